@@ -0,0 +1,188 @@
+// Benchmark of the many-to-many distance tables of RoadRouter against one
+// contraction hierarchy query per pair and one Dijkstra per source, on a
+// synthetic metro-sized road graph.
+//
+// Usage: bench_distance_table [blocks_per_side] [num_sources] [num_targets]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "parallel.h"
+#include "road_router.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Manhattan street grid with one intersection every 100 m and a shape point
+// every 25 m in between, like the OSM ways. 5% of the blocks have no street,
+// 20% of the streets are one-way and lengths vary by up to 10%.
+static void generateGraph(size_t blocks, graph_t& graph) {
+    const int SHAPE_POINTS = 3;
+    const float BLOCK = 100.0f;
+    mt19937 rng(42);
+    uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    size_t side = blocks + 1;
+    vector<GraphNode> vertices(side * side);
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        vertices[i].easting = (i % side) * BLOCK;
+        vertices[i].northing = (i / side) * BLOCK;
+    }
+    vector<uint32_t> sources, targets;
+    vector<GraphEdge> edges;
+    auto add_edge = [&](uint32_t u, uint32_t v, float length) {
+        GraphEdge edge;
+        edge.length = length;
+        sources.push_back(u);
+        targets.push_back(v);
+        edges.push_back(edge);
+    };
+    auto add_street = [&](uint32_t a, uint32_t b) {
+        if (unit(rng) < 0.05f) return;
+        bool one_way = unit(rng) < 0.2f;
+        float stretch = 1.0f + 0.1f * unit(rng);
+        uint32_t prev = a;
+        for (int k = 1; k <= SHAPE_POINTS + 1; ++k) {
+            uint32_t next = b;
+            if (k <= SHAPE_POINTS) {
+                float f = static_cast<float>(k) / (SHAPE_POINTS + 1);
+                GraphNode shape_point;
+                shape_point.easting = vertices[a].easting +
+                                      f * (vertices[b].easting -
+                                           vertices[a].easting);
+                shape_point.northing = vertices[a].northing +
+                                       f * (vertices[b].northing -
+                                            vertices[a].northing);
+                next = static_cast<uint32_t>(vertices.size());
+                vertices.push_back(shape_point);
+            }
+            float length = stretch * BLOCK / (SHAPE_POINTS + 1);
+            add_edge(prev, next, length);
+            if (!one_way) add_edge(next, prev, length);
+            prev = next;
+        }
+    };
+    for (size_t y = 0; y < side; ++y) {
+        for (size_t x = 0; x < side; ++x) {
+            uint32_t v = static_cast<uint32_t>(y * side + x);
+            if (x + 1 < side) add_street(v, v + 1);
+            if (y + 1 < side) add_street(v, v + side);
+        }
+    }
+    graph.build(vertices, sources, targets, edges);
+}
+
+// Distances from one vertex to every vertex
+static void dijkstra(const graph_t& graph, uint32_t source,
+                     vector<float>& dist) {
+    typedef pair<float, uint32_t> Entry;
+    dist.assign(graph.numVertices(), numeric_limits<float>::infinity());
+    priority_queue<Entry, vector<Entry>, greater<Entry>> heap;
+    dist[source] = 0.0f;
+    heap.push(Entry(0.0f, source));
+    while (!heap.empty()) {
+        Entry top = heap.top();
+        heap.pop();
+        uint32_t u = top.second;
+        if (top.first > dist[u]) continue;
+        for (uint32_t e = graph.outBegin(u); e < graph.outEnd(u); ++e) {
+            uint32_t v = graph.target(e);
+            float dv = top.first + graph.edgeProperties()[e].length;
+            if (dv < dist[v]) {
+                dist[v] = dv;
+                heap.push(Entry(dv, v));
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t blocks = argc > 1 ? strtoul(argv[1], NULL, 10) : 150;
+    size_t num_sources = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+    size_t num_targets = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000;
+    const size_t NUM_PAIR_QUERIES = 10000;
+    const size_t NUM_DIJKSTRAS = 10;
+    const float RADIUS = 3000.0f;
+
+    graph_t graph;
+    generateGraph(blocks, graph);
+    printf("%.1f km x %.1f km grid: %zu vertices, %zu edges, %zu threads\n",
+           blocks * 0.1, blocks * 0.1, graph.numVertices(),
+           graph.numEdges(), numWorkerThreads());
+
+    Clock::time_point start = Clock::now();
+    RoadRouter router;
+    router.build(graph);
+    printf("%-22s %10.3f s\n", "contraction", secondsSince(start));
+
+    mt19937 rng(7);
+    uniform_int_distribution<uint32_t> pick(0, graph.numVertices() - 1);
+    vector<vector<RouteEndpoint>> sources(num_sources), targets(num_targets);
+    for (auto& source : sources) source.push_back(RouteEndpoint(pick(rng), 0));
+    for (auto& target : targets) target.push_back(RouteEndpoint(pick(rng), 0));
+    double num_pairs = static_cast<double>(num_sources) * num_targets;
+
+    DistanceTable table;
+    start = Clock::now();
+    router.distanceTable(sources, targets, table);
+    double seconds = secondsSince(start);
+    printf("%-22s %10.3f s (%7.3f us / pair)\n", "bucket table", seconds,
+           1e6 * seconds / num_pairs);
+
+    vector<DistanceEntry> entries;
+    start = Clock::now();
+    router.sparseDistanceTable(sources, targets, RADIUS, entries);
+    seconds = secondsSince(start);
+    printf("%-22s %10.3f s (%7.3f us / pair)   %zu pairs within %.0f m\n",
+           "bucket table, bounded", seconds, 1e6 * seconds / num_pairs,
+           entries.size(), RADIUS);
+
+    // Baselines on samples, extrapolated to the whole table
+    RouteWorkspace workspace;
+    size_t num_queries = min<size_t>(NUM_PAIR_QUERIES, num_pairs);
+    double max_error = 0.0;
+    start = Clock::now();
+    for (size_t q = 0; q < num_queries; ++q) {
+        size_t i = q % num_sources, j = (q / num_sources + q) % num_targets;
+        float d = router.distance(sources[i], targets[j], workspace);
+        if (!std::isinf(d)) {
+            max_error = max<double>(max_error, fabs(d - table.at(i, j)));
+        }
+    }
+    seconds = secondsSince(start) * num_pairs / num_queries;
+    printf("%-22s %10.3f s (%7.3f us / pair, extrapolated)\n",
+           "query per pair", seconds, 1e6 * seconds / num_pairs);
+
+    vector<float> dist;
+    size_t num_dijkstras = min(NUM_DIJKSTRAS, num_sources);
+    start = Clock::now();
+    for (size_t i = 0; i < num_dijkstras; ++i) {
+        dijkstra(graph, sources[i][0].vertex, dist);
+        for (size_t j = 0; j < num_targets; ++j) {
+            float d = dist[targets[j][0].vertex];
+            if (std::isinf(d) != std::isinf(table.at(i, j))) {
+                max_error = numeric_limits<double>::infinity();
+            } else if (!std::isinf(d)) {
+                max_error = max<double>(max_error, fabs(d - table.at(i, j)));
+            }
+        }
+    }
+    seconds = secondsSince(start) * num_sources / num_dijkstras;
+    printf("%-22s %10.3f s (%7.3f us / pair, extrapolated)\n",
+           "Dijkstra per source", seconds, 1e6 * seconds / num_pairs);
+    printf("max difference to the baselines: %g m\n", max_error);
+    return 0;
+}
@@ -0,0 +1,108 @@
+// Benchmark of the 2D point indices (kd-tree, uniform grid) on synthetic
+// dense urban GPS data.
+//
+// Usage: bench_point_index [num_points] [radius] [num_queries]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "point_index.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// GPS samples along a Manhattan street grid: 10 km x 10 km, one street every
+// 100 m, 5 m of noise. Positions are fixed-point centimeters around a UTM
+// origin, like the Trajectories columns.
+static void generatePoints(size_t n, vector<int32_t>& x, vector<int32_t>& y) {
+    mt19937 rng(42);
+    uniform_real_distribution<double> along(0.0, 10000.0);
+    uniform_int_distribution<int> street(0, 100);
+    normal_distribution<double> noise(0.0, 5.0);
+    x.resize(n);
+    y.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        double a = along(rng);
+        double b = street(rng) * 100.0 + noise(rng);
+        bool vertical = i % 2 == 0;
+        x[i] = static_cast<int32_t>((vertical ? b : a) * 100.0);
+        y[i] = static_cast<int32_t>((vertical ? a : b) * 100.0);
+    }
+}
+
+struct Result {
+    double buildSeconds;
+    double querySeconds;
+    size_t found;
+};
+
+template <class Index>
+static Result runIndex(Index& index, const PointSpans<int32_t>& points,
+                       const vector<size_t>& queries, double radius) {
+    Result result;
+    Clock::time_point start = Clock::now();
+    index.build(points);
+    result.buildSeconds = secondsSince(start);
+
+    vector<uint32_t> indices;
+    vector<double> sqr_distances;
+    result.found = 0;
+    start = Clock::now();
+    for (size_t q : queries) {
+        result.found += index.radiusSearch(points.coord(q, 0),
+                                           points.coord(q, 1), radius, indices,
+                                           sqr_distances);
+    }
+    result.querySeconds = secondsSince(start);
+    return result;
+}
+
+static void printResult(const char* name, const Result& result,
+                        size_t num_queries) {
+    printf("%-14s build %8.3f s   query %8.3f s (%7.2f us / query)   "
+           "%zu neighbors\n",
+           name, result.buildSeconds, result.querySeconds,
+           1e6 * result.querySeconds / num_queries, result.found);
+}
+
+int main(int argc, char** argv) {
+    size_t num_points = argc > 1 ? strtoul(argv[1], NULL, 10) : 4000000;
+    double radius = argc > 2 ? atof(argv[2]) : 25.0;
+    size_t num_queries = argc > 3 ? strtoul(argv[3], NULL, 10) : 200000;
+
+    printf("%zu points, %zu radius queries of %.1f m, %zu threads\n",
+           num_points, num_queries, radius, numWorkerThreads());
+
+    vector<int32_t> x, y;
+    generatePoints(num_points, x, y);
+    PointSpans<int32_t> points(x.data(), y.data(), num_points, 0.01,
+                               500000.0, 4400000.0);
+
+    // Queries at data points, as when matching trajectories
+    mt19937 rng(7);
+    uniform_int_distribution<size_t> pick(0, num_points - 1);
+    vector<size_t> queries(num_queries);
+    for (size_t& q : queries) q = pick(rng);
+
+    PointIndex<PointSpans<int32_t>> kdtree;
+    kdtree.setBackend(SearchBackend::KdTree);
+    printResult("kd-tree", runIndex(kdtree, points, queries, radius),
+                num_queries);
+
+    PointIndex<PointSpans<int32_t>> grid;
+    GridIndexParams grid_params;
+    grid_params.cellSize = radius;
+    grid.grid().setParams(grid_params);
+    grid.setBackend(SearchBackend::UniformGrid);
+    printResult("uniform grid", runIndex(grid, points, queries, radius),
+                num_queries);
+    return 0;
+}
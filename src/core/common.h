@@ -11,11 +11,11 @@
 
 // Boost Graph
 #include <boost/graph/graph_traits.hpp>
-#include <boost/graph/adjacency_list.hpp>
 #include <boost/property_map/property_map.hpp>
 #include <Eigen/Dense>
 #include "color.h"
 #include "headers.h"
+#include "road_graph.h"
 
 using namespace std;
 
@@ -39,9 +39,8 @@ struct GraphEdge {
     int type = 0;
 };
 
-// Using bidirectionalS because it's easier to get in-edges
-typedef boost::adjacency_list<boost::vecS, boost::vecS, boost::bidirectionalS,
-                              GraphNode, GraphEdge> graph_t;
+// Compact CSR graph with in-edges, built in bulk (see road_graph.h)
+typedef RoadGraph<GraphNode, GraphEdge> graph_t;
 typedef boost::graph_traits<graph_t>::vertex_descriptor graph_vertex_descriptor;
 typedef boost::graph_traits<graph_t>::edge_descriptor graph_edge_descriptor;
 
@@ -0,0 +1,521 @@
+/*=====================================================================================
+                                grid_index.h
+
+    Description:  Uniform grid point index with cells in Hilbert order
+
+        Points are bucketed into square cells. Point ids are sorted by the
+        Hilbert index of their cell, so that the points of a cell, and of
+        nearby cells, are contiguous in memory. Building is a parallel radix
+        sort of the cell keys, O(n). For the short fixed-radius queries on
+        dense data it replaces the kd-tree traversal by a scan of a few cells.
+
+        Same dataset adaptors and query semantics as KdTree (see kdtree.h).
+=====================================================================================*/
+
+#ifndef GRID_INDEX_H_
+#define GRID_INDEX_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "index_file.h"
+#include "neighborhoods.h"
+#include "parallel.h"
+#include "radix_sort.h"
+
+using namespace std;
+
+struct GridIndexParams {
+    GridIndexParams() : cellSize(25.0f), buildThreads(0), sorted(false) {}
+
+    float cellSize;       // in meters, close to the typical query radius
+    size_t buildThreads;  // 0: numWorkerThreads()
+    bool sorted;          // sort radiusSearch results by distance
+};
+
+// Index of cell (x, y) along the Hilbert curve filling a 2^order square
+inline uint32_t hilbertIndex(int order, uint32_t x, uint32_t y) {
+    uint32_t d = 0;
+    for (uint32_t s = uint32_t(1) << (order - 1); s > 0; s >>= 1) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        // Rotate the quadrant
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+template <class Dataset>
+class GridIndex {
+public:
+    explicit GridIndex(const GridIndexParams& params = GridIndexParams())
+        : m_params(params),
+          m_minX(0.0),
+          m_minY(0.0),
+          m_cellSize(0.0),
+          m_numCellsX(0),
+          m_numCellsY(0),
+          m_fileIndexData(nullptr),
+          m_fileCellData(nullptr),
+          m_numIndices(0) {}
+
+    void setParams(const GridIndexParams& params) { m_params = params; }
+    const GridIndexParams& params() const { return m_params; }
+
+    void build(const Dataset& dataset);
+    void clear() {
+        m_dataset = Dataset();
+        vector<uint32_t>().swap(m_indices);
+        vector<CellRange>().swap(m_cells);
+        m_numCellsX = m_numCellsY = 0;
+        m_file.reset();
+        m_fileIndexData = nullptr;
+        m_fileCellData = nullptr;
+        m_numIndices = 0;
+    }
+
+    // Same as KdTree::save() / KdTree::load()
+    bool save(const string& filename, IndexFileKey key) const;
+    bool load(const string& filename, const Dataset& dataset,
+              IndexFileKey key);
+
+    size_t size() const { return m_numIndices; }
+    bool empty() const { return m_numIndices == 0; }
+    const Dataset& dataset() const { return m_dataset; }
+
+    // Actual cell size, larger than the requested one if the grid would have
+    // had too many cells
+    double cellSize() const { return m_cellSize; }
+
+    size_t radiusSearch(double x, double y, double radius,
+                        vector<uint32_t>& indices,
+                        vector<double>& sqr_distances,
+                        size_t max_nn = 0) const;
+    size_t nearestKSearch(double x, double y, size_t k,
+                          vector<uint32_t>& indices,
+                          vector<double>& sqr_distances) const;
+    size_t radiusSearch(double x, double y, double radius,
+                        NeighborList& neighbors, size_t max_nn = 0) const;
+    size_t nearestKSearch(double x, double y, size_t k,
+                          NeighborList& neighbors) const;
+    size_t boxSearch(double min_x, double max_x, double min_y, double max_y,
+                     vector<uint32_t>& indices) const;
+
+private:
+    // Range of a cell in m_indices
+    struct CellRange {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    // Geometry section of an index file
+    struct GridGeometry {
+        double minX;
+        double minY;
+        double cellSize;
+        uint64_t numCellsX;
+        uint64_t numCellsY;
+    };
+
+    // At most this many cells per point: sparse data gets larger cells
+    static const size_t MAX_CELLS_PER_POINT = 4;
+    // Type of the index in IndexFileKey
+    static const uint32_t INDEX_FILE_TYPE = 2;
+
+    // Cell column / row of a coordinate, clamped to the grid
+    long cellX(double x) const {
+        return clampCell(std::floor((x - m_minX) / m_cellSize), m_numCellsX);
+    }
+    long cellY(double y) const {
+        return clampCell(std::floor((y - m_minY) / m_cellSize), m_numCellsY);
+    }
+    static long clampCell(double c, size_t num_cells) {
+        if (!(c > 0.0)) return 0;
+        if (c >= static_cast<double>(num_cells)) return num_cells - 1;
+        return static_cast<long>(c);
+    }
+
+    static bool validCells(const CellRange* cells, size_t num_cells,
+                           const uint32_t* indices, size_t n);
+
+    const CellRange& cell(long cx, long cy) const {
+        return cellData()[cy * m_numCellsX + cx];
+    }
+    double sqrDistance(size_t i, double x, double y) const {
+        double dx = m_dataset.coord(i, 0) - x;
+        double dy = m_dataset.coord(i, 1) - y;
+        return dx * dx + dy * dy;
+    }
+
+    GridIndexParams m_params;
+    Dataset m_dataset;
+    double m_minX;
+    double m_minY;
+    double m_cellSize;
+    size_t m_numCellsX;
+    size_t m_numCellsY;
+    vector<uint32_t> m_indices;  // point ids sorted by Hilbert cell index
+    vector<CellRange> m_cells;   // row-major
+
+    // Same as in KdTree
+    shared_ptr<MappedFile> m_file;
+    const uint32_t* m_fileIndexData;
+    const CellRange* m_fileCellData;
+    const uint32_t* indexData() const {
+        return m_file ? m_fileIndexData : m_indices.data();
+    }
+    const CellRange* cellData() const {
+        return m_file ? m_fileCellData : m_cells.data();
+    }
+    size_t m_numIndices;
+};
+
+template <class Dataset>
+void GridIndex<Dataset>::build(const Dataset& dataset) {
+    clear();
+    m_dataset = dataset;
+    size_t n = dataset.size();
+    if (n == 0) return;
+    if (n > numeric_limits<uint32_t>::max()) {
+        fprintf(stderr,
+                "ERROR: more than 2^32 points, cannot build the grid index.\n");
+        return;
+    }
+    size_t num_threads = m_params.buildThreads > 0 ? m_params.buildThreads
+                                                   : numWorkerThreads();
+
+    // Bounding box
+    vector<double> thread_box(4 * num_threads);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t tid) {
+        double box[4] = {numeric_limits<double>::max(),
+                         -numeric_limits<double>::max(),
+                         numeric_limits<double>::max(),
+                         -numeric_limits<double>::max()};
+        for (size_t i = begin; i < end; ++i) {
+            double x = dataset.coord(i, 0);
+            double y = dataset.coord(i, 1);
+            box[0] = std::min(box[0], x);
+            box[1] = std::max(box[1], x);
+            box[2] = std::min(box[2], y);
+            box[3] = std::max(box[3], y);
+        }
+        std::copy(box, box + 4, thread_box.begin() + 4 * tid);
+    });
+    double min_x = numeric_limits<double>::max(), max_x = -min_x;
+    double min_y = min_x, max_y = -min_x;
+    for (size_t t = 0; t < num_threads; ++t) {
+        min_x = std::min(min_x, thread_box[4 * t]);
+        max_x = std::max(max_x, thread_box[4 * t + 1]);
+        min_y = std::min(min_y, thread_box[4 * t + 2]);
+        max_y = std::max(max_y, thread_box[4 * t + 3]);
+    }
+
+    // Grid of at most MAX_CELLS_PER_POINT * n cells, and at most 2^16 cells
+    // per side so that Hilbert indices fit in 32 bits
+    const double MAX_CELLS_PER_SIDE = 65536.0;
+    m_minX = min_x;
+    m_minY = min_y;
+    m_cellSize = std::max<double>(m_params.cellSize, 1e-3);
+    double extent = std::max(max_x - min_x, max_y - min_y);
+    m_cellSize = std::max(m_cellSize, extent / (MAX_CELLS_PER_SIDE - 1));
+    double max_cells = static_cast<double>(MAX_CELLS_PER_POINT * n);
+    double area = (max_x - min_x + m_cellSize) * (max_y - min_y + m_cellSize);
+    if (area / (m_cellSize * m_cellSize) > max_cells) {
+        m_cellSize = std::sqrt(area / max_cells);
+    }
+    m_numCellsX = static_cast<size_t>((max_x - min_x) / m_cellSize) + 1;
+    m_numCellsY = static_cast<size_t>((max_y - min_y) / m_cellSize) + 1;
+    m_numCellsX = std::min<size_t>(m_numCellsX, MAX_CELLS_PER_SIDE);
+    m_numCellsY = std::min<size_t>(m_numCellsY, MAX_CELLS_PER_SIDE);
+
+    int order = 1;
+    while ((size_t(1) << order) < std::max(m_numCellsX, m_numCellsY)) {
+        ++order;
+    }
+
+    // Hilbert key and row-major cell of every point
+    vector<uint32_t> keys(n);
+    vector<uint32_t> point_cell(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            long cx = cellX(dataset.coord(i, 0));
+            long cy = cellY(dataset.coord(i, 1));
+            keys[i] = hilbertIndex(order, cx, cy);
+            point_cell[i] = static_cast<uint32_t>(cy * m_numCellsX + cx);
+        }
+    });
+    sortIndicesByKey(keys.data(), n, m_indices);
+
+    // Each cell is a run of equal keys in the sorted ids
+    CellRange empty_cell = {0, 0};
+    m_cells.assign(m_numCellsX * m_numCellsY, empty_cell);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t p = begin; p < end; ++p) {
+            uint32_t key = keys[m_indices[p]];
+            CellRange& range = m_cells[point_cell[m_indices[p]]];
+            if (p == 0 || keys[m_indices[p - 1]] != key) {
+                range.begin = static_cast<uint32_t>(p);
+            }
+            if (p + 1 == n || keys[m_indices[p + 1]] != key) {
+                range.end = static_cast<uint32_t>(p + 1);
+            }
+        }
+    });
+
+    m_numIndices = n;
+}
+
+template <class Dataset>
+bool GridIndex<Dataset>::save(const string& filename, IndexFileKey key) const {
+    key.type = INDEX_FILE_TYPE;
+    key.numPoints = m_numIndices;
+    GridGeometry geometry = {m_minX, m_minY, m_cellSize, m_numCellsX,
+                             m_numCellsY};
+    vector<IndexSection> sections;
+    sections.push_back(IndexSection(&geometry, sizeof(GridGeometry)));
+    sections.push_back(
+        IndexSection(indexData(), m_numIndices * sizeof(uint32_t)));
+    sections.push_back(IndexSection(
+        cellData(), m_numCellsX * m_numCellsY * sizeof(CellRange)));
+    return writeIndexFile(filename, key, sections);
+}
+
+template <class Dataset>
+bool GridIndex<Dataset>::load(const string& filename, const Dataset& dataset,
+                              IndexFileKey key) {
+    key.type = INDEX_FILE_TYPE;
+    key.numPoints = dataset.size();
+    vector<IndexSection> sections;
+    shared_ptr<MappedFile> file = openIndexFile(filename, key, 3, sections);
+    if (!file) return false;
+
+    size_t n = dataset.size();
+    GridGeometry geometry;
+    bool valid = sections[0].bytes == sizeof(GridGeometry);
+    if (valid) {
+        memcpy(&geometry, sections[0].data, sizeof(GridGeometry));
+        size_t num_cells = sections[2].bytes / sizeof(CellRange);
+        valid = sections[1].bytes == n * sizeof(uint32_t) &&
+                geometry.cellSize > 0.0 &&
+                sections[2].bytes % sizeof(CellRange) == 0 &&
+                (n == 0 || num_cells > 0) &&
+                geometry.numCellsX * geometry.numCellsY == num_cells &&
+                // The product must not have wrapped around
+                (num_cells == 0 ||
+                 num_cells / geometry.numCellsX == geometry.numCellsY) &&
+                validCells(static_cast<const CellRange*>(sections[2].data),
+                           num_cells,
+                           static_cast<const uint32_t*>(sections[1].data), n);
+    }
+    if (!valid) {
+        fprintf(stderr, "ERROR: grid index file %s is corrupted.\n",
+                filename.c_str());
+        return false;
+    }
+
+    clear();
+    m_dataset = dataset;
+    m_file = file;
+    m_minX = geometry.minX;
+    m_minY = geometry.minY;
+    m_cellSize = geometry.cellSize;
+    m_numCellsX = geometry.numCellsX;
+    m_numCellsY = geometry.numCellsY;
+    m_fileIndexData = static_cast<const uint32_t*>(sections[1].data);
+    m_fileCellData = static_cast<const CellRange*>(sections[2].data);
+    m_numIndices = n;
+    return true;
+}
+
+// Whether the searches of a mapped grid stay inside its sections: cell ranges
+// and point ids within n
+template <class Dataset>
+bool GridIndex<Dataset>::validCells(const CellRange* cells, size_t num_cells,
+                                    const uint32_t* indices, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (indices[i] >= n) return false;
+    }
+    for (size_t c = 0; c < num_cells; ++c) {
+        if (cells[c].begin > cells[c].end || cells[c].end > n) return false;
+    }
+    return true;
+}
+
+template <class Dataset>
+size_t GridIndex<Dataset>::radiusSearch(double x, double y, double radius,
+                                        vector<uint32_t>& indices,
+                                        vector<double>& sqr_distances,
+                                        size_t max_nn) const {
+    NeighborList neighbors;
+    radiusSearch(x, y, radius, neighbors, max_nn);
+    splitNeighbors(neighbors, indices, sqr_distances);
+    return neighbors.size();
+}
+
+template <class Dataset>
+size_t GridIndex<Dataset>::radiusSearch(double x, double y, double radius,
+                                        NeighborList& result,
+                                        size_t max_nn) const {
+    result.clear();
+    if (m_numIndices == 0) return 0;
+
+    double sqr_radius = radius * radius;
+    long cx0 = cellX(x - radius), cx1 = cellX(x + radius);
+    long cy0 = cellY(y - radius), cy1 = cellY(y + radius);
+    bool full = false;
+    for (long cy = cy0; cy <= cy1 && !full; ++cy) {
+        double dy = std::max(0.0, std::max(m_minY + cy * m_cellSize - y,
+                                           y - m_minY - (cy + 1) * m_cellSize));
+        for (long cx = cx0; cx <= cx1 && !full; ++cx) {
+            // Skip the corner cells out of reach
+            double dx =
+                std::max(0.0, std::max(m_minX + cx * m_cellSize - x,
+                                       x - m_minX - (cx + 1) * m_cellSize));
+            if (dx * dx + dy * dy >= sqr_radius) continue;
+
+            const CellRange& range = cell(cx, cy);
+            for (uint32_t p = range.begin; p < range.end; ++p) {
+                double sqr_dist = sqrDistance(indexData()[p], x, y);
+                if (sqr_dist < sqr_radius) {
+                    result.push_back(Neighbor(sqr_dist, indexData()[p]));
+                    if (max_nn > 0 && result.size() >= max_nn) {
+                        full = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    if (m_params.sorted) {
+        std::sort(result.begin(), result.end());
+    }
+    return result.size();
+}
+
+template <class Dataset>
+size_t GridIndex<Dataset>::nearestKSearch(double x, double y, size_t k,
+                                          vector<uint32_t>& indices,
+                                          vector<double>& sqr_distances) const {
+    NeighborList neighbors;
+    nearestKSearch(x, y, k, neighbors);
+    splitNeighbors(neighbors, indices, sqr_distances);
+    return neighbors.size();
+}
+
+template <class Dataset>
+size_t GridIndex<Dataset>::nearestKSearch(double x, double y, size_t k,
+                                          NeighborList& heap) const {
+    heap.clear();
+    if (m_numIndices == 0 || k == 0) return 0;
+
+    // Scan square rings of cells around the query until the k-th candidate
+    // is closer than any cell not scanned yet
+    auto scan_cell = [&](long cx, long cy) {
+        const CellRange& range = cell(cx, cy);
+        for (uint32_t p = range.begin; p < range.end; ++p) {
+            pushNeighbor(heap, k,
+                         Neighbor(sqrDistance(indexData()[p], x, y),
+                                  indexData()[p]));
+        }
+    };
+
+    long qx = cellX(x), qy = cellY(y);
+    long num_x = m_numCellsX, num_y = m_numCellsY;
+    long max_ring = std::max(std::max(qx, num_x - 1 - qx),
+                             std::max(qy, num_y - 1 - qy));
+    for (long ring = 0; ring <= max_ring; ++ring) {
+        long cx0 = qx - ring, cx1 = qx + ring;
+        long cy0 = qy - ring, cy1 = qy + ring;
+        for (long cy = std::max(cy0, 0L); cy <= std::min(cy1, num_y - 1);
+             ++cy) {
+            if (cy == cy0 || cy == cy1) {
+                for (long cx = std::max(cx0, 0L);
+                     cx <= std::min(cx1, num_x - 1); ++cx) {
+                    scan_cell(cx, cy);
+                }
+            } else {
+                if (cx0 >= 0) scan_cell(cx0, cy);
+                if (cx1 < num_x && cx1 != cx0) scan_cell(cx1, cy);
+            }
+        }
+
+        if (heap.size() == k) {
+            // Cells not scanned yet lie inside the grid, past a side of the
+            // square that does not reach the grid border. A query outside
+            // the grid is at least dx_out / dy_out from any of them.
+            double dx_out = std::max(
+                0.0, std::max(m_minX - x, x - (m_minX + num_x * m_cellSize)));
+            double dy_out = std::max(
+                0.0, std::max(m_minY - y, y - (m_minY + num_y * m_cellSize)));
+            double bound = numeric_limits<double>::infinity();
+            if (cx0 > 0) {
+                double d = x - (m_minX + cx0 * m_cellSize);
+                bound = std::min(bound, d * d + dy_out * dy_out);
+            }
+            if (cx1 < num_x - 1) {
+                double d = m_minX + (cx1 + 1) * m_cellSize - x;
+                bound = std::min(bound, d * d + dy_out * dy_out);
+            }
+            if (cy0 > 0) {
+                double d = y - (m_minY + cy0 * m_cellSize);
+                bound = std::min(bound, d * d + dx_out * dx_out);
+            }
+            if (cy1 < num_y - 1) {
+                double d = m_minY + (cy1 + 1) * m_cellSize - y;
+                bound = std::min(bound, d * d + dx_out * dx_out);
+            }
+            if (heap.front().first <= bound) break;
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end());
+    return heap.size();
+}
+
+template <class Dataset>
+size_t GridIndex<Dataset>::boxSearch(double min_x, double max_x, double min_y,
+                                     double max_y,
+                                     vector<uint32_t>& indices) const {
+    indices.clear();
+    if (m_numIndices == 0 || min_x > max_x || min_y > max_y) return 0;
+
+    long cx0 = cellX(min_x), cx1 = cellX(max_x);
+    long cy0 = cellY(min_y), cy1 = cellY(max_y);
+    for (long cy = cy0; cy <= cy1; ++cy) {
+        for (long cx = cx0; cx <= cx1; ++cx) {
+            const CellRange& range = cell(cx, cy);
+            for (uint32_t p = range.begin; p < range.end; ++p) {
+                uint32_t pt_idx = indexData()[p];
+                double px = m_dataset.coord(pt_idx, 0);
+                double py = m_dataset.coord(pt_idx, 1);
+                if (px >= min_x && px <= max_x && py >= min_y && py <= max_y) {
+                    indices.push_back(pt_idx);
+                }
+            }
+        }
+    }
+    return indices.size();
+}
+
+template <class Dataset>
+const size_t GridIndex<Dataset>::MAX_CELLS_PER_POINT;
+template <class Dataset>
+const uint32_t GridIndex<Dataset>::INDEX_FILE_TYPE;
+
+#endif /* end of include guard: GRID_INDEX_H_ */
@@ -0,0 +1,97 @@
+#include "heading_index.h"
+
+#include <cmath>
+
+// Heading in [0, 360)
+static float normalizeHeading(float heading) {
+    float h = std::fmod(heading, 360.0f);
+    return h < 0.0f ? h + 360.0f : h;
+}
+
+// Absolute difference of two headings, in [0, 180]
+static float headingDifference(float h1, float h2) {
+    float delta = std::fabs(normalizeHeading(h1) - normalizeHeading(h2));
+    return delta > 180.0f ? 360.0f - delta : delta;
+}
+
+int HeadingIndex::headingBin(float heading) {
+    int bin = static_cast<int>(normalizeHeading(heading) / BIN_DEGREES);
+    return bin < NUM_BINS ? bin : NUM_BINS - 1;
+}
+
+void HeadingIndex::clear() {
+    m_points = PointSpans<float>();
+    m_headings = nullptr;
+    vector<uint32_t>().swap(m_binIds);
+    vector<size_t>().swap(m_binOffsets);
+    for (int b = 0; b < NUM_BINS; ++b) {
+        m_trees[b].clear();
+    }
+}
+
+void HeadingIndex::build(const PointSpans<float>& points,
+                         const int* headings) {
+    clear();
+    size_t n = points.size();
+    if (n == 0) return;
+    m_points = points;
+    m_headings = headings;
+
+    // Counting sort of the point ids by bin
+    m_binOffsets.assign(NUM_BINS + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+        ++m_binOffsets[headingBin(headings[i]) + 1];
+    }
+    for (int b = 0; b < NUM_BINS; ++b) {
+        m_binOffsets[b + 1] += m_binOffsets[b];
+    }
+    m_binIds.resize(n);
+    vector<size_t> fill(m_binOffsets.begin(), m_binOffsets.end() - 1);
+    for (size_t i = 0; i < n; ++i) {
+        m_binIds[fill[headingBin(headings[i])]++] = static_cast<uint32_t>(i);
+    }
+
+    for (int b = 0; b < NUM_BINS; ++b) {
+        m_trees[b].build(BinPoints(points, m_binIds.data() + m_binOffsets[b],
+                                   m_binOffsets[b + 1] - m_binOffsets[b]));
+    }
+}
+
+bool HeadingIndex::nearest(double x, double y, float heading, float max_angle,
+                           double radius, uint32_t& point) const {
+    if (m_binIds.empty() || max_angle < 0.0f) return false;
+
+    double best_sqr_dist = radius * radius;
+    bool found = false;
+    NeighborList neighbors;
+    for (int b = 0; b < NUM_BINS; ++b) {
+        // Skip the bins entirely out of the tolerance
+        float bin_center = (b + 0.5f) * BIN_DEGREES;
+        float bin_gap = headingDifference(heading, bin_center) -
+                        0.5f * BIN_DEGREES;
+        if (bin_gap > max_angle) continue;
+        // Points of inner bins are all within the tolerance
+        bool check_heading =
+            headingDifference(heading, bin_center) + 0.5f * BIN_DEGREES >
+            max_angle;
+
+        // Nothing farther than the best point so far
+        m_trees[b].radiusSearch(x, y, std::sqrt(best_sqr_dist), neighbors);
+        const uint32_t* ids = m_binIds.data() + m_binOffsets[b];
+        for (const Neighbor& neighbor : neighbors) {
+            uint32_t pt_idx = ids[neighbor.second];
+            if (neighbor.first >= best_sqr_dist) continue;
+            if (check_heading &&
+                headingDifference(heading, m_headings[pt_idx]) > max_angle) {
+                continue;
+            }
+            best_sqr_dist = neighbor.first;
+            point = pt_idx;
+            found = true;
+        }
+    }
+    return found;
+}
+
+const int HeadingIndex::NUM_BINS;
+const float HeadingIndex::BIN_DEGREES = 360.0f / HeadingIndex::NUM_BINS;
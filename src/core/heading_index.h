@@ -0,0 +1,71 @@
+/*=====================================================================================
+                                heading_index.h
+
+    Description:  Point index keyed on position and heading
+
+        Points are split into NUM_BINS heading bins of equal width, each with
+        its own kd-tree. A nearest query with a heading tolerance only
+        searches the bins within the tolerance, so points going the other way
+        (the opposite side of a two-way road) are never fetched, and checks the
+        exact heading of the candidates in the bins at the boundary.
+=====================================================================================*/
+
+#ifndef HEADING_INDEX_H_
+#define HEADING_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kdtree.h"
+
+using namespace std;
+
+class HeadingIndex {
+public:
+    HeadingIndex() : m_headings(nullptr) {}
+
+    // headings in degrees, one per point. The columns are read in place and
+    // must outlive the index.
+    void build(const PointSpans<float>& points, const int* headings);
+    void clear();
+
+    size_t size() const { return m_binIds.size(); }
+    bool empty() const { return m_binIds.empty(); }
+
+    // Nearest point closer than radius whose heading differs from heading by
+    // at most max_angle degrees. Returns false if there is none.
+    bool nearest(double x, double y, float heading, float max_angle,
+                 double radius, uint32_t& point) const;
+
+private:
+    static const int NUM_BINS = 12;
+    static const float BIN_DEGREES;  // 30
+
+    static int headingBin(float heading);
+
+    // Dataset adaptor over the points of one bin
+    struct BinPoints {
+        BinPoints() : ids(nullptr), n(0) {}
+        BinPoints(const PointSpans<float>& all_points, const uint32_t* bin_ids,
+                  size_t num_points)
+            : points(all_points), ids(bin_ids), n(num_points) {}
+
+        size_t size() const { return n; }
+        double coord(size_t i, int dim) const {
+            return points.coord(ids[i], dim);
+        }
+
+        PointSpans<float> points;
+        const uint32_t* ids;
+        size_t n;
+    };
+
+    PointSpans<float> m_points;
+    const int* m_headings;
+    vector<uint32_t> m_binIds;      // point ids grouped by bin
+    vector<size_t> m_binOffsets;    // range of each bin in m_binIds
+    KdTree<BinPoints> m_trees[NUM_BINS];
+};
+
+#endif /* end of include guard: HEADING_INDEX_H_ */
@@ -0,0 +1,120 @@
+#include "index_file.h"
+
+#include <cstdio>
+#include <cstring>
+
+static const char INDEX_FILE_MAGIC[8] = {'S', 'P', 'I', 'N',
+                                        'D', 'E', 'X', '1'};
+static const uint32_t INDEX_FILE_VERSION = 2;
+static const size_t INDEX_FILE_ALIGNMENT = 64;
+static const size_t MAX_INDEX_SECTIONS = 8;
+
+struct IndexFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numSections;
+    IndexFileKey key;
+    uint64_t sectionOffset[MAX_INDEX_SECTIONS];
+    uint64_t sectionBytes[MAX_INDEX_SECTIONS];
+};
+
+bool IndexFileKey::operator==(const IndexFileKey& other) const {
+    if (sourceSize != other.sourceSize || sourceMtime != other.sourceMtime ||
+        numPoints != other.numPoints || type != other.type) {
+        return false;
+    }
+    for (int i = 0; i < NUM_PARAMS; ++i) {
+        if (params[i] != other.params[i]) return false;
+    }
+    return true;
+}
+
+bool writeIndexFile(const string& filename, const IndexFileKey& key,
+                    const vector<IndexSection>& sections) {
+    if (sections.size() > MAX_INDEX_SECTIONS) return false;
+
+    IndexFileHeader header;
+    memset(static_cast<void*>(&header), 0, sizeof(IndexFileHeader));
+    memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.version = INDEX_FILE_VERSION;
+    header.numSections = sections.size();
+    header.key = key;
+
+    // Section offsets are known up front
+    uint64_t offset = sizeof(IndexFileHeader);
+    for (size_t i = 0; i < sections.size(); ++i) {
+        offset += (INDEX_FILE_ALIGNMENT - offset % INDEX_FILE_ALIGNMENT) %
+                  INDEX_FILE_ALIGNMENT;
+        header.sectionOffset[i] = offset;
+        header.sectionBytes[i] = sections[i].bytes;
+        offset += sections[i].bytes;
+    }
+
+    string tmp_filename = filename + ".tmp";
+    FILE* fp = fopen(tmp_filename.c_str(), "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "WARNING: cannot create index file %s\n",
+                filename.c_str());
+        return false;
+    }
+
+    static const char padding[INDEX_FILE_ALIGNMENT] = {0};
+    bool success = fwrite(&header, sizeof(IndexFileHeader), 1, fp) == 1;
+    uint64_t pos = sizeof(IndexFileHeader);
+    for (size_t i = 0; i < sections.size() && success; ++i) {
+        size_t pad = header.sectionOffset[i] - pos;
+        const IndexSection& section = sections[i];
+        success = (pad == 0 || fwrite(padding, 1, pad, fp) == pad) &&
+                  (section.bytes == 0 ||
+                   fwrite(section.data, 1, section.bytes, fp) ==
+                       section.bytes);
+        pos = header.sectionOffset[i] + section.bytes;
+    }
+    success = (fclose(fp) == 0) && success;
+
+    if (!success || !commitTemporaryFile(tmp_filename, filename)) {
+        fprintf(stderr, "WARNING: failed to write index file %s\n",
+                filename.c_str());
+        remove(tmp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+shared_ptr<MappedFile> openIndexFile(const string& filename,
+                                     const IndexFileKey& key,
+                                     size_t num_sections,
+                                     vector<IndexSection>& sections) {
+    sections.clear();
+    shared_ptr<MappedFile> file(new MappedFile);
+    if (!file->open(filename) || file->size() < sizeof(IndexFileHeader)) {
+        return nullptr;
+    }
+
+    IndexFileHeader header;
+    memcpy(&header, file->data(), sizeof(IndexFileHeader));
+    if (memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INDEX_FILE_VERSION ||
+        num_sections > MAX_INDEX_SECTIONS) {
+        return nullptr;
+    }
+    if (!(header.key == key) || header.numSections != num_sections) {
+        printf("Index file %s is outdated, rebuilding the index.\n",
+               filename.c_str());
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < num_sections; ++i) {
+        uint64_t offset = header.sectionOffset[i];
+        uint64_t bytes = header.sectionBytes[i];
+        if (offset % INDEX_FILE_ALIGNMENT != 0 || offset > file->size() ||
+            bytes > file->size() - offset) {
+            fprintf(stderr, "ERROR: index file %s is corrupted.\n",
+                    filename.c_str());
+            sections.clear();
+            return nullptr;
+        }
+        sections.push_back(IndexSection(file->data() + offset, bytes));
+    }
+    return file;
+}
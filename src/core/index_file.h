@@ -0,0 +1,68 @@
+/*=====================================================================================
+                                index_file.h
+
+    Description:  Binary files holding a built search index next to its dataset
+
+        Layout:
+            IndexFileHeader
+            section 0 ... section numSections - 1 (each 64-byte aligned)
+        The header records an IndexFileKey describing the data and the
+        parameters the index was built for. A file is only used when its key
+        matches the one of the data being indexed, so that an outdated index is
+        rebuilt rather than trusted. Sections are read in place from the
+        memory mapped file.
+=====================================================================================*/
+
+#ifndef INDEX_FILE_H_
+#define INDEX_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+using namespace std;
+
+struct IndexFileKey {
+    IndexFileKey() : sourceSize(0), sourceMtime(0), numPoints(0), type(0) {
+        for (int i = 0; i < NUM_PARAMS; ++i) params[i] = 0.0;
+    }
+
+    static const int NUM_PARAMS = 8;
+
+    uint64_t sourceSize;   // fingerprint of the dataset file
+    int64_t sourceMtime;
+    uint64_t numPoints;
+    uint32_t type;         // kind of index
+    double params[NUM_PARAMS];  // dataset / index parameters, unused are 0
+
+    void setSource(const FileFingerprint& source) {
+        sourceSize = source.size;
+        sourceMtime = source.mtime;
+    }
+    bool operator==(const IndexFileKey& other) const;
+};
+
+struct IndexSection {
+    IndexSection(const void* section_data, uint64_t section_bytes)
+        : data(section_data), bytes(section_bytes) {}
+
+    const void* data;
+    uint64_t bytes;
+};
+
+// Write the sections atomically (through a temporary file)
+bool writeIndexFile(const string& filename, const IndexFileKey& key,
+                    const vector<IndexSection>& sections);
+
+// Memory map an index file. Returns null if the file does not exist, has
+// another key or another number of sections.
+shared_ptr<MappedFile> openIndexFile(const string& filename,
+                                     const IndexFileKey& key,
+                                     size_t num_sections,
+                                     vector<IndexSection>& sections);
+
+#endif /* end of include guard: INDEX_FILE_H_ */
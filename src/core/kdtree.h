@@ -0,0 +1,507 @@
+/*=====================================================================================
+                                kdtree.h
+
+    Description:  Header-only 2D kd-tree over coordinate columns
+
+        The tree does not copy the points: it reads them through a dataset
+        adaptor (see PointSpans) and only stores a permutation of the point ids
+        plus its nodes. The columns must outlive the tree and must not change
+        until the next build().
+
+        A built tree can be saved to an index file and mapped back later
+        instead of being rebuilt (see index_file.h).
+
+        Queries are in meters and return point ids:
+            - radiusSearch: points closer than radius (strictly, as FLANN)
+            - nearestKSearch: k nearest points, sorted by distance
+            - boxSearch: points inside a closed bounding box
+        All queries are const and can run concurrently. Each also has a
+        version filling a NeighborList, which does not allocate when the list
+        is reused (see neighborhoods.h for batches of queries).
+=====================================================================================*/
+
+#ifndef KDTREE_H_
+#define KDTREE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "index_file.h"
+#include "neighborhoods.h"
+#include "parallel.h"
+
+using namespace std;
+
+// Dataset adaptor over two coordinate arrays. Coordinates in meters are
+// origin + scale * value, which covers plain float / double columns (the
+// defaults) as well as fixed-point integer columns.
+template <typename T>
+struct PointSpans {
+    PointSpans()
+        : x(nullptr),
+          y(nullptr),
+          n(0),
+          scale(1.0),
+          originX(0.0),
+          originY(0.0) {}
+    PointSpans(const T* x_values, const T* y_values, size_t num_points,
+               double value_scale = 1.0, double origin_x = 0.0,
+               double origin_y = 0.0)
+        : x(x_values),
+          y(y_values),
+          n(num_points),
+          scale(value_scale),
+          originX(origin_x),
+          originY(origin_y) {}
+
+    size_t size() const { return n; }
+    double coord(size_t i, int dim) const {
+        return dim == 0 ? originX + scale * x[i] : originY + scale * y[i];
+    }
+
+    const T* x;
+    const T* y;
+    size_t n;
+    double scale;
+    double originX;
+    double originY;
+};
+
+struct KdTreeParams {
+    KdTreeParams() : leafSize(16), buildThreads(0), sorted(false) {}
+
+    size_t leafSize;      // maximum number of points in a leaf
+    size_t buildThreads;  // 0: numWorkerThreads()
+    bool sorted;          // sort radiusSearch results by distance
+};
+
+template <class Dataset>
+class KdTree {
+public:
+    explicit KdTree(const KdTreeParams& params = KdTreeParams())
+        : m_params(params),
+          m_fileIndexData(nullptr),
+          m_fileNodeData(nullptr),
+          m_numIndices(0),
+          m_numNodes(0) {
+        if (m_params.leafSize < 1) m_params.leafSize = 1;
+    }
+
+    void setParams(const KdTreeParams& params) {
+        m_params = params;
+        if (m_params.leafSize < 1) m_params.leafSize = 1;
+    }
+    const KdTreeParams& params() const { return m_params; }
+
+    // Index every point of dataset. Point ids are 32-bit.
+    void build(const Dataset& dataset);
+    void clear() {
+        m_dataset = Dataset();
+        vector<uint32_t>().swap(m_indices);
+        vector<Node>().swap(m_nodes);
+        m_file.reset();
+        m_fileIndexData = nullptr;
+        m_fileNodeData = nullptr;
+        m_numIndices = m_numNodes = 0;
+    }
+
+    // Save the tree, identified by key, to an index file. load() maps it
+    // back for dataset if the key matches and the tree stays within the
+    // file, and returns false otherwise. A loaded tree keeps the leaf size it
+    // was built with.
+    bool save(const string& filename, IndexFileKey key) const;
+    bool load(const string& filename, const Dataset& dataset,
+              IndexFileKey key);
+
+    size_t size() const { return m_numIndices; }
+    bool empty() const { return m_numIndices == 0; }
+    const Dataset& dataset() const { return m_dataset; }
+
+    // Points with a distance to (x, y) less than radius. If max_nn > 0, stop
+    // after max_nn points. Returns the number of points found.
+    size_t radiusSearch(double x, double y, double radius,
+                        vector<uint32_t>& indices,
+                        vector<double>& sqr_distances,
+                        size_t max_nn = 0) const;
+
+    // The k nearest points to (x, y), closest first
+    size_t nearestKSearch(double x, double y, size_t k,
+                          vector<uint32_t>& indices,
+                          vector<double>& sqr_distances) const;
+
+    size_t radiusSearch(double x, double y, double radius,
+                        NeighborList& neighbors, size_t max_nn = 0) const;
+    size_t nearestKSearch(double x, double y, size_t k,
+                          NeighborList& neighbors) const;
+
+    // Points with min_x <= x <= max_x and min_y <= y <= max_y
+    size_t boxSearch(double min_x, double max_x, double min_y, double max_y,
+                     vector<uint32_t>& indices) const;
+
+private:
+    struct Node {
+        double bbox[4];   // min_x, max_x, min_y, max_y of the points below
+        uint32_t begin;   // range of the points in m_indices
+        uint32_t end;
+        uint32_t right;   // right child, 0 for a leaf. The left one is next.
+    };
+
+    // Subtrees with fewer points are built on the current thread
+    static const size_t MIN_POINTS_PER_BUILD_THREAD = 1 << 15;
+
+    // Number of nodes of the subtree of every size that occurs below n.
+    // Halving by count gives at most two sizes per level.
+    typedef map<size_t, size_t> NodeCounts;
+    size_t countNodes(size_t n, NodeCounts& counts) const {
+        auto it = counts.find(n);
+        if (it != counts.end()) return it->second;
+        size_t count = n <= m_params.leafSize
+                           ? 1
+                           : 1 + countNodes(n / 2, counts) +
+                                 countNodes(n - n / 2, counts);
+        counts[n] = count;
+        return count;
+    }
+    void buildNode(size_t node, size_t begin, size_t end, size_t num_threads,
+                   const NodeCounts& counts);
+
+    double sqrDistance(size_t i, double x, double y) const {
+        double dx = m_dataset.coord(i, 0) - x;
+        double dy = m_dataset.coord(i, 1) - y;
+        return dx * dx + dy * dy;
+    }
+    static bool validNodes(const Node* nodes, size_t num_nodes,
+                           const uint32_t* indices, size_t n);
+
+    static double sqrDistanceToBox(const Node& node, double x, double y) {
+        double dx = std::max(0.0, std::max(node.bbox[0] - x, x - node.bbox[1]));
+        double dy = std::max(0.0, std::max(node.bbox[2] - y, y - node.bbox[3]));
+        return dx * dx + dy * dy;
+    }
+
+    bool radiusSearchNode(size_t node, double x, double y, double sqr_radius,
+                          size_t max_nn, NeighborList& result) const;
+    void nearestKSearchNode(size_t node, double x, double y, size_t k,
+                            NeighborList& heap) const;
+    void boxSearchNode(size_t node, const double* box,
+                       vector<uint32_t>& indices) const;
+
+    // Type of the index in IndexFileKey
+    static const uint32_t INDEX_FILE_TYPE = 1;
+
+    KdTreeParams m_params;
+    Dataset m_dataset;
+    vector<uint32_t> m_indices;  // point ids, grouped by leaf
+    vector<Node> m_nodes;        // depth-first order, root first
+
+    // A loaded tree reads the sections of a mapped index file instead of the
+    // vectors above (not cached as pointers, which copies would share)
+    shared_ptr<MappedFile> m_file;
+    const uint32_t* m_fileIndexData;
+    const Node* m_fileNodeData;
+    const uint32_t* indexData() const {
+        return m_file ? m_fileIndexData : m_indices.data();
+    }
+    const Node* nodeData() const {
+        return m_file ? m_fileNodeData : m_nodes.data();
+    }
+    size_t m_numIndices;
+    size_t m_numNodes;
+};
+
+template <class Dataset>
+void KdTree<Dataset>::build(const Dataset& dataset) {
+    clear();
+    m_dataset = dataset;
+    size_t n = dataset.size();
+    if (n == 0) return;
+    if (n > numeric_limits<uint32_t>::max()) {
+        fprintf(stderr,
+                "ERROR: more than 2^32 points, cannot build the kd-tree.\n");
+        return;
+    }
+
+    size_t num_threads = m_params.buildThreads > 0 ? m_params.buildThreads
+                                                   : numWorkerThreads();
+    m_indices.resize(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            m_indices[i] = static_cast<uint32_t>(i);
+        }
+    });
+
+    // Nodes split their points in halves by count, so the shape of the tree,
+    // and the position of every subtree in m_nodes, only depend on n. The
+    // subtrees can then be built concurrently in place.
+    NodeCounts counts;
+    m_nodes.resize(countNodes(n, counts));
+    buildNode(0, 0, n, num_threads, counts);
+
+    m_numIndices = m_indices.size();
+    m_numNodes = m_nodes.size();
+}
+
+template <class Dataset>
+bool KdTree<Dataset>::save(const string& filename, IndexFileKey key) const {
+    key.type = INDEX_FILE_TYPE;
+    key.numPoints = m_numIndices;
+    vector<IndexSection> sections;
+    sections.push_back(
+        IndexSection(indexData(), m_numIndices * sizeof(uint32_t)));
+    sections.push_back(IndexSection(nodeData(), m_numNodes * sizeof(Node)));
+    return writeIndexFile(filename, key, sections);
+}
+
+template <class Dataset>
+bool KdTree<Dataset>::load(const string& filename, const Dataset& dataset,
+                           IndexFileKey key) {
+    key.type = INDEX_FILE_TYPE;
+    key.numPoints = dataset.size();
+    vector<IndexSection> sections;
+    shared_ptr<MappedFile> file = openIndexFile(filename, key, 2, sections);
+    if (!file) return false;
+
+    size_t n = dataset.size();
+    const IndexSection& nodes = sections[1];
+    if (sections[0].bytes != n * sizeof(uint32_t) ||
+        nodes.bytes % sizeof(Node) != 0 || (n > 0 && nodes.bytes == 0) ||
+        !validNodes(static_cast<const Node*>(nodes.data),
+                    nodes.bytes / sizeof(Node),
+                    static_cast<const uint32_t*>(sections[0].data), n)) {
+        fprintf(stderr, "ERROR: kd-tree index file %s is corrupted.\n",
+                filename.c_str());
+        return false;
+    }
+
+    clear();
+    m_dataset = dataset;
+    m_file = file;
+    m_fileIndexData = static_cast<const uint32_t*>(sections[0].data);
+    m_fileNodeData = static_cast<const Node*>(nodes.data);
+    m_numIndices = n;
+    m_numNodes = nodes.bytes / sizeof(Node);
+    return true;
+}
+
+// Whether the searches of a mapped tree stay inside its sections: point
+// ranges and ids within n, children after their parent (which also rules out
+// cycles) and before num_nodes
+template <class Dataset>
+bool KdTree<Dataset>::validNodes(const Node* nodes, size_t num_nodes,
+                                 const uint32_t* indices, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (indices[i] >= n) return false;
+    }
+    for (size_t node = 0; node < num_nodes; ++node) {
+        const Node& a_node = nodes[node];
+        if (a_node.begin > a_node.end || a_node.end > n) return false;
+        if (a_node.right != 0 &&
+            (a_node.right <= node + 1 || a_node.right >= num_nodes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <class Dataset>
+void KdTree<Dataset>::buildNode(size_t node, size_t begin, size_t end,
+                                size_t num_threads,
+                                const NodeCounts& counts) {
+    Node& a_node = m_nodes[node];
+    a_node.bbox[0] = a_node.bbox[2] = numeric_limits<double>::max();
+    a_node.bbox[1] = a_node.bbox[3] = -numeric_limits<double>::max();
+    for (size_t i = begin; i < end; ++i) {
+        double x = m_dataset.coord(m_indices[i], 0);
+        double y = m_dataset.coord(m_indices[i], 1);
+        a_node.bbox[0] = std::min(a_node.bbox[0], x);
+        a_node.bbox[1] = std::max(a_node.bbox[1], x);
+        a_node.bbox[2] = std::min(a_node.bbox[2], y);
+        a_node.bbox[3] = std::max(a_node.bbox[3], y);
+    }
+    a_node.begin = static_cast<uint32_t>(begin);
+    a_node.end = static_cast<uint32_t>(end);
+    a_node.right = 0;
+    if (end - begin <= m_params.leafSize) return;
+
+    // Split the widest dimension at the median
+    int dim = a_node.bbox[1] - a_node.bbox[0] >= a_node.bbox[3] - a_node.bbox[2]
+                  ? 0
+                  : 1;
+    size_t mid = begin + (end - begin) / 2;
+    const Dataset& dataset = m_dataset;
+    std::nth_element(m_indices.begin() + begin, m_indices.begin() + mid,
+                     m_indices.begin() + end,
+                     [&dataset, dim](uint32_t a, uint32_t b) {
+                         return dataset.coord(a, dim) < dataset.coord(b, dim);
+                     });
+
+    size_t left = node + 1;
+    size_t right = left + counts.at(mid - begin);
+    a_node.right = static_cast<uint32_t>(right);
+    if (num_threads > 1 && end - begin >= 2 * MIN_POINTS_PER_BUILD_THREAD) {
+        size_t left_threads = num_threads / 2;
+        std::thread worker(&KdTree::buildNode, this, left, begin, mid,
+                           left_threads, std::cref(counts));
+        buildNode(right, mid, end, num_threads - left_threads, counts);
+        worker.join();
+    } else {
+        buildNode(left, begin, mid, 1, counts);
+        buildNode(right, mid, end, 1, counts);
+    }
+}
+
+template <class Dataset>
+size_t KdTree<Dataset>::radiusSearch(double x, double y, double radius,
+                                     vector<uint32_t>& indices,
+                                     vector<double>& sqr_distances,
+                                     size_t max_nn) const {
+    NeighborList neighbors;
+    radiusSearch(x, y, radius, neighbors, max_nn);
+    splitNeighbors(neighbors, indices, sqr_distances);
+    return neighbors.size();
+}
+
+template <class Dataset>
+size_t KdTree<Dataset>::radiusSearch(double x, double y, double radius,
+                                     NeighborList& neighbors,
+                                     size_t max_nn) const {
+    neighbors.clear();
+    if (m_numNodes == 0) return 0;
+
+    radiusSearchNode(0, x, y, radius * radius, max_nn, neighbors);
+    if (m_params.sorted) {
+        std::sort(neighbors.begin(), neighbors.end());
+    }
+    return neighbors.size();
+}
+
+// Returns false once max_nn points are found
+template <class Dataset>
+bool KdTree<Dataset>::radiusSearchNode(size_t node, double x, double y,
+                                       double sqr_radius, size_t max_nn,
+                                       NeighborList& result) const {
+    const Node& a_node = nodeData()[node];
+    if (!(sqrDistanceToBox(a_node, x, y) < sqr_radius)) return true;
+
+    if (a_node.right == 0) {
+        for (uint32_t i = a_node.begin; i < a_node.end; ++i) {
+            double sqr_dist = sqrDistance(indexData()[i], x, y);
+            if (sqr_dist < sqr_radius) {
+                result.push_back(Neighbor(sqr_dist, indexData()[i]));
+                if (max_nn > 0 && result.size() >= max_nn) return false;
+            }
+        }
+        return true;
+    }
+    return radiusSearchNode(node + 1, x, y, sqr_radius, max_nn, result) &&
+           radiusSearchNode(a_node.right, x, y, sqr_radius, max_nn, result);
+}
+
+template <class Dataset>
+size_t KdTree<Dataset>::nearestKSearch(double x, double y, size_t k,
+                                       vector<uint32_t>& indices,
+                                       vector<double>& sqr_distances) const {
+    NeighborList neighbors;
+    nearestKSearch(x, y, k, neighbors);
+    splitNeighbors(neighbors, indices, sqr_distances);
+    return neighbors.size();
+}
+
+template <class Dataset>
+size_t KdTree<Dataset>::nearestKSearch(double x, double y, size_t k,
+                                       NeighborList& neighbors) const {
+    neighbors.clear();
+    if (m_numNodes == 0 || k == 0) return 0;
+
+    // Max-heap of the k best candidates
+    nearestKSearchNode(0, x, y, k, neighbors);
+    std::sort_heap(neighbors.begin(), neighbors.end());
+    return neighbors.size();
+}
+
+template <class Dataset>
+void KdTree<Dataset>::nearestKSearchNode(size_t node, double x, double y,
+                                         size_t k,
+                                         NeighborList& heap) const {
+    const Node& a_node = nodeData()[node];
+    if (a_node.right == 0) {
+        for (uint32_t i = a_node.begin; i < a_node.end; ++i) {
+            pushNeighbor(heap, k,
+                         Neighbor(sqrDistance(indexData()[i], x, y),
+                                  indexData()[i]));
+        }
+        return;
+    }
+
+    // Visit the closer child first, skip children beyond the k-th candidate
+    size_t children[2] = {node + 1, a_node.right};
+    double box_dist[2] = {sqrDistanceToBox(nodeData()[children[0]], x, y),
+                          sqrDistanceToBox(nodeData()[children[1]], x, y)};
+    int first = box_dist[1] < box_dist[0] ? 1 : 0;
+    for (int c = 0; c < 2; ++c) {
+        int child = c == 0 ? first : 1 - first;
+        if (heap.size() == k && box_dist[child] > heap.front().first) {
+            continue;
+        }
+        nearestKSearchNode(children[child], x, y, k, heap);
+    }
+}
+
+template <class Dataset>
+size_t KdTree<Dataset>::boxSearch(double min_x, double max_x, double min_y,
+                                  double max_y,
+                                  vector<uint32_t>& indices) const {
+    indices.clear();
+    if (m_numNodes == 0) return 0;
+
+    double box[4] = {min_x, max_x, min_y, max_y};
+    boxSearchNode(0, box, indices);
+    return indices.size();
+}
+
+template <class Dataset>
+void KdTree<Dataset>::boxSearchNode(size_t node, const double* box,
+                                    vector<uint32_t>& indices) const {
+    const Node& a_node = nodeData()[node];
+    if (a_node.bbox[0] > box[1] || a_node.bbox[1] < box[0] ||
+        a_node.bbox[2] > box[3] || a_node.bbox[3] < box[2]) {
+        return;
+    }
+
+    // Nodes inside the box are reported without testing their points
+    bool inside = a_node.bbox[0] >= box[0] && a_node.bbox[1] <= box[1] &&
+                  a_node.bbox[2] >= box[2] && a_node.bbox[3] <= box[3];
+    if (inside || a_node.right == 0) {
+        for (uint32_t i = a_node.begin; i < a_node.end; ++i) {
+            uint32_t pt_idx = indexData()[i];
+            if (inside) {
+                indices.push_back(pt_idx);
+                continue;
+            }
+            double x = m_dataset.coord(pt_idx, 0);
+            double y = m_dataset.coord(pt_idx, 1);
+            if (x >= box[0] && x <= box[1] && y >= box[2] && y <= box[3]) {
+                indices.push_back(pt_idx);
+            }
+        }
+        return;
+    }
+    boxSearchNode(node + 1, box, indices);
+    boxSearchNode(a_node.right, box, indices);
+}
+
+template <class Dataset>
+const size_t KdTree<Dataset>::MIN_POINTS_PER_BUILD_THREAD;
+template <class Dataset>
+const uint32_t KdTree<Dataset>::INDEX_FILE_TYPE;
+
+#endif /* end of include guard: KDTREE_H_ */
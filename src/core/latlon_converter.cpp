@@ -1,40 +1,289 @@
 #include "latlon_converter.h"
 
-Converter::Converter(){
-    setUTMZone(UtmRegion::California);
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Number of points handed to pj_transform at once by the batch conversions
+static const size_t PROJECTION_BATCH_SIZE = 4096;
+
+// The native projection must agree with pj_transform within this distance
+static const double NATIVE_PROJECTION_TOLERANCE = 1e-3;  // meters
+
+Converter::Converter()
+    : zone_(0),
+      south_(false),
+      backend_(ProjectionBackend::Native),
+      zone_backend_(ProjectionBackend::Native),
+      has_zone_(false),
+      generation_(0) {
+    memset(native_valid_, 0, sizeof(native_valid_));
 }
 
-void Converter::setUTMZone(UtmRegion zone){
-    const char* src_proj_str;
-    const char* dst_proj_str;
+Converter::ThreadProjection::~ThreadProjection() { release(); }
+
+void Converter::ThreadProjection::release() {
+    if (src_proj_) pj_free(src_proj_);
+    if (dst_proj_) pj_free(dst_proj_);
+    if (ctx_) pj_ctx_free(ctx_);
+    src_proj_ = nullptr;
+    dst_proj_ = nullptr;
+    ctx_ = nullptr;
+}
+
+static string utmProjString(int zone, bool south) {
+    char proj_str[64];
+    snprintf(proj_str, sizeof(proj_str), "+proj=utm +zone=%d%s +ellps=WGS84",
+             zone, south ? " +south" : "");
+    return proj_str;
+}
+
+string Converter::dstProjString() const { return utmProjString(zone_, south_); }
 
+void Converter::setUTMZone(UtmRegion zone){
     switch (zone) {
         case UtmRegion::Beijing:
-            src_proj_str = BJ_SRC_PROJ;
-            dst_proj_str = BJ_DST_PROJ;        
+            setUTMZone(50, false);
             break;
         case UtmRegion::California:
-            src_proj_str = SF_SRC_PROJ;
-            dst_proj_str = SF_DST_PROJ;
-            break;
         default:
+            setUTMZone(10, false);
             break;
     }
+}
 
-    if (!(src_proj_ = pj_init_plus(SF_SRC_PROJ))) {
-        fprintf(stderr, "Error! Cannot initialize latlon to XY projector!\n");
+void Converter::setUTMZone(int zone, bool south){
+    std::lock_guard<std::mutex> lock(mutex_);
+    installUTMZone(zone, south);
+}
+
+void Converter::selectUTMZone(double lat, double lon){
+    if (has_zone_.load()) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (has_zone_.load()) return;
+    installUTMZone(UtmProjection::zoneFromLatLon(lat, lon), lat < 0.0);
+}
+
+void Converter::installUTMZone(int zone, bool south){
+    if (zone < 1 || zone > 60) {
+        fprintf(stderr, "Error! Invalid UTM zone %d\n", zone);
         exit(1);
     }
-    if (!(dst_proj_ = pj_init_plus(SF_DST_PROJ))) {
+    zone_ = zone;
+    south_ = south;
+    printf("Projecting to UTM zone %d%s\n", zone, south ? "S" : "N");
+
+    zone_backend_ = backend_;
+    if (backend_ == ProjectionBackend::Native &&
+        !nativeProjectionValid(zone, south)) {
+        zone_backend_ = ProjectionBackend::Proj;
+    }
+    ++generation_;
+    // Published last: a thread that sees the zone also sees the new generation
+    has_zone_ = true;
+}
+
+bool Converter::nativeProjectionValid(int zone, bool south){
+    int8_t& valid = native_valid_[south][zone];
+    if (valid == 0) {
+        double error = nativeProjectionError(zone, south);
+        valid = error < NATIVE_PROJECTION_TOLERANCE ? 1 : -1;
+        if (valid < 0) {
+            fprintf(stderr,
+                    "WARNING: native UTM projection deviates from proj by "
+                    "%.2g m in zone %d%s, using proj instead.\n",
+                    error, zone, south ? "S" : "N");
+        }
+    }
+    return valid > 0;
+}
+
+void Converter::setProjectionBackend(ProjectionBackend backend){
+    std::lock_guard<std::mutex> lock(mutex_);
+    backend_ = backend;
+    if (has_zone_.load()) {
+        installUTMZone(zone_, south_);
+    } else {
+        ++generation_;
+    }
+}
+
+// Compare the native projection with pj_transform on a grid spanning the
+// zone (plus one degree on each side) and all UTM latitudes of the hemisphere
+double Converter::nativeProjectionError(int zone, bool south){
+    static const int GRID_SIZE = 25;
+
+    projCtx ctx = pj_ctx_alloc();
+    projPJ src_proj = pj_init_plus_ctx(ctx, UTM_SRC_PROJ);
+    projPJ dst_proj = pj_init_plus_ctx(ctx, utmProjString(zone, south).c_str());
+    if (!src_proj || !dst_proj) {
         fprintf(stderr, "Error! Cannot initialize latlon to XY projector!\n");
         exit(1);
     }
+
+    UtmProjection utm(zone, south);
+    double min_lat = south ? -80.0 : 0.0;
+    vector<double> lat, lon;
+    for (int i = 0; i < GRID_SIZE; ++i) {
+        for (int j = 0; j < GRID_SIZE; ++j) {
+            lat.push_back(min_lat + 84.0 * i / (GRID_SIZE - 1));
+            lon.push_back(utm.centralMeridian() - 4.0 + 8.0 * j / (GRID_SIZE - 1));
+        }
+    }
+    size_t n = lat.size();
+
+    vector<double> x(n), y(n);
+    utm.forward(n, lat.data(), lon.data(), x.data(), y.data());
+
+    vector<double> proj_x(n), proj_y(n);
+    for (size_t i = 0; i < n; ++i) {
+        proj_x[i] = lon[i] * DEG_TO_RAD;
+        proj_y[i] = lat[i] * DEG_TO_RAD;
+    }
+    pj_transform(src_proj, dst_proj, n, 1, proj_x.data(), proj_y.data(), NULL);
+
+    double max_error = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        double error = std::hypot(x[i] - proj_x[i], y[i] - proj_y[i]);
+        // NaN must fail the check
+        if (!(error <= max_error)) max_error = error;
+    }
+
+    pj_free(src_proj);
+    pj_free(dst_proj);
+    pj_ctx_free(ctx);
+    return max_error;
+}
+
+double Converter::validateNativeProjection(){
+    if (!has_zone_.load()) return 0.0;
+    return nativeProjectionError(zone_, south_);
+}
+
+Converter::ThreadProjection& Converter::threadProjection(){
+    static thread_local ThreadProjection projection;
+
+    if (projection.generation_ != generation_.load()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        projection.release();
+        projection.generation_ = generation_.load();
+        projection.backend_ = zone_backend_;
+        projection.utm_ = UtmProjection(zone_, south_);
+        if (!has_zone_.load() || zone_backend_ != ProjectionBackend::Proj) {
+            return projection;
+        }
+
+        // A context per thread keeps error state and caches thread-local
+        projection.ctx_ = pj_ctx_alloc();
+        if (!(projection.src_proj_ =
+                  pj_init_plus_ctx(projection.ctx_, UTM_SRC_PROJ))) {
+            fprintf(stderr, "Error! Cannot initialize latlon to XY projector!\n");
+            exit(1);
+        }
+        if (!(projection.dst_proj_ = pj_init_plus_ctx(
+                  projection.ctx_, dstProjString().c_str()))) {
+            fprintf(stderr, "Error! Cannot initialize latlon to XY projector!\n");
+            exit(1);
+        }
+    }
+    return projection;
 }
 
 void Converter::convertLatLonToXY(float lat, float lon, float& x, float&y){
-    double tmp_x = lon * DEG_TO_RAD;
-    double tmp_y = lat * DEG_TO_RAD;
-    pj_transform(src_proj_, dst_proj_, 1, 1, &tmp_x, &tmp_y, NULL);
-    x = tmp_x;
-    y = tmp_y;
+    convertBatch(1, &lat, &lon, 1.0, &x, &y);
+}
+
+template <typename T, typename U>
+void Converter::convertBatch(size_t n, const T* lat, const T* lon,
+                             double scale, U* x, U* y){
+    if (n == 0) return;
+
+    if (!has_zone_.load()) {
+        double sum_lat = 0.0, sum_lon = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            sum_lat += lat[i];
+            sum_lon += lon[i];
+        }
+        selectUTMZone(sum_lat * scale / n, sum_lon * scale / n);
+    }
+
+    ThreadProjection& projection = threadProjection();
+    projection.x_.resize(PROJECTION_BATCH_SIZE);
+    projection.y_.resize(PROJECTION_BATCH_SIZE);
+    double* tmp_x = projection.x_.data();
+    double* tmp_y = projection.y_.data();
+
+    bool native = projection.backend_ == ProjectionBackend::Native;
+    double to_unit = native ? scale : scale * DEG_TO_RAD;
+    for (size_t begin = 0; begin < n; begin += PROJECTION_BATCH_SIZE) {
+        size_t count = std::min(PROJECTION_BATCH_SIZE, n - begin);
+        for (size_t i = 0; i < count; ++i) {
+            tmp_x[i] = lon[begin + i] * to_unit;
+            tmp_y[i] = lat[begin + i] * to_unit;
+        }
+        if (native) {
+            projection.utm_.forward(count, tmp_y, tmp_x, tmp_x, tmp_y);
+        } else {
+            pj_transform(projection.src_proj_, projection.dst_proj_, count, 1,
+                         tmp_x, tmp_y, NULL);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            x[begin + i] = tmp_x[i];
+            y[begin + i] = tmp_y[i];
+        }
+    }
+}
+
+void Converter::convertLatLonToXY(size_t n, const double* lat,
+                                  const double* lon, float* x, float* y){
+    convertBatch(n, lat, lon, 1.0, x, y);
+}
+
+void Converter::convertLatLonToXY(size_t n, const int32_t* lat,
+                                  const int32_t* lon, float* x, float* y){
+    convertBatch(n, lat, lon, 1.0e-6, x, y);
+}
+
+void Converter::convertLatLonToXY(size_t n, const double* lat,
+                                  const double* lon, double* x, double* y){
+    convertBatch(n, lat, lon, 1.0, x, y);
+}
+
+void Converter::convertLatLonToXY(size_t n, const int32_t* lat,
+                                  const int32_t* lon, double* x, double* y){
+    convertBatch(n, lat, lon, 1.0e-6, x, y);
+}
+
+void Converter::convertXYToLatLon(float x, float y, float& lat, float& lon){
+    double tmp_x = x, tmp_y = y, tmp_lat, tmp_lon;
+    convertXYToLatLon(1, &tmp_x, &tmp_y, &tmp_lat, &tmp_lon);
+    lat = tmp_lat;
+    lon = tmp_lon;
+}
+
+void Converter::convertXYToLatLon(size_t n, const double* x, const double* y,
+                                  double* lat, double* lon){
+    if (n == 0) return;
+    if (!has_zone_.load()) {
+        fprintf(stderr, "Error! No UTM zone selected for XY to latlon.\n");
+        exit(1);
+    }
+
+    ThreadProjection& projection = threadProjection();
+    for (size_t i = 0; i < n; ++i) {
+        lon[i] = x[i];
+        lat[i] = y[i];
+    }
+    if (projection.backend_ == ProjectionBackend::Native) {
+        projection.utm_.inverse(n, lon, lat, lat, lon);
+        return;
+    }
+    pj_transform(projection.dst_proj_, projection.src_proj_, n, 1, lon, lat,
+                 NULL);
+    for (size_t i = 0; i < n; ++i) {
+        lon[i] *= RAD_TO_DEG;
+        lat[i] *= RAD_TO_DEG;
+    }
 }
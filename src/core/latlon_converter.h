@@ -1,7 +1,7 @@
 /*=====================================================================================
                                 latlon_converter.h
     Description:  Convert lat / lon to easting / northing
-        
+
     Created by Chen Chen on 10/12/2015
 =====================================================================================*/
 
@@ -10,20 +10,30 @@
 #define LATLON_CONVERTER_H_
 
 #include <proj_api.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utm_projection.h"
 using namespace std;
 
 static int32_t UTC_OFFSET = 1241100000;
 
-static const char *BJ_DST_PROJ = "+proj=utm +zone=50 +south=False +ellps=WGS84";
-static const char *BJ_SRC_PROJ = "+proj=latlon +ellps=WGS84";
-
-static const char *SF_DST_PROJ = "+proj=utm +zone=10 +south=False +ellps=WGS84";
-static const char *SF_SRC_PROJ = "+proj=latlon +ellps=WGS84";
+static const char *UTM_SRC_PROJ = "+proj=latlon +ellps=WGS84";
 
+// Predefined UTM zones
 enum class UtmRegion{
-    Beijing = 0,
-    California = 1
+    Beijing = 0,    // zone 50N
+    California = 1  // zone 10N
+};
+
+enum class ProjectionBackend{
+    Proj = 0,   // libproj, pj_transform
+    Native = 1  // UtmProjection (AVX2 when available)
 };
 
 class Converter{
@@ -33,15 +43,101 @@ class Converter{
             return singleton;
         }
 
+        // Not thread-safe: select the zone and backend before starting any
+        // loader.
         void setUTMZone(UtmRegion zone);
+        void setUTMZone(int zone, bool south);
+        void setProjectionBackend(ProjectionBackend backend);
+
+        // No zone is selected by default. Loaders call selectUTMZone with the
+        // centroid of their data, which picks the zone containing it unless
+        // one is already selected (the first dataset loaded defines the
+        // projection of the scene). Converting without a zone selects it
+        // from the converted points. Thread-safe.
+        void selectUTMZone(double lat, double lon);
+        bool hasUTMZone() const { return has_zone_.load(); }
+        int utmZone() const { return zone_; }
+        bool isSouth() const { return south_; }
+        // Requested backend, and the one used for the current zone: a zone
+        // where the native projection fails validation falls back to proj
+        // without changing the request for the next zones.
+        ProjectionBackend projectionBackend() const { return backend_; }
+        ProjectionBackend zoneProjectionBackend() const {
+            return zone_backend_;
+        }
+
+        // Largest distance, in meters, between the native projection and
+        // pj_transform over a grid covering the current zone. The native
+        // backend is only used if it stays below 1 mm.
+        double validateNativeProjection();
+
+        // All conversions are thread-safe: with the proj backend each thread
+        // lazily creates its own projection context, since projPJ objects
+        // cannot be shared between threads.
         void convertLatLonToXY(float, float, float&, float&);
 
+        // Batch versions, projecting n points per call. Prefer these in
+        // loaders: pj_transform has a large per-call overhead.
+        //  - lat / lon in degrees
+        void convertLatLonToXY(size_t n, const double* lat, const double* lon,
+                               float* x, float* y);
+        //  - lat / lon in 1e-6 degrees, as stored in the trajectory files
+        void convertLatLonToXY(size_t n, const int32_t* lat,
+                               const int32_t* lon, float* x, float* y);
+        //  - full precision output
+        void convertLatLonToXY(size_t n, const double* lat, const double* lon,
+                               double* x, double* y);
+        void convertLatLonToXY(size_t n, const int32_t* lat,
+                               const int32_t* lon, double* x, double* y);
+
+        // Inverse conversions, lat / lon in degrees
+        void convertXYToLatLon(float, float, float&, float&);
+        void convertXYToLatLon(size_t n, const double* x, const double* y,
+                               double* lat, double* lon);
+
     private:
         Converter();
         virtual ~Converter(){}
 
-        projPJ      src_proj_;
-        projPJ      dst_proj_;
+        struct ThreadProjection {
+            projCtx ctx_ = nullptr;
+            projPJ  src_proj_ = nullptr;
+            projPJ  dst_proj_ = nullptr;
+            int     generation_ = -1;
+            ProjectionBackend backend_ = ProjectionBackend::Proj;
+            UtmProjection utm_;
+            // Scratch buffers of the batch conversion
+            vector<double>  x_;
+            vector<double>  y_;
+            ~ThreadProjection();
+            void release();
+        };
+        ThreadProjection& threadProjection();
+
+        // Install a zone, the caller holds mutex_
+        void installUTMZone(int zone, bool south);
+        // Whether the native projection passed validation in a zone, checked
+        // once per zone, the caller holds mutex_
+        bool nativeProjectionValid(int zone, bool south);
+        static double nativeProjectionError(int zone, bool south);
+        string dstProjString() const;
+
+        template <typename T, typename U>
+        void convertBatch(size_t n, const T* lat, const T* lon, double scale,
+                          U* x, U* y);
+
+        // Zone and backend, guarded by mutex_ and published through
+        // generation_
+        std::mutex          mutex_;
+        int                 zone_;
+        bool                south_;
+        ProjectionBackend   backend_;
+        ProjectionBackend   zone_backend_;
+        // Per hemisphere and zone: 0 unchecked, 1 valid, -1 invalid
+        int8_t              native_valid_[2][61];
+        std::atomic<bool>   has_zone_;
+        // Bumped on every zone change to invalidate per-thread projections
+        std::atomic<int>    generation_;
 };
 
 #endif
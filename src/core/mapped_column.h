@@ -0,0 +1,68 @@
+/*=====================================================================================
+                                mapped_column.h
+
+    Description:  Data column owned in memory or read in place from a file
+
+        A column loaded from a cache can point into the memory mapped file,
+        which it keeps open, instead of copying it. Writing goes through
+        owned(), which first copies mapped values into memory.
+=====================================================================================*/
+
+#ifndef MAPPED_COLUMN_H_
+#define MAPPED_COLUMN_H_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "mapped_file.h"
+
+using namespace std;
+
+template <typename T>
+class MappedColumn {
+public:
+    MappedColumn() : m_mappedData(nullptr), m_mappedSize(0) {}
+
+    // Serve the n values at data, inside file, in place
+    void map(const shared_ptr<MappedFile>& file, const T* data, size_t n) {
+        clear();
+        m_file = file;
+        m_mappedData = data;
+        m_mappedSize = n;
+    }
+    bool isMapped() const { return m_file != nullptr; }
+
+    // The values in memory, for writing
+    vector<T>& owned() {
+        if (m_file) {
+            vector<T> values(m_mappedData, m_mappedData + m_mappedSize);
+            clear();
+            m_values.swap(values);
+        }
+        return m_values;
+    }
+    void clear() {
+        vector<T>().swap(m_values);
+        m_file.reset();
+        m_mappedData = nullptr;
+        m_mappedSize = 0;
+    }
+
+    size_t size() const { return m_file ? m_mappedSize : m_values.size(); }
+    bool empty() const { return size() == 0; }
+    const T* data() const { return m_file ? m_mappedData : m_values.data(); }
+    const T& operator[](size_t i) const { return data()[i]; }
+    const T& front() const { return data()[0]; }
+    const T& back() const { return data()[size() - 1]; }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+
+private:
+    vector<T> m_values;
+    shared_ptr<MappedFile> m_file;
+    const T* m_mappedData;
+    size_t m_mappedSize;
+};
+
+#endif /* end of include guard: MAPPED_COLUMN_H_ */
@@ -0,0 +1,72 @@
+#include "mapped_file.h"
+
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool FileFingerprint::get(const string& filename,
+                          FileFingerprint& fingerprint) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+    fingerprint.size = static_cast<uint64_t>(st.st_size);
+    // Nanoseconds: a file rewritten within the same second with the same
+    // size must not match its previous fingerprint
+#ifdef __APPLE__
+    const struct timespec& mtime = st.st_mtimespec;
+#else
+    const struct timespec& mtime = st.st_mtim;
+#endif
+    fingerprint.mtime = static_cast<int64_t>(mtime.tv_sec) * 1000000000 +
+                        mtime.tv_nsec;
+    return true;
+}
+
+MappedFile::MappedFile() : m_data(nullptr), m_size(0) {}
+
+MappedFile::~MappedFile() { close(); }
+
+bool MappedFile::open(const string& filename) {
+    close();
+
+    int fid = ::open(filename.c_str(), O_RDONLY);
+    if (fid == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fid, &st) != 0 || st.st_size == 0) {
+        ::close(fid);
+        return false;
+    }
+
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fid, 0);
+    ::close(fid);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "ERROR! Cannot map file %s\n", filename.c_str());
+        return false;
+    }
+
+    m_data = static_cast<const char*>(addr);
+    m_size = st.st_size;
+    return true;
+}
+
+void MappedFile::close() {
+    if (m_data != nullptr) {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+}
+
+bool commitTemporaryFile(const string& tmp_filename, const string& filename) {
+    if (rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        unlink(tmp_filename.c_str());
+        return false;
+    }
+    return true;
+}
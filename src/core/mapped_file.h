@@ -0,0 +1,57 @@
+/*=====================================================================================
+                                mapped_file.h
+
+    Description:  Read-only memory mapped file and source file fingerprint,
+                  used by the binary caches stored next to the datasets.
+=====================================================================================*/
+
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Size and modification time of a file. A cache is considered current when the
+// fingerprint stored inside it matches the one of its source file.
+struct FileFingerprint {
+    uint64_t size = 0;
+    int64_t mtime = 0;  // in nanoseconds since the epoch
+
+    static bool get(const string& filename, FileFingerprint& fingerprint);
+
+    bool operator==(const FileFingerprint& other) const {
+        return size == other.size && mtime == other.mtime;
+    }
+    bool operator!=(const FileFingerprint& other) const {
+        return !(*this == other);
+    }
+};
+
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const string& filename);
+    void close();
+
+    bool isOpen() const { return m_data != nullptr; }
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* m_data;
+    size_t m_size;
+};
+
+// Write a file to a temporary name first and move it in place on success, so
+// that readers never observe a partially written cache.
+bool commitTemporaryFile(const string& tmp_filename, const string& filename);
+
+#endif /* end of include guard: MAPPED_FILE_H_ */
@@ -0,0 +1,180 @@
+/*=====================================================================================
+                                neighborhoods.h
+
+    Description:  Batch neighborhood queries over a point index
+
+        Runs one radius or kNN query per query point on all cores and stores
+        the results in CSR layout: the neighbors of query q are
+            indices[offsets[q] ... offsets[q + 1])
+        Threads take chunks of queries in turn, so that dense areas do not
+        hold back a single thread, and append to their own buffers, which are
+        copied into place at the end. A query point that is also a data
+        point is its own neighbor.
+
+        Works with any index providing the NeighborList queries (KdTree,
+        GridIndex, PointIndex) and any dataset adaptor as queries.
+=====================================================================================*/
+
+#ifndef NEIGHBORHOODS_H_
+#define NEIGHBORHOODS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "parallel.h"
+
+using namespace std;
+
+typedef pair<double, uint32_t> Neighbor;  // squared distance, point id
+
+// Query result buffer. Queries reuse its capacity, so a buffer kept across
+// queries stops allocating once it has grown to the largest result.
+typedef vector<Neighbor> NeighborList;
+
+// Copy neighbors to separate id / squared distance vectors
+inline void splitNeighbors(const NeighborList& neighbors,
+                           vector<uint32_t>& indices,
+                           vector<double>& sqr_distances) {
+    indices.resize(neighbors.size());
+    sqr_distances.resize(neighbors.size());
+    for (size_t i = 0; i < neighbors.size(); ++i) {
+        sqr_distances[i] = neighbors[i].first;
+        indices[i] = neighbors[i].second;
+    }
+}
+
+// Keep the k closest candidates in the max-heap heap (std::push_heap order).
+// std::sort_heap then sorts them closest first.
+inline void pushNeighbor(NeighborList& heap, size_t k,
+                         const Neighbor& candidate) {
+    if (heap.size() < k) {
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end());
+    } else if (candidate < heap.front()) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = candidate;
+        std::push_heap(heap.begin(), heap.end());
+    }
+}
+
+struct Neighborhoods {
+    vector<uint64_t> offsets;    // size() + 1 entries
+    vector<uint32_t> indices;    // point ids
+    vector<float> sqrDistances;  // in square meters, same order as indices
+
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    size_t count(size_t q) const { return offsets[q + 1] - offsets[q]; }
+    const uint32_t* indicesOf(size_t q) const {
+        return indices.data() + offsets[q];
+    }
+    const float* sqrDistancesOf(size_t q) const {
+        return sqrDistances.data() + offsets[q];
+    }
+
+    void clear() {
+        offsets.clear();
+        indices.clear();
+        sqrDistances.clear();
+    }
+};
+
+// Run search(x, y, neighbors) for every query point. num_threads = 0 uses
+// numWorkerThreads().
+template <class Queries, class Search>
+void searchNeighborhoods(const Queries& queries, size_t num_threads,
+                         Search search, Neighborhoods& result) {
+    const size_t CHUNK_SIZE = 256;
+    size_t n = queries.size();
+    result.clear();
+    result.offsets.assign(n + 1, 0);
+    if (n == 0) return;
+
+    size_t num_chunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (num_threads == 0) num_threads = numWorkerThreads();
+    num_threads = std::min(num_threads, num_chunks);
+
+    // Neighbors found by one thread, chunk after chunk
+    struct ThreadBuffer {
+        vector<uint32_t> indices;
+        vector<float> sqrDistances;
+        vector<pair<size_t, size_t>> chunks;  // chunk, start in the buffer
+    };
+    vector<ThreadBuffer> buffers(num_threads);
+    atomic<size_t> next_chunk(0);
+    parallelFor(num_threads, num_threads, [&](size_t, size_t, size_t tid) {
+        ThreadBuffer& buffer = buffers[tid];
+        NeighborList neighbors;
+        for (size_t c = next_chunk++; c < num_chunks; c = next_chunk++) {
+            buffer.chunks.push_back(make_pair(c, buffer.indices.size()));
+            size_t end = std::min(n, (c + 1) * CHUNK_SIZE);
+            for (size_t q = c * CHUNK_SIZE; q < end; ++q) {
+                search(queries.coord(q, 0), queries.coord(q, 1), neighbors);
+                result.offsets[q + 1] = neighbors.size();
+                for (const Neighbor& neighbor : neighbors) {
+                    buffer.indices.push_back(neighbor.second);
+                    buffer.sqrDistances.push_back(
+                        static_cast<float>(neighbor.first));
+                }
+            }
+        }
+    });
+
+    for (size_t q = 0; q < n; ++q) {
+        result.offsets[q + 1] += result.offsets[q];
+    }
+    result.indices.resize(result.offsets[n]);
+    result.sqrDistances.resize(result.offsets[n]);
+
+    // Chunks are contiguous in the result
+    parallelFor(num_threads, num_threads, [&](size_t, size_t, size_t tid) {
+        ThreadBuffer& buffer = buffers[tid];
+        for (size_t i = 0; i < buffer.chunks.size(); ++i) {
+            size_t begin = buffer.chunks[i].second;
+            size_t end = i + 1 < buffer.chunks.size()
+                             ? buffer.chunks[i + 1].second
+                             : buffer.indices.size();
+            uint64_t offset = result.offsets[buffer.chunks[i].first *
+                                             CHUNK_SIZE];
+            std::copy(buffer.indices.begin() + begin,
+                      buffer.indices.begin() + end,
+                      result.indices.begin() + offset);
+            std::copy(buffer.sqrDistances.begin() + begin,
+                      buffer.sqrDistances.begin() + end,
+                      result.sqrDistances.begin() + offset);
+        }
+        vector<uint32_t>().swap(buffer.indices);
+        vector<float>().swap(buffer.sqrDistances);
+    });
+}
+
+// Points closer than radius to each query (see KdTree::radiusSearch)
+template <class Index, class Queries>
+void radiusSearchBatch(const Index& index, const Queries& queries,
+                       double radius, Neighborhoods& result,
+                       size_t max_nn = 0, size_t num_threads = 0) {
+    searchNeighborhoods(
+        queries, num_threads,
+        [&](double x, double y, NeighborList& neighbors) {
+            index.radiusSearch(x, y, radius, neighbors, max_nn);
+        },
+        result);
+}
+
+// k nearest points to each query, closest first
+template <class Index, class Queries>
+void nearestKSearchBatch(const Index& index, const Queries& queries,
+                         size_t k, Neighborhoods& result,
+                         size_t num_threads = 0) {
+    searchNeighborhoods(
+        queries, num_threads,
+        [&](double x, double y, NeighborList& neighbors) {
+            index.nearestKSearch(x, y, k, neighbors);
+        },
+        result);
+}
+
+#endif /* end of include guard: NEIGHBORHOODS_H_ */
@@ -3,20 +3,24 @@
 #include "shader.h"
 #include "renderable_object.h"
 #include "latlon_converter.h"
+#include "index_file.h"
+#include "parallel.h"
 
-#include <pcl/common/centroid.h>
-#include <pcl/search/impl/flann_search.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Osmium
-// Osmium for openstreetmap
-#include <osmium/io/xml_input.hpp>
+// Osmium for openstreetmap: XML, PBF and their compressed variants, picked
+// from the file suffix (.osm, .osm.pbf, .osm.gz, .osm.bz2)
+#include <osmium/io/any_input.hpp>
 #include <osmium/handler.hpp>
 #include <osmium/visitor.hpp>
 
 struct OsmWay {
     bool is_oneway = false;
     WayType type;
-    vector<size_t> node_idxs;
+    vector<osmium::object_id_type> node_ids;
 };
 
 glm::vec4 getWayColor(int type) {
@@ -41,17 +45,9 @@ glm::vec4 getWayColor(int type) {
     }
 }
 
+// First pass: the highway ways, with the ids of their nodes
 class MyHandlerClass : public osmium::handler::Handler {
 public:
-    void node(osmium::Node& node) {
-        if (node_table_.find(node.id()) == node_table_.end()) {
-            // Add a new node
-            node_table_[node.id()] = nodes_.size();
-            nodes_.emplace_back(pair<double, double>(node.location().lat(),
-                                                     node.location().lon()));
-        }
-    }
-
     void way(osmium::Way& way) {
         if (way.nodes().size() == 0) return;
 
@@ -100,25 +96,73 @@ public:
         }
 
         // Process way nodes
+        a_way.node_ids.reserve(way.nodes().size());
         for (auto it = way.nodes().begin(); it != way.nodes().end(); ++it) {
-            size_t node_idx = node_table_[it->ref()];
-            a_way.node_idxs.emplace_back(node_idx);
+            a_way.node_ids.emplace_back(it->ref());
         }
-        ways_.emplace_back(a_way);
+        ways_.emplace_back(std::move(a_way));
     }
 
-    vector<pair<double, double>>& getNodes() { return nodes_; }
     vector<OsmWay>& getWays() { return ways_; }
 
 private:
-    vector<pair<double, double>> nodes_;
     vector<OsmWay> ways_;
-    map<int64_t, size_t> node_table_;
+};
+
+// Second pass: the locations of the nodes used by the ways only. Node i is
+// the i-th of their sorted ids, which replaces a tree of every node of the
+// file by two flat arrays.
+class NodeLocationHandler : public osmium::handler::Handler {
+public:
+    explicit NodeLocationHandler(const vector<OsmWay>& ways) : located_(0) {
+        size_t n_refs = 0;
+        for (const auto& a_way : ways) {
+            n_refs += a_way.node_ids.size();
+        }
+        ids_.reserve(n_refs);
+        for (const auto& a_way : ways) {
+            ids_.insert(ids_.end(), a_way.node_ids.begin(),
+                        a_way.node_ids.end());
+        }
+        std::sort(ids_.begin(), ids_.end());
+        ids_.erase(std::unique(ids_.begin(), ids_.end()), ids_.end());
+        ids_.shrink_to_fit();
+        nodes_.assign(ids_.size(),
+                      pair<double, double>(
+                          numeric_limits<double>::quiet_NaN(), 0.0));
+    }
+
+    void node(const osmium::Node& node) {
+        auto it = std::lower_bound(ids_.begin(), ids_.end(), node.id());
+        if (it == ids_.end() || *it != node.id()) return;
+        if (!node.location().valid()) return;
+        size_t node_idx = it - ids_.begin();
+        if (!isLocated(node_idx)) ++located_;
+        nodes_[node_idx] = pair<double, double>(node.location().lat(),
+                                                node.location().lon());
+    }
+
+    // Index of a node used by the ways
+    size_t index(osmium::object_id_type id) const {
+        return std::lower_bound(ids_.begin(), ids_.end(), id) - ids_.begin();
+    }
+    // Whether the node was found in the file with a valid location
+    bool isLocated(size_t node_idx) const {
+        return !std::isnan(nodes_[node_idx].first);
+    }
+
+    size_t size() const { return ids_.size(); }
+    size_t numLocated() const { return located_; }
+    const vector<pair<double, double>>& getNodes() const { return nodes_; }
+
+private:
+    vector<osmium::object_id_type> ids_;  // sorted
+    vector<pair<double, double>> nodes_;  // (lat, lon), NaN if not located
+    size_t located_;
 };
 
 OpenStreetMap::OpenStreetMap()
-    : m_mapPoints(new pcl::PointCloud<MapPointType>),
-      m_searchTree(new pcl::search::FlannSearch<MapPointType>(false)),
+    : m_edgeIndexBuilt(false),
       m_interpolation(10.0f),
       m_dataUpdated(false),
       m_vboPoints(new RenderableObject),
@@ -127,152 +171,720 @@ OpenStreetMap::OpenStreetMap()
 OpenStreetMap::~OpenStreetMap() {}
 
 bool OpenStreetMap::load(const string& filename) {
-    clear();
+    string snapshot_filename = filename + ".snapshot";
+    if (loadSnapshot(snapshot_filename, filename)) {
+        return true;
+    }
 
-    osmium::io::File input_file(filename.c_str());
-    osmium::io::Reader reader(input_file);
+    if (!loadOSM(filename)) {
+        return false;
+    }
 
+    saveSnapshot(snapshot_filename, filename);
+    return true;
+}
+
+bool OpenStreetMap::loadOSM(const string& filename) {
+    clear();
+    m_filename = filename;
+
+    // Nodes come before the ways in OSM files, so the file is read twice:
+    // the ways first, then the locations of their nodes only. Relations are
+    // not even decoded, and PBF blocks are decoded in parallel by the osmium
+    // thread pool.
     MyHandlerClass handler;
-    osmium::apply(reader, handler);
-    reader.close();
+    unique_ptr<NodeLocationHandler> node_handler;
+    try {
+        osmium::io::File input_file(filename);
+        osmium::io::Reader way_reader(input_file,
+                                      osmium::osm_entity_bits::way);
+        osmium::apply(way_reader, handler);
+        way_reader.close();
+
+        node_handler.reset(new NodeLocationHandler(handler.getWays()));
+        osmium::io::Reader node_reader(input_file,
+                                       osmium::osm_entity_bits::node);
+        osmium::apply(node_reader, *node_handler);
+        node_reader.close();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "ERROR: cannot read %s: %s\n", filename.c_str(),
+                e.what());
+        clear();
+        return false;
+    }
 
     // Build the graph
     vector<OsmWay>& raw_ways = handler.getWays();
-    vector<pair<double, double>>& raw_nodes = handler.getNodes();
-    map<size_t, graph_vertex_descriptor> vertex_table;
-    Converter& latlon_converter = Converter::getInstance();
+    const vector<pair<double, double>>& raw_nodes = node_handler->getNodes();
+    if (node_handler->numLocated() < node_handler->size()) {
+        printf("WARNING: %lu nodes used by the ways are missing from %s, the "
+               "ways are cut there.\n",
+               node_handler->size() - node_handler->numLocated(),
+               filename.c_str());
+    }
+
+    // Create a vertex for every located node, then project all of them at
+    // once (which selects the UTM zone from their centroid if the scene has
+    // none yet)
+    const graph_vertex_descriptor NO_VERTEX = graph_t::null_vertex();
+    vector<graph_vertex_descriptor> vertex_table(raw_nodes.size(), NO_VERTEX);
+    vector<double> vertex_lat;
+    vector<double> vertex_lon;
+    for (size_t node_idx = 0; node_idx < raw_nodes.size(); ++node_idx) {
+        if (!node_handler->isLocated(node_idx)) continue;
+        vertex_table[node_idx] =
+            static_cast<graph_vertex_descriptor>(vertex_lat.size());
+        vertex_lat.push_back(raw_nodes[node_idx].first);
+        vertex_lon.push_back(raw_nodes[node_idx].second);
+    }
+
+    size_t n_vertices = vertex_lat.size();
+    vector<float> vertex_easting(n_vertices);
+    vector<float> vertex_northing(n_vertices);
+    Converter::getInstance().convertLatLonToXY(
+        n_vertices, vertex_lat.data(), vertex_lon.data(),
+        vertex_easting.data(), vertex_northing.data());
+    vector<GraphNode> graph_nodes(n_vertices);
+    for (size_t v = 0; v < n_vertices; ++v) {
+        float easting = vertex_easting[v];
+        float northing = vertex_northing[v];
+        graph_nodes[v].easting = easting;
+        graph_nodes[v].northing = northing;
+        if (easting < m_boundBox[0]) {
+            m_boundBox[0] = easting;
+        }
+        if (easting > m_boundBox[1]) {
+            m_boundBox[1] = easting;
+        }
+        if (northing < m_boundBox[2]) {
+            m_boundBox[2] = northing;
+        }
+        if (northing > m_boundBox[3]) {
+            m_boundBox[3] = northing;
+        }
+    }
+
+    // Collect the edges, then build the graph at once
+    vector<uint32_t> edge_sources;
+    vector<uint32_t> edge_targets;
+    vector<GraphEdge> graph_edges;
     for (const auto& a_way : raw_ways) {
-        graph_vertex_descriptor prev_v;
+        graph_vertex_descriptor prev_v = NO_VERTEX;
         vector<graph_vertex_descriptor> indexed_road;
-        for (size_t i = 0; i < a_way.node_idxs.size(); ++i) {
-            graph_vertex_descriptor v;
-            pair<double, double> node_loc = raw_nodes[a_way.node_idxs[i]];
-            if (vertex_table.find(a_way.node_idxs[i]) != vertex_table.end()) {
-                v = vertex_table[a_way.node_idxs[i]];
-            } else {
-                // Add a new node
-                v = boost::add_vertex(m_graph);
-                vertex_table[a_way.node_idxs[i]] = v;
-                float easting, northing;
-                latlon_converter.convertLatLonToXY(
-                    node_loc.first, node_loc.second, easting, northing);
-                m_graph[v].easting = easting;
-                m_graph[v].northing = northing;
-                if (easting < m_boundBox[0]) {
-                    m_boundBox[0] = easting;
-                }
-                if (easting > m_boundBox[1]) {
-                    m_boundBox[1] = easting;
-                }
-                if (northing < m_boundBox[2]) {
-                    m_boundBox[2] = northing;
-                }
-                if (northing > m_boundBox[3]) {
-                    m_boundBox[3] = northing;
+        for (size_t i = 0; i < a_way.node_ids.size(); ++i) {
+            graph_vertex_descriptor v =
+                vertex_table[node_handler->index(a_way.node_ids[i])];
+            if (v == NO_VERTEX) {
+                // Missing node: the road continues as a new one
+                if (!indexed_road.empty()) {
+                    m_indexedRoads.push_back(indexed_road);
+                    indexed_road.clear();
                 }
+                continue;
             }
 
             indexed_road.push_back(v);
-            if (i > 0) {
+            if (indexed_road.size() > 1) {
                 // Add edge
-                float edge_length =
-                    distance(m_graph[prev_v].easting, m_graph[prev_v].northing,
-                             m_graph[v].easting, m_graph[v].northing);
-
-                auto e = boost::add_edge(prev_v, v, m_graph);
-                if (e.second) {
-                    m_graph[e.first].length = edge_length;
-                    m_graph[e.first].type = a_way.type;
-                }
+                GraphEdge edge;
+                edge.length = distance(
+                    graph_nodes[prev_v].easting, graph_nodes[prev_v].northing,
+                    graph_nodes[v].easting, graph_nodes[v].northing);
+                edge.type = a_way.type;
+                edge_sources.push_back(prev_v);
+                edge_targets.push_back(v);
+                graph_edges.push_back(edge);
 
                 // If is not oneway, add opposite edge
                 if (!a_way.is_oneway) {
-                    auto e = boost::add_edge(v, prev_v, m_graph);
-                    if (e.second) {
-                        m_graph[e.first].length = edge_length;
-                        m_graph[e.first].type = a_way.type;
-                    }
+                    edge_sources.push_back(v);
+                    edge_targets.push_back(prev_v);
+                    graph_edges.push_back(edge);
                 }
             }
             prev_v = v;
         }
-        m_indexedRoads.push_back(indexed_road);
+        if (!indexed_road.empty()) {
+            m_indexedRoads.push_back(indexed_road);
+        }
     }
+    m_graph.build(graph_nodes, edge_sources, edge_targets, graph_edges);
 
     updateBBOX(m_boundBox[0], m_boundBox[1], m_boundBox[2], m_boundBox[3]);
     printf("OpenStreetMap Loaded, there are %lu ways, %lu nodes\n",
-           handler.getWays().size(), handler.getNodes().size());
+           handler.getWays().size(), node_handler->numLocated());
     printf("\tThe graph has %lu nodes, %lu edges\n",
-           boost::num_vertices(m_graph), boost::num_edges(m_graph));
+           num_vertices(m_graph), num_edges(m_graph));
     printf("\tupdated bbox: %.2f, %.2f, %.2f, %.2f\n", m_boundBox[0],
            m_boundBox[1], m_boundBox[2], m_boundBox[3]);
 
     return true;
 }
 
+/*=====================================================================================
+        Graph Snapshot
+
+        Binary file stored next to the map file (<filename>.snapshot). Layout:
+            OsmSnapshotHeader
+            column 0 ... column NUM_SNAPSHOT_COLUMNS - 1 (each 64-byte aligned)
+        The snapshot is only used when the size / mtime of the map file match
+        the ones recorded in the header. Edges are stored in the order of the
+        graph, so that rebuilding it from the snapshot does not move them.
+=====================================================================================*/
+static const char OSM_SNAPSHOT_MAGIC[8] = {'O', 'S', 'M', 'G',
+                                           'R', 'A', 'P', 'H'};
+static const uint32_t OSM_SNAPSHOT_VERSION = 2;
+static const size_t OSM_SNAPSHOT_ALIGNMENT = 64;
+
+enum OsmSnapshotColumn {
+    SNAPSHOT_VERTEX_EASTING = 0,
+    SNAPSHOT_VERTEX_NORTHING,
+    SNAPSHOT_EDGE_SOURCE,
+    SNAPSHOT_EDGE_TARGET,
+    SNAPSHOT_EDGE_LENGTH,
+    SNAPSHOT_EDGE_TYPE,
+    SNAPSHOT_ROAD_OFFSET,  // numRoads + 1 offsets into the road vertices
+    SNAPSHOT_ROAD_VERTEX,
+    NUM_SNAPSHOT_COLUMNS
+};
+
+struct OsmSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numColumns;
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t numVertices;
+    uint64_t numEdges;
+    uint64_t numRoads;
+    uint64_t numRoadVertices;
+    int32_t utmZone;  // projection of the vertex coordinates
+    uint32_t utmSouth;
+    float boundBox[4];
+    uint64_t columnOffset[NUM_SNAPSHOT_COLUMNS];
+    uint64_t columnBytes[NUM_SNAPSHOT_COLUMNS];
+};
+
+template <typename T>
+static bool writeSnapshotColumn(FILE* fp, const T* data, size_t n,
+                                OsmSnapshotColumn column,
+                                OsmSnapshotHeader& header) {
+    static const char padding[OSM_SNAPSHOT_ALIGNMENT] = {0};
+    long pos = ftell(fp);
+    if (pos < 0) return false;
+    size_t pad = (OSM_SNAPSHOT_ALIGNMENT - pos % OSM_SNAPSHOT_ALIGNMENT) %
+                 OSM_SNAPSHOT_ALIGNMENT;
+    if (pad > 0 && fwrite(padding, 1, pad, fp) != pad) return false;
+
+    header.columnOffset[column] = pos + pad;
+    header.columnBytes[column] = n * sizeof(T);
+    if (n > 0 && fwrite(data, sizeof(T), n, fp) != n) return false;
+    return true;
+}
+
+// Column of n values read in place from the mapped snapshot, or nullptr if
+// it does not fit the file
+template <typename T>
+static const T* snapshotColumn(const MappedFile& file,
+                               const OsmSnapshotHeader& header,
+                               OsmSnapshotColumn column, size_t n) {
+    uint64_t offset = header.columnOffset[column];
+    uint64_t bytes = header.columnBytes[column];
+    if (bytes != n * sizeof(T) || offset % alignof(T) != 0 ||
+        offset > file.size() || bytes > file.size() - offset) {
+        return nullptr;
+    }
+    return reinterpret_cast<const T*>(file.data() + offset);
+}
+
+bool OpenStreetMap::loadSnapshot(const string& snapshot_filename,
+                                 const string& source_filename) {
+    FileFingerprint fingerprint;
+    if (!FileFingerprint::get(source_filename, fingerprint)) {
+        return false;
+    }
+
+    MappedFile file;
+    if (!file.open(snapshot_filename)) {
+        return false;
+    }
+
+    OsmSnapshotHeader header;
+    if (file.size() < sizeof(OsmSnapshotHeader)) {
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(OsmSnapshotHeader));
+    if (memcmp(header.magic, OSM_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != OSM_SNAPSHOT_VERSION ||
+        header.numColumns != NUM_SNAPSHOT_COLUMNS || header.utmZone < 1 ||
+        header.utmZone > 60) {
+        return false;
+    }
+    if (header.sourceSize != fingerprint.size ||
+        header.sourceMtime != fingerprint.mtime) {
+        printf("Map snapshot %s is outdated, reloading from source.\n",
+               snapshot_filename.c_str());
+        return false;
+    }
+
+    // The vertex coordinates are only valid in the zone they were projected to
+    Converter& latlon_converter = Converter::getInstance();
+    if (latlon_converter.hasUTMZone() &&
+        (latlon_converter.utmZone() != header.utmZone ||
+         latlon_converter.isSouth() != (header.utmSouth != 0))) {
+        printf("Map snapshot %s is in another UTM zone, reloading from "
+               "source.\n",
+               snapshot_filename.c_str());
+        return false;
+    }
+
+    clear();
+    HPTimer timer;
+
+    size_t n_vertices = header.numVertices;
+    size_t n_edges = header.numEdges;
+    size_t n_roads = header.numRoads;
+    size_t n_road_vertices = header.numRoadVertices;
+    // The columns are read in place: the graph and the roads are built
+    // straight from the mapping
+    const float* vertex_easting =
+        snapshotColumn<float>(file, header, SNAPSHOT_VERTEX_EASTING,
+                              n_vertices);
+    const float* vertex_northing =
+        snapshotColumn<float>(file, header, SNAPSHOT_VERTEX_NORTHING,
+                              n_vertices);
+    const uint32_t* edge_sources =
+        snapshotColumn<uint32_t>(file, header, SNAPSHOT_EDGE_SOURCE, n_edges);
+    const uint32_t* edge_targets =
+        snapshotColumn<uint32_t>(file, header, SNAPSHOT_EDGE_TARGET, n_edges);
+    const float* edge_length =
+        snapshotColumn<float>(file, header, SNAPSHOT_EDGE_LENGTH, n_edges);
+    const int32_t* edge_type =
+        snapshotColumn<int32_t>(file, header, SNAPSHOT_EDGE_TYPE, n_edges);
+    const uint64_t* road_offsets = snapshotColumn<uint64_t>(
+        file, header, SNAPSHOT_ROAD_OFFSET, n_roads + 1);
+    const uint32_t* road_vertices = snapshotColumn<uint32_t>(
+        file, header, SNAPSHOT_ROAD_VERTEX, n_road_vertices);
+    bool success = vertex_easting && vertex_northing && edge_sources &&
+                   edge_targets && edge_length && edge_type && road_offsets &&
+                   road_vertices;
+    for (size_t e = 0; e < n_edges && success; ++e) {
+        success = edge_sources[e] < n_vertices && edge_targets[e] < n_vertices;
+    }
+    for (size_t i = 0; i < n_road_vertices && success; ++i) {
+        success = road_vertices[i] < n_vertices;
+    }
+    for (size_t r = 0; r < n_roads && success; ++r) {
+        success = road_offsets[r] <= road_offsets[r + 1];
+    }
+    if (!success || road_offsets[0] != 0 ||
+        road_offsets[n_roads] != n_road_vertices) {
+        fprintf(stderr, "ERROR: map snapshot %s is corrupted.\n",
+                snapshot_filename.c_str());
+        return false;
+    }
+
+    vector<GraphNode> graph_nodes(n_vertices);
+    for (size_t v = 0; v < n_vertices; ++v) {
+        graph_nodes[v].easting = vertex_easting[v];
+        graph_nodes[v].northing = vertex_northing[v];
+    }
+    vector<GraphEdge> graph_edges(n_edges);
+    for (size_t e = 0; e < n_edges; ++e) {
+        graph_edges[e].length = edge_length[e];
+        graph_edges[e].type = edge_type[e];
+    }
+    m_graph.build(graph_nodes, edge_sources, edge_targets, graph_edges);
+
+    m_indexedRoads.resize(n_roads);
+    for (size_t r = 0; r < n_roads; ++r) {
+        m_indexedRoads[r].assign(road_vertices + road_offsets[r],
+                                 road_vertices + road_offsets[r + 1]);
+    }
+    for (int i = 0; i < 4; ++i) {
+        m_boundBox[i] = header.boundBox[i];
+    }
+    if (!latlon_converter.hasUTMZone()) {
+        latlon_converter.setUTMZone(header.utmZone, header.utmSouth != 0);
+    }
+    m_filename = source_filename;
+
+    updateBBOX(m_boundBox[0], m_boundBox[1], m_boundBox[2], m_boundBox[3]);
+    printf("OpenStreetMap loaded from snapshot %s in %.2f sec\n",
+           snapshot_filename.c_str(), timer.time() / 1000.0);
+    printf("\tThe graph has %lu nodes, %lu edges\n", num_vertices(m_graph),
+           num_edges(m_graph));
+    return true;
+}
+
+bool OpenStreetMap::saveSnapshot(const string& snapshot_filename,
+                                 const string& source_filename) const {
+    FileFingerprint fingerprint;
+    if (!FileFingerprint::get(source_filename, fingerprint)) {
+        return false;
+    }
+
+    size_t n_vertices = num_vertices(m_graph);
+    size_t n_edges = num_edges(m_graph);
+    vector<float> vertex_easting(n_vertices), vertex_northing(n_vertices);
+    for (size_t v = 0; v < n_vertices; ++v) {
+        vertex_easting[v] = m_graph[v].easting;
+        vertex_northing[v] = m_graph[v].northing;
+    }
+    vector<uint32_t> edge_sources(n_edges), edge_targets(n_edges);
+    vector<float> edge_length(n_edges);
+    vector<int32_t> edge_type(n_edges);
+    for (size_t e = 0; e < n_edges; ++e) {
+        graph_edge_descriptor edge(static_cast<uint32_t>(e));
+        edge_sources[e] = source(edge, m_graph);
+        edge_targets[e] = target(edge, m_graph);
+        edge_length[e] = m_graph[edge].length;
+        edge_type[e] = m_graph[edge].type;
+    }
+    vector<uint64_t> road_offsets(1, 0);
+    vector<uint32_t> road_vertices;
+    for (const auto& road : m_indexedRoads) {
+        road_vertices.insert(road_vertices.end(), road.begin(), road.end());
+        road_offsets.push_back(road_vertices.size());
+    }
+
+    OsmSnapshotHeader header;
+    memset(&header, 0, sizeof(OsmSnapshotHeader));
+    memcpy(header.magic, OSM_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = OSM_SNAPSHOT_VERSION;
+    header.numColumns = NUM_SNAPSHOT_COLUMNS;
+    header.sourceSize = fingerprint.size;
+    header.sourceMtime = fingerprint.mtime;
+    header.numVertices = n_vertices;
+    header.numEdges = n_edges;
+    header.numRoads = m_indexedRoads.size();
+    header.numRoadVertices = road_vertices.size();
+    header.utmZone = Converter::getInstance().utmZone();
+    header.utmSouth = Converter::getInstance().isSouth() ? 1 : 0;
+    for (int i = 0; i < 4; ++i) {
+        header.boundBox[i] = m_boundBox[i];
+    }
+
+    string tmp_filename = snapshot_filename + ".tmp";
+    FILE* fp = fopen(tmp_filename.c_str(), "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "WARNING: cannot create map snapshot %s\n",
+                snapshot_filename.c_str());
+        return false;
+    }
+
+    bool success =
+        fwrite(&header, sizeof(OsmSnapshotHeader), 1, fp) == 1 &&
+        writeSnapshotColumn(fp, vertex_easting.data(), n_vertices,
+                            SNAPSHOT_VERTEX_EASTING, header) &&
+        writeSnapshotColumn(fp, vertex_northing.data(), n_vertices,
+                            SNAPSHOT_VERTEX_NORTHING, header) &&
+        writeSnapshotColumn(fp, edge_sources.data(), n_edges,
+                            SNAPSHOT_EDGE_SOURCE, header) &&
+        writeSnapshotColumn(fp, edge_targets.data(), n_edges,
+                            SNAPSHOT_EDGE_TARGET, header) &&
+        writeSnapshotColumn(fp, edge_length.data(), n_edges,
+                            SNAPSHOT_EDGE_LENGTH, header) &&
+        writeSnapshotColumn(fp, edge_type.data(), n_edges, SNAPSHOT_EDGE_TYPE,
+                            header) &&
+        writeSnapshotColumn(fp, road_offsets.data(), road_offsets.size(),
+                            SNAPSHOT_ROAD_OFFSET, header) &&
+        writeSnapshotColumn(fp, road_vertices.data(), road_vertices.size(),
+                            SNAPSHOT_ROAD_VERTEX, header);
+
+    // Rewrite the header now that the column offsets are known
+    success = success && fseek(fp, 0, SEEK_SET) == 0 &&
+              fwrite(&header, sizeof(OsmSnapshotHeader), 1, fp) == 1;
+    success = (fclose(fp) == 0) && success;
+
+    if (!success || !commitTemporaryFile(tmp_filename, snapshot_filename)) {
+        fprintf(stderr, "WARNING: failed to write map snapshot %s\n",
+                snapshot_filename.c_str());
+        remove(tmp_filename.c_str());
+        return false;
+    }
+
+    printf("Map snapshot saved to %s\n", snapshot_filename.c_str());
+    return true;
+}
+/*=====================================================================================
+        End of Graph Snapshot
+=====================================================================================*/
+
+const SegmentIndex& OpenStreetMap::edgeIndex() const {
+    if (m_edgeIndexBuilt.load(std::memory_order_acquire)) {
+        return m_edgeIndex;
+    }
+    std::lock_guard<std::mutex> lock(m_edgeIndexMutex);
+    if (m_edgeIndexBuilt.load(std::memory_order_relaxed)) {
+        return m_edgeIndex;
+    }
+    size_t n_edges = num_edges(m_graph);
+    m_segmentEdges.reserve(n_edges);
+    vector<float> start_x, start_y, end_x, end_y;
+    start_x.reserve(n_edges);
+    start_y.reserve(n_edges);
+    end_x.reserve(n_edges);
+    end_y.reserve(n_edges);
+    auto es = edges(m_graph);
+    for (auto eit = es.first; eit != es.second; ++eit) {
+        const GraphNode& source_v = m_graph[source(*eit, m_graph)];
+        const GraphNode& target_v = m_graph[target(*eit, m_graph)];
+        start_x.push_back(source_v.easting);
+        start_y.push_back(source_v.northing);
+        end_x.push_back(target_v.easting);
+        end_y.push_back(target_v.northing);
+        m_segmentEdges.push_back(*eit);
+    }
+    m_edgeIndex.build(
+        PointSpans<float>(start_x.data(), start_y.data(), start_x.size()),
+        PointSpans<float>(end_x.data(), end_y.data(), end_x.size()));
+    m_edgeIndexBuilt.store(true, std::memory_order_release);
+    return m_edgeIndex;
+}
+
+/*=====================================================================================
+        Edge headings
+
+        Heading in degrees of a direction (dx, dy), counterclockwise from the
+        x axis in [0, 360) and truncated, like vector2fToHeading() but without
+        printing on zero-length directions (which give 0). atan(z) on [0, 1]
+        is a minimax polynomial accurate to 1e-5 rad. Four directions per
+        iteration with SSE2, the scalar version is the same sequence of
+        operations.
+=====================================================================================*/
+static const float HEADING_ATAN_COEFFS[6] = {0.99997726f, -0.33262347f,
+                                             0.19354346f, -0.11643287f,
+                                             0.05265332f, -0.01172120f};
+
+static inline int headingOf(float dx, float dy) {
+    float ax = std::fabs(dx);
+    float ay = std::fabs(dy);
+    float z = std::min(ax, ay) /
+              std::max(std::max(ax, ay), numeric_limits<float>::min());
+    float z2 = z * z;
+    float p = HEADING_ATAN_COEFFS[5];
+    for (int k = 4; k >= 0; --k) {
+        p = p * z2 + HEADING_ATAN_COEFFS[k];
+    }
+    float a = z * p;
+    a = ay > ax ? 0.5f * PI - a : a;
+    a = dx < 0.0f ? PI - a : a;
+    float angle = a * (180.0f / PI);
+    angle = dy < 0.0f ? 360.0f - angle : angle;
+    return static_cast<int>(angle);
+}
+
+#if defined(__SSE2__)
+// mask ? a : b
+static inline __m128 selectSSE2(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+#endif
+
+static void computeHeadings(size_t n, const float* dx, const float* dy,
+                            int* headings) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 min_float = _mm_set1_ps(numeric_limits<float>::min());
+    const __m128 half_pi = _mm_set1_ps(0.5f * PI);
+    const __m128 pi = _mm_set1_ps(PI);
+    const __m128 rad_to_deg = _mm_set1_ps(180.0f / PI);
+    const __m128 full_turn = _mm_set1_ps(360.0f);
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(dx + i);
+        __m128 y = _mm_loadu_ps(dy + i);
+        __m128 ax = _mm_andnot_ps(sign_mask, x);
+        __m128 ay = _mm_andnot_ps(sign_mask, y);
+        __m128 z = _mm_div_ps(_mm_min_ps(ax, ay),
+                              _mm_max_ps(_mm_max_ps(ax, ay), min_float));
+        __m128 z2 = _mm_mul_ps(z, z);
+        __m128 p = _mm_set1_ps(HEADING_ATAN_COEFFS[5]);
+        for (int k = 4; k >= 0; --k) {
+            p = _mm_add_ps(_mm_mul_ps(p, z2),
+                           _mm_set1_ps(HEADING_ATAN_COEFFS[k]));
+        }
+        __m128 a = _mm_mul_ps(z, p);
+        a = selectSSE2(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(half_pi, a), a);
+        a = selectSSE2(_mm_cmplt_ps(x, zero), _mm_sub_ps(pi, a), a);
+        __m128 angle = _mm_mul_ps(a, rad_to_deg);
+        angle = selectSSE2(_mm_cmplt_ps(y, zero),
+                           _mm_sub_ps(full_turn, angle), angle);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(headings + i),
+                         _mm_cvttps_epi32(angle));
+    }
+#endif
+    for (; i < n; ++i) {
+        headings[i] = headingOf(dx[i], dy[i]);
+    }
+}
+/*=====================================================================================
+        End of Edge headings
+=====================================================================================*/
+
 void OpenStreetMap::computeMapPointCloud() {
-    m_mapPoints->clear();
+    m_searchTree.clear();
+    m_headingIndex.clear();
+    m_mapPointEasting.clear();
+    m_mapPointNorthing.clear();
     m_pointHeading.clear();
     m_graphVertices.clear();
     m_pointEdgeIds.clear();
     printf("Start interpolating OpenStreetMap with %.1f meter accuracy......",
            m_interpolation);
-    // Iterate over the edges
-    auto es = boost::edges(m_graph);
-    for (auto eit = es.first; eit != es.second; ++eit) {
-        if (m_graph[*eit].length < 0.1f) {
-            // Ignore very short edges
-            continue;
+    size_t n_edges = num_edges(m_graph);
+    size_t num_threads = numWorkerThreads();
+
+    // Number of points of each edge (its two ends and the points inserted
+    // every m_interpolation meters, none for very short edges) and its
+    // heading
+    vector<uint64_t> edge_offsets(n_edges + 1, 0);
+    vector<int> edge_heading(n_edges);
+    parallelFor(n_edges, num_threads, [&](size_t begin, size_t end, size_t) {
+        vector<float> dx(end - begin), dy(end - begin);
+        for (size_t e = begin; e < end; ++e) {
+            graph_edge_descriptor edge(static_cast<uint32_t>(e));
+            const GraphNode& source_v = m_graph[source(edge, m_graph)];
+            const GraphNode& target_v = m_graph[target(edge, m_graph)];
+            dx[e - begin] = target_v.easting - source_v.easting;
+            dy[e - begin] = target_v.northing - source_v.northing;
+
+            float length = m_graph[edge].length;
+            uint64_t n_pt = 0;
+            if (length >= 0.1f) {
+                n_pt = 2;
+                if (length > m_interpolation) {
+                    n_pt += static_cast<uint64_t>(
+                        floor(length / m_interpolation));
+                }
+            }
+            edge_offsets[e + 1] = n_pt;
         }
+        computeHeadings(end - begin, dx.data(), dy.data(),
+                        edge_heading.data() + begin);
+    });
+    for (size_t e = 0; e < n_edges; ++e) {
+        edge_offsets[e + 1] += edge_offsets[e];
+    }
 
-        auto source_v = source(*eit, m_graph);
-        auto target_v = target(*eit, m_graph);
+    // Every edge fills its own range of the point columns
+    size_t n_points = edge_offsets.back();
+    m_mapPointEasting.resize(n_points);
+    m_mapPointNorthing.resize(n_points);
+    m_pointHeading.resize(n_points);
+    m_graphVertices.resize(n_points);
+    m_pointEdgeIds.resize(n_points);
+    parallelFor(n_edges, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t e = begin; e < end; ++e) {
+            size_t first = edge_offsets[e];
+            size_t n_pt = edge_offsets[e + 1] - first;
+            if (n_pt == 0) continue;
+
+            graph_edge_descriptor edge(static_cast<uint32_t>(e));
+            graph_vertex_descriptor source_v = source(edge, m_graph);
+            graph_vertex_descriptor target_v = target(edge, m_graph);
+            float start_x = m_graph[source_v].easting;
+            float start_y = m_graph[source_v].northing;
+            float end_x = m_graph[target_v].easting;
+            float end_y = m_graph[target_v].northing;
+            std::fill_n(m_pointHeading.begin() + first, n_pt,
+                        edge_heading[e]);
+            std::fill_n(m_pointEdgeIds.begin() + first, n_pt, edge);
+
+            // Start point
+            m_mapPointEasting[first] = start_x;
+            m_mapPointNorthing[first] = start_y;
+            m_graphVertices[first] = source_v;
 
-        Eigen::Vector2f start_pt(m_graph[source_v].easting,
-                                 m_graph[source_v].northing);
-        Eigen::Vector2f end_pt(m_graph[target_v].easting,
-                               m_graph[target_v].northing);
-
-        Eigen::Vector2f dir = end_pt - start_pt;
-
-        int heading = vector2fToHeading(dir);
-
-        MapPointType point;
-        point.setCoordinate(start_pt[0], start_pt[1], 0.0f);
-        m_mapPoints->push_back(point);
-        m_pointHeading.push_back(heading);
-        m_graphVertices.push_back(source_v);
-        m_pointEdgeIds.push_back(*eit);
-
-        if (m_graph[*eit].length > m_interpolation) {
-            // Insert point
-            int n_pt_to_insert = floor(m_graph[*eit].length / m_interpolation);
-            // Normalize direction
-            dir /= m_graph[*eit].length;
-            float delta_length = m_graph[*eit].length / (n_pt_to_insert + 1);
-            for (size_t i = 0; i < n_pt_to_insert; ++i) {
-                Eigen::Vector2f pt = start_pt + dir * (i + 1) * delta_length;
-                point.setCoordinate(pt[0], pt[1], 0.0f);
-                m_mapPoints->push_back(point);
-                m_pointHeading.push_back(heading);
-                m_pointEdgeIds.push_back(*eit);
-                if (i < n_pt_to_insert / 2) {
-                    m_graphVertices.push_back(source_v);
-                } else {
-                    m_graphVertices.push_back(target_v);
+            // Inserted points, the first half closer to the source vertex
+            size_t n_pt_to_insert = n_pt - 2;
+            if (n_pt_to_insert > 0) {
+                float length = m_graph[edge].length;
+                float dir_x = (end_x - start_x) / length;
+                float dir_y = (end_y - start_y) / length;
+                float delta_length = length / (n_pt_to_insert + 1);
+                for (size_t i = 0; i < n_pt_to_insert; ++i) {
+                    float step = static_cast<float>(i + 1);
+                    size_t pt = first + 1 + i;
+                    m_mapPointEasting[pt] =
+                        start_x + dir_x * step * delta_length;
+                    m_mapPointNorthing[pt] =
+                        start_y + dir_y * step * delta_length;
+                    m_graphVertices[pt] =
+                        i < n_pt_to_insert / 2 ? source_v : target_v;
                 }
             }
+
+            // End point
+            size_t last = first + n_pt - 1;
+            m_mapPointEasting[last] = end_x;
+            m_mapPointNorthing[last] = end_y;
+            m_graphVertices[last] = target_v;
         }
+    });
+
+    PointSpans<float> points(m_mapPointEasting.data(),
+                             m_mapPointNorthing.data(),
+                             m_mapPointEasting.size());
+    m_headingIndex.build(points, m_pointHeading.data());
 
-        // Insert the end point
-        point.setCoordinate(end_pt[0], end_pt[1], 0.0f);
-        m_mapPoints->push_back(point);
-        m_pointHeading.push_back(heading);
-        m_graphVertices.push_back(target_v);
-        m_pointEdgeIds.push_back(*eit);
+    // The map points only depend on the map file, the interpolation and the
+    // UTM zone: reuse the index saved next to the map while they and the
+    // build parameters of the index match
+    FileFingerprint source;
+    bool persistent =
+        !m_filename.empty() && FileFingerprint::get(m_filename, source);
+    string index_filename = m_filename + ".index";
+    IndexFileKey key;
+    if (persistent) {
+        Converter& latlon_converter = Converter::getInstance();
+        key.setSource(source);
+        key.params[0] = m_interpolation;
+        key.params[1] = latlon_converter.utmZone();
+        key.params[2] = latlon_converter.isSouth() ? 1.0 : 0.0;
+        // Build parameters of the backends (the backend is the key type)
+        key.params[3] = m_searchTree.kdTree().params().leafSize;
+        key.params[4] = m_searchTree.grid().params().cellSize;
+        if (m_searchTree.load(index_filename, points, key)) {
+            printf("done (index loaded from %s).\n", index_filename.c_str());
+            return;
+        }
+    }
+
+    m_searchTree.build(points);
+    if (persistent) {
+        m_searchTree.save(index_filename, key);
+    }
+    printf("done.\n");
+}
+
+void OpenStreetMap::computeRouter() {
+    m_router.clear();
+    printf("Start building the routing hierarchy......");
+
+    // The edge lengths only depend on the map file and the UTM zone
+    FileFingerprint source;
+    bool persistent =
+        !m_filename.empty() && FileFingerprint::get(m_filename, source);
+    string router_filename = m_filename + ".ch";
+    IndexFileKey key;
+    if (persistent) {
+        Converter& latlon_converter = Converter::getInstance();
+        key.setSource(source);
+        key.params[0] = latlon_converter.utmZone();
+        key.params[1] = latlon_converter.isSouth() ? 1.0 : 0.0;
+        if (m_router.load(router_filename, m_graph, key)) {
+            printf("done (loaded from %s).\n", router_filename.c_str());
+            return;
+        }
     }
 
-    m_searchTree->setInputCloud(m_mapPoints);
+    m_router.build(m_graph);
+    if (persistent && !m_router.empty()) {
+        m_router.save(router_filename, key);
+    }
     printf("done.\n");
 }
 
@@ -299,16 +911,16 @@ void OpenStreetMap::updateVBO() {
     vector<RenderableObject::Vertex> pointData;
 
     glm::vec4 vertex_color(1.0f, 1.0f, 0.0f, 0.5f);
-    auto vs = boost::vertices(m_graph);
+    auto vs = vertices(m_graph);
     for (auto vit = vs.first; vit != vs.second; ++vit) {
-        auto out_es = boost::out_edges(*vit, m_graph);
-        auto in_es = boost::in_edges(*vit, m_graph);
+        auto out_es = out_edges(*vit, m_graph);
+        auto in_es = in_edges(*vit, m_graph);
         set<graph_vertex_descriptor> neighbors;
         for (auto eit = in_es.first; eit != in_es.second; ++eit) {
-            neighbors.emplace(boost::source(*eit, m_graph));
+            neighbors.emplace(source(*eit, m_graph));
         }
         for (auto eit = out_es.first; eit != out_es.second; ++eit) {
-            neighbors.emplace(boost::target(*eit, m_graph));
+            neighbors.emplace(target(*eit, m_graph));
         }
         int n_neighbors = neighbors.size();
         m_graph[*vit].nNeighbors = n_neighbors;
@@ -321,7 +933,7 @@ void OpenStreetMap::updateVBO() {
         }
     }
 
-    auto es = boost::edges(m_graph);
+    auto es = edges(m_graph);
     for (auto eit = es.first; eit != es.second; ++eit) {
         glm::vec4 edge_color = getWayColor(m_graph[*eit].type);
 
@@ -348,11 +960,19 @@ void OpenStreetMap::updateVBO() {
 
 void OpenStreetMap::clear() {
     m_dataUpdated = false;
+    m_filename.clear();
 
-    m_mapPoints->clear();
+    m_edgeIndex.clear();
+    m_segmentEdges.clear();
+    m_edgeIndexBuilt = false;
+    m_searchTree.clear();
+    m_headingIndex.clear();
+    m_mapPointEasting.clear();
+    m_mapPointNorthing.clear();
     m_pointHeading.clear();
     m_graphVertices.clear();
     m_pointEdgeIds.clear();
+    m_router.clear();
 
     m_indexedRoads.clear();
     m_boundBox = Eigen::Vector4f(POSITIVE_INFINITY, -POSITIVE_INFINITY,
@@ -367,3 +987,130 @@ bool OpenStreetMap::isEmpty() {
     }
     return false;
 }
+
+bool OpenStreetMap::nearestWithHeading(float x, float y, float heading,
+                                       float max_angle, float radius,
+                                       graph_edge_descriptor& edge) const {
+    uint32_t point;
+    if (!m_headingIndex.nearest(x, y, heading, max_angle, radius, point)) {
+        return false;
+    }
+    edge = m_pointEdgeIds[point];
+    return true;
+}
+
+void OpenStreetMap::toEdgeSnap(const SegmentSnap& snap,
+                               EdgeSnap& result) const {
+    result.edge = m_segmentEdges[snap.segment];
+    result.easting = static_cast<float>(snap.x);
+    result.northing = static_cast<float>(snap.y);
+    result.offset = static_cast<float>(snap.offset);
+    result.distance = static_cast<float>(std::sqrt(snap.sqrDistance));
+}
+
+bool OpenStreetMap::snap(float x, float y, EdgeSnap& result,
+                         float max_distance) const {
+    SegmentSnap segment_snap;
+    if (!edgeIndex().snap(x, y, segment_snap, max_distance)) {
+        return false;
+    }
+    toEdgeSnap(segment_snap, result);
+    return true;
+}
+
+size_t OpenStreetMap::nearestEdges(float x, float y, size_t k,
+                                   vector<EdgeSnap>& results) const {
+    vector<SegmentSnap> segment_snaps;
+    edgeIndex().nearestKSegments(x, y, k, segment_snaps);
+    results.resize(segment_snaps.size());
+    for (size_t i = 0; i < segment_snaps.size(); ++i) {
+        toEdgeSnap(segment_snaps[i], results[i]);
+    }
+    return results.size();
+}
+
+// A snapped position lies on its edge and, on a two-way road, on the
+// reverse edge. Returns the number of these edges, with the offset of the
+// position along each.
+static int snapDirections(const graph_t& graph, const EdgeSnap& snap,
+                          graph_edge_descriptor edges[2], float offsets[2]) {
+    edges[0] = snap.edge;
+    offsets[0] = snap.offset;
+    auto reverse = edge(target(snap.edge, graph), source(snap.edge, graph),
+                        graph);
+    if (!reverse.second || reverse.first == snap.edge) return 1;
+    edges[1] = reverse.first;
+    offsets[1] = std::max(0.0f, graph[reverse.first].length - snap.offset);
+    return 2;
+}
+
+bool OpenStreetMap::route(float x0, float y0, float x1, float y1,
+                          RoutePath& path, RouteWorkspace& workspace) const {
+    path.clear();
+    EdgeSnap from, to;
+    if (!snap(x0, y0, from) || !snap(x1, y1, to)) {
+        return false;
+    }
+    graph_edge_descriptor from_edges[2], to_edges[2];
+    float from_offsets[2], to_offsets[2];
+    int n_from = snapDirections(m_graph, from, from_edges, from_offsets);
+    int n_to = snapDirections(m_graph, to, to_edges, to_offsets);
+
+    // Leave the first edge at its target, enter the last one at its source
+    vector<RouteEndpoint> sources, targets;
+    for (int i = 0; i < n_from; ++i) {
+        float rest = m_graph[from_edges[i]].length - from_offsets[i];
+        sources.push_back(RouteEndpoint(target(from_edges[i], m_graph),
+                                        std::max(0.0f, rest)));
+    }
+    for (int i = 0; i < n_to; ++i) {
+        targets.push_back(
+            RouteEndpoint(source(to_edges[i], m_graph), to_offsets[i]));
+    }
+    bool found = m_router.empty()
+                     ? RoadRouter::aStar(m_graph, sources, targets, path,
+                                         workspace)
+                     : m_router.shortestPath(sources, targets, path,
+                                             workspace);
+    if (found) {
+        // Endpoints of the route
+        int first = 0, last = 0;
+        for (int i = 1; i < n_from; ++i) {
+            if (sources[i].vertex == path.vertices.front() &&
+                (sources[first].vertex != path.vertices.front() ||
+                 sources[i].cost < sources[first].cost)) {
+                first = i;
+            }
+        }
+        for (int i = 1; i < n_to; ++i) {
+            if (targets[i].vertex == path.vertices.back() &&
+                (targets[last].vertex != path.vertices.back() ||
+                 targets[i].cost < targets[last].cost)) {
+                last = i;
+            }
+        }
+        path.edges.insert(path.edges.begin(), from_edges[first]);
+        path.edges.push_back(to_edges[last]);
+    }
+
+    // Both positions on the same edge, the second one further along it
+    for (int i = 0; i < n_from; ++i) {
+        for (int j = 0; j < n_to; ++j) {
+            float length = to_offsets[j] - from_offsets[i];
+            if (from_edges[i] == to_edges[j] && length >= 0.0f &&
+                (!found || length < path.length)) {
+                path.clear();
+                path.length = length;
+                path.edges.push_back(from_edges[i]);
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+bool OpenStreetMap::route(float x0, float y0, float x1, float y1,
+                          RoutePath& path) const {
+    RouteWorkspace workspace;
+    return route(x0, y0, x1, y1, path, workspace);
+}
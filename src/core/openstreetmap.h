@@ -12,10 +12,13 @@
 #include "headers.h"
 #include "common.h"
 
-#include <pcl/common/common.h>
-#include <pcl/search/search.h>
+#include <atomic>
+#include <mutex>
 
-#include "pcl_wrapper.h"
+#include "heading_index.h"
+#include "point_index.h"
+#include "road_router.h"
+#include "segment_index.h"
 
 class Shader;
 class RenderableObject;
@@ -34,17 +37,43 @@ enum WayType {
     OTHER = 10
 };
 
+// A position snapped onto a graph edge
+struct EdgeSnap {
+    graph_edge_descriptor edge;
+    float easting;  // projected position
+    float northing;
+    float offset;    // distance along the edge from its source vertex
+    float distance;  // from the query position
+};
+
 class OpenStreetMap {
 public:
     OpenStreetMap();
     virtual ~OpenStreetMap();
 
-    // IO
+    // IO. The built graph is saved to / reloaded from a snapshot next to
+    // the map file (<map file>.snapshot) while the map file is unchanged.
     bool load(const string& filename);
 
-    // Interpolate map to produce a point cloud for searching
+    // Binary snapshot of the graph and the roads of source_filename
+    bool loadSnapshot(const string& snapshot_filename,
+                      const string& source_filename);
+    bool saveSnapshot(const string& snapshot_filename,
+                      const string& source_filename) const;
+
+    // Interpolate map to produce a point cloud for searching. The search tree
+    // is mapped from / saved to <map file>.index.
     void computeMapPointCloud();
 
+    // Backend of m_searchTree, takes effect at the next computeMapPointCloud()
+    void setSearchBackend(SearchBackend backend) {
+        m_searchTree.setBackend(backend);
+    }
+
+    // Contraction hierarchy of m_graph for route(). It is mapped from /
+    // saved to <map file>.ch.
+    void computeRouter();
+
     // Rendering
     void render(unique_ptr<Shader>& shader);
     void updateVBO();
@@ -54,6 +83,30 @@ public:
 
     bool isEmpty();
 
+    // Edge of the nearest map point within radius whose heading differs from
+    // heading by at most max_angle degrees. Needs computeMapPointCloud().
+    bool nearestWithHeading(float x, float y, float heading, float max_angle,
+                            float radius, graph_edge_descriptor& edge) const;
+
+    // Exact projection of (x, y) on the closest edge within max_distance, on
+    // an index of the edges built by the first call. Does not need
+    // computeMapPointCloud().
+    bool snap(float x, float y, EdgeSnap& result,
+              float max_distance = POSITIVE_INFINITY) const;
+    // The k closest edges by increasing distance. Both directions of a
+    // two-way road are returned.
+    size_t nearestEdges(float x, float y, size_t k,
+                        vector<EdgeSnap>& results) const;
+
+    // Shortest route between two positions, each snapped to its closest
+    // edge. The path edges start and end with the snapped edges, whose
+    // length only counts beyond the snapped positions, and its vertices are
+    // the graph vertices in between. Uses the hierarchy of computeRouter()
+    // if computed, A* on m_graph otherwise.
+    bool route(float x0, float y0, float x1, float y1, RoutePath& path,
+               RouteWorkspace& workspace) const;
+    bool route(float x0, float y0, float x1, float y1, RoutePath& path) const;
+
 public:
     // Publicly available data
     vector<graph_vertex_descriptor> m_graphVertices;
@@ -64,14 +117,32 @@ public:
     // Routing graph
     graph_t m_graph;
 
-    // Below is only valid after running interpolateMap()
-    pcl::PointCloud<MapPointType>::Ptr m_mapPoints;
-    pcl::search::Search<MapPointType>::Ptr m_searchTree;
+    // Below is only valid after running computeMapPointCloud()
+    vector<float> m_mapPointEasting;
+    vector<float> m_mapPointNorthing;
+    PointIndex<PointSpans<float>> m_searchTree;
     vector<int> m_pointHeading;  // Lookup heading
     vector<graph_edge_descriptor>
         m_pointEdgeIds;  // Lookup graph edge of each mapPoint
+    HeadingIndex m_headingIndex;  // map points by position and heading
+
+    // Only valid after running computeRouter()
+    RoadRouter m_router;
 
 private:
+    bool loadOSM(const string& filename);
+    // The edge index, built on first use
+    const SegmentIndex& edgeIndex() const;
+    void toEdgeSnap(const SegmentSnap& snap, EdgeSnap& result) const;
+
+    // Every graph edge as a segment, built by edgeIndex(). The mutex guards
+    // the build, the flag publishes it.
+    mutable SegmentIndex m_edgeIndex;
+    mutable vector<graph_edge_descriptor> m_segmentEdges;  // edge of segments
+    mutable std::atomic<bool> m_edgeIndexBuilt;
+    mutable std::mutex m_edgeIndexMutex;
+
+    string m_filename;  // loaded map file
     float m_interpolation;
 
     // Rendering
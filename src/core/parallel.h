@@ -0,0 +1,49 @@
+/*=====================================================================================
+                                parallel.h
+
+    Description:  Minimal helpers for splitting work over std::thread
+=====================================================================================*/
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Number of worker threads used by the parallel loaders and indices
+inline size_t numWorkerThreads() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// Split [0, n) into num_threads contiguous blocks and call
+//      func(begin, end, thread_id)
+// for each block on its own thread. The calling thread runs the last block.
+template <class Func>
+void parallelFor(size_t n, size_t num_threads, Func func) {
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > n) num_threads = std::max<size_t>(n, 1);
+
+    size_t block = (n + num_threads - 1) / num_threads;
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads - 1);
+    for (size_t t = 0; t + 1 < num_threads; ++t) {
+        size_t begin = std::min(n, t * block);
+        size_t end = std::min(n, begin + block);
+        workers.emplace_back(func, begin, end, t);
+    }
+    size_t last = num_threads - 1;
+    func(std::min(n, last * block), n, last);
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+template <class Func>
+void parallelFor(size_t n, Func func) {
+    parallelFor(n, numWorkerThreads(), func);
+}
+
+#endif /* end of include guard: PARALLEL_H_ */
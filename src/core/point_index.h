@@ -0,0 +1,109 @@
+/*=====================================================================================
+                                point_index.h
+
+    Description:  2D point index with a selectable backend
+
+        Forwards to a KdTree or a GridIndex over the same dataset adaptor.
+        The kd-tree adapts to any density; the grid is faster for fixed-radius
+        queries close to its cell size on dense data.
+=====================================================================================*/
+
+#ifndef POINT_INDEX_H_
+#define POINT_INDEX_H_
+
+#include "grid_index.h"
+#include "kdtree.h"
+
+enum class SearchBackend {
+    KdTree = 0,      // see kdtree.h
+    UniformGrid = 1  // see grid_index.h
+};
+
+template <class Dataset>
+class PointIndex {
+public:
+    PointIndex() : m_backend(SearchBackend::KdTree) {}
+
+    // Takes effect at the next build()
+    void setBackend(SearchBackend backend) { m_backend = backend; }
+    SearchBackend backend() const { return m_backend; }
+
+    // Backends, to tune their parameters
+    KdTree<Dataset>& kdTree() { return m_kdTree; }
+    GridIndex<Dataset>& grid() { return m_grid; }
+
+    void build(const Dataset& dataset) {
+        clear();
+        if (m_backend == SearchBackend::UniformGrid) {
+            m_grid.build(dataset);
+        } else {
+            m_kdTree.build(dataset);
+        }
+    }
+    void clear() {
+        m_kdTree.clear();
+        m_grid.clear();
+    }
+
+    // Save the built backend / load an index file of the current backend
+    // (see KdTree::save())
+    bool save(const string& filename, const IndexFileKey& key) const {
+        return useGrid() ? m_grid.save(filename, key)
+                         : m_kdTree.save(filename, key);
+    }
+    bool load(const string& filename, const Dataset& dataset,
+              const IndexFileKey& key) {
+        clear();
+        if (m_backend == SearchBackend::UniformGrid) {
+            return m_grid.load(filename, dataset, key);
+        }
+        return m_kdTree.load(filename, dataset, key);
+    }
+
+    size_t size() const { return m_kdTree.size() + m_grid.size(); }
+    bool empty() const { return size() == 0; }
+
+    size_t radiusSearch(double x, double y, double radius,
+                        vector<uint32_t>& indices,
+                        vector<double>& sqr_distances,
+                        size_t max_nn = 0) const {
+        return useGrid() ? m_grid.radiusSearch(x, y, radius, indices,
+                                               sqr_distances, max_nn)
+                         : m_kdTree.radiusSearch(x, y, radius, indices,
+                                                 sqr_distances, max_nn);
+    }
+    size_t nearestKSearch(double x, double y, size_t k,
+                          vector<uint32_t>& indices,
+                          vector<double>& sqr_distances) const {
+        return useGrid()
+                   ? m_grid.nearestKSearch(x, y, k, indices, sqr_distances)
+                   : m_kdTree.nearestKSearch(x, y, k, indices, sqr_distances);
+    }
+    size_t radiusSearch(double x, double y, double radius,
+                        NeighborList& neighbors, size_t max_nn = 0) const {
+        return useGrid()
+                   ? m_grid.radiusSearch(x, y, radius, neighbors, max_nn)
+                   : m_kdTree.radiusSearch(x, y, radius, neighbors, max_nn);
+    }
+    size_t nearestKSearch(double x, double y, size_t k,
+                          NeighborList& neighbors) const {
+        return useGrid() ? m_grid.nearestKSearch(x, y, k, neighbors)
+                         : m_kdTree.nearestKSearch(x, y, k, neighbors);
+    }
+    size_t boxSearch(double min_x, double max_x, double min_y, double max_y,
+                     vector<uint32_t>& indices) const {
+        return useGrid()
+                   ? m_grid.boxSearch(min_x, max_x, min_y, max_y, indices)
+                   : m_kdTree.boxSearch(min_x, max_x, min_y, max_y, indices);
+    }
+
+private:
+    // The backend that was built, whatever m_backend says now
+    bool useGrid() const { return !m_grid.empty(); }
+
+    SearchBackend m_backend;
+    KdTree<Dataset> m_kdTree;
+    GridIndex<Dataset> m_grid;
+};
+
+#endif /* end of include guard: POINT_INDEX_H_ */
@@ -0,0 +1,271 @@
+#include "radix_sort.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "parallel.h"
+
+static const int RADIX_BITS = 8;
+static const size_t RADIX_BUCKETS = size_t(1) << RADIX_BITS;
+// Below this many points per thread, splitting the work is not worth it
+static const size_t MIN_POINTS_PER_THREAD = 1 << 16;
+
+static size_t sortThreads(size_t n) {
+    return std::max<size_t>(
+        1, std::min(numWorkerThreads(), n / MIN_POINTS_PER_THREAD));
+}
+
+static void keyRange(const uint32_t* keys, size_t n, size_t num_threads,
+                     uint32_t& min_key, uint32_t& max_key) {
+    vector<uint32_t> thread_min(num_threads,
+                                numeric_limits<uint32_t>::max());
+    vector<uint32_t> thread_max(num_threads, 0);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t tid) {
+        uint32_t lo = numeric_limits<uint32_t>::max(), hi = 0;
+        for (size_t i = begin; i < end; ++i) {
+            lo = std::min(lo, keys[i]);
+            hi = std::max(hi, keys[i]);
+        }
+        thread_min[tid] = lo;
+        thread_max[tid] = hi;
+    });
+    min_key = *std::min_element(thread_min.begin(), thread_min.end());
+    max_key = *std::max_element(thread_max.begin(), thread_max.end());
+}
+
+// Number of RADIX_BITS digits needed to represent key - min_key
+static int numRadixPasses(uint32_t min_key, uint32_t max_key) {
+    uint32_t range = max_key - min_key;
+    int passes = 0;
+    while (passes * RADIX_BITS < 32 && (range >> (passes * RADIX_BITS)) != 0) {
+        ++passes;
+    }
+    return passes;
+}
+
+// Start of every maximal ascending run of keys
+static void findAscendingRuns(const uint32_t* keys, size_t n,
+                              size_t num_threads, vector<size_t>& run_begin) {
+    vector<vector<size_t>> thread_runs(num_threads);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t tid) {
+        for (size_t i = std::max<size_t>(begin, 1); i < end; ++i) {
+            if (keys[i] < keys[i - 1]) {
+                thread_runs[tid].push_back(i);
+            }
+        }
+    });
+
+    run_begin.assign(1, 0);
+    for (const auto& runs : thread_runs) {
+        run_begin.insert(run_begin.end(), runs.begin(), runs.end());
+    }
+}
+
+static int ceilLog2(size_t k) {
+    int bits = 0;
+    while ((size_t(1) << bits) < k) ++bits;
+    return bits;
+}
+
+static void radixSort(const uint32_t* keys, size_t n, uint32_t min_key,
+                      uint32_t max_key, size_t num_threads,
+                      vector<uint32_t>& sorted_ids);
+static void mergeRuns(const uint32_t* keys, size_t n,
+                      vector<size_t>& run_begin, size_t num_threads,
+                      vector<uint32_t>& sorted_ids);
+
+void sortIndicesByKey(const uint32_t* keys, size_t n,
+                      vector<uint32_t>& sorted_ids) {
+    size_t num_threads = sortThreads(n);
+    uint32_t min_key = 0, max_key = 0;
+    if (n > 0) keyRange(keys, n, num_threads, min_key, max_key);
+
+    // Both strategies stream the whole array once per pass / merge round
+    vector<size_t> run_begin;
+    findAscendingRuns(keys, n, num_threads, run_begin);
+    if (ceilLog2(run_begin.size()) <= numRadixPasses(min_key, max_key)) {
+        mergeRuns(keys, n, run_begin, num_threads, sorted_ids);
+    } else {
+        radixSort(keys, n, min_key, max_key, num_threads, sorted_ids);
+    }
+}
+
+void radixSortIndices(const uint32_t* keys, size_t n,
+                      vector<uint32_t>& sorted_ids) {
+    size_t num_threads = sortThreads(n);
+    uint32_t min_key = 0, max_key = 0;
+    if (n > 0) keyRange(keys, n, num_threads, min_key, max_key);
+    radixSort(keys, n, min_key, max_key, num_threads, sorted_ids);
+}
+
+void mergeSortIndices(const uint32_t* keys, size_t n,
+                      vector<uint32_t>& sorted_ids) {
+    size_t num_threads = sortThreads(n);
+    vector<size_t> run_begin;
+    findAscendingRuns(keys, n, num_threads, run_begin);
+    mergeRuns(keys, n, run_begin, num_threads, sorted_ids);
+}
+
+/*=====================================================================================
+        LSD radix sort
+
+        Each pass counts the digits of contiguous blocks on their own thread,
+        turns the counts into per (digit, block) output offsets, then every
+        thread scatters its block. Keys are sorted relative to the smallest
+        one, and only the bytes that vary are processed.
+=====================================================================================*/
+static void radixSort(const uint32_t* keys, size_t n, uint32_t min_key,
+                      uint32_t max_key, size_t num_threads,
+                      vector<uint32_t>& sorted_ids) {
+    int passes = numRadixPasses(min_key, max_key);
+
+    vector<uint32_t> src_ids(n);
+    vector<uint32_t> src_keys(passes > 1 ? n : 0);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            src_ids[i] = static_cast<uint32_t>(i);
+        }
+    });
+    if (passes == 0) {
+        sorted_ids.swap(src_ids);
+        return;
+    }
+
+    vector<uint32_t> dst_ids(n);
+    vector<uint32_t> dst_keys(passes > 1 ? n : 0);
+    vector<size_t> offsets(num_threads * RADIX_BUCKETS);
+    for (int pass = 0; pass < passes; ++pass) {
+        int shift = pass * RADIX_BITS;
+        bool first = pass == 0;
+        bool last = pass + 1 == passes;
+        // The first pass reads the input keys directly
+        const uint32_t* in_keys = first ? keys : src_keys.data();
+        uint32_t bias = first ? min_key : 0;
+
+        // Histogram of each block
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallelFor(n, num_threads, [&](size_t begin, size_t end,
+                                        size_t tid) {
+            size_t* count = &offsets[tid * RADIX_BUCKETS];
+            for (size_t i = begin; i < end; ++i) {
+                ++count[((in_keys[i] - bias) >> shift) & (RADIX_BUCKETS - 1)];
+            }
+        });
+
+        // Exclusive prefix sum in (digit, block) order
+        size_t sum = 0;
+        for (size_t digit = 0; digit < RADIX_BUCKETS; ++digit) {
+            for (size_t t = 0; t < num_threads; ++t) {
+                size_t count = offsets[t * RADIX_BUCKETS + digit];
+                offsets[t * RADIX_BUCKETS + digit] = sum;
+                sum += count;
+            }
+        }
+
+        // Scatter, keeping the keys only if another pass follows
+        parallelFor(n, num_threads, [&](size_t begin, size_t end,
+                                        size_t tid) {
+            size_t* offset = &offsets[tid * RADIX_BUCKETS];
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t key = in_keys[i] - bias;
+                size_t pos = offset[(key >> shift) & (RADIX_BUCKETS - 1)]++;
+                dst_ids[pos] = src_ids[i];
+                if (!last) dst_keys[pos] = key;
+            }
+        });
+
+        src_ids.swap(dst_ids);
+        src_keys.swap(dst_keys);
+    }
+    sorted_ids.swap(src_ids);
+}
+
+/*=====================================================================================
+        Merge of ascending runs
+
+        Keys and ids are packed into 64-bit values (key in the high half), so
+        that comparing packed values orders by key and then by id, which keeps
+        the result identical to the stable radix sort. Adjacent runs are
+        merged pairwise. Every thread of a round writes an equal share of the
+        output, locating its slice of each merge by co-ranking (merge path),
+        so the last rounds, with a few long runs, still use all threads.
+
+        The packed source and destination take 2 x 8 bytes per point, plus
+        the 4-byte output ids, more than the 16 bytes per point of the radix
+        sort.
+=====================================================================================*/
+
+// Number of values taken from a (the rest from b) by the first k values of
+// the merge of a and b. Packed values are unique, so ties cannot occur.
+static size_t coRank(const uint64_t* a, size_t na, const uint64_t* b,
+                     size_t nb, size_t k) {
+    size_t lo = k > nb ? k - nb : 0;
+    size_t hi = std::min(k, na);
+    while (lo < hi) {
+        size_t i = lo + (hi - lo) / 2;
+        if (a[i] < b[k - i - 1]) {
+            lo = i + 1;
+        } else {
+            hi = i;
+        }
+    }
+    return lo;
+}
+
+static void mergeRuns(const uint32_t* keys, size_t n,
+                      vector<size_t>& run_begin, size_t num_threads,
+                      vector<uint32_t>& sorted_ids) {
+    run_begin.push_back(n);
+
+    vector<uint64_t> src(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            src[i] = (static_cast<uint64_t>(keys[i]) << 32) | i;
+        }
+    });
+
+    vector<uint64_t> dst(n > 0 && run_begin.size() > 2 ? n : 0);
+    while (run_begin.size() > 2) {
+        size_t num_runs = run_begin.size() - 1;
+        size_t num_pairs = (num_runs + 1) / 2;
+        parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+            // First pair overlapping [begin, end)
+            size_t p = (std::upper_bound(run_begin.begin(), run_begin.end(),
+                                         begin) -
+                        run_begin.begin() - 1) /
+                       2;
+            for (; p < num_pairs && run_begin[2 * p] < end; ++p) {
+                size_t a = run_begin[2 * p];
+                size_t mid = run_begin[std::min(2 * p + 1, num_runs)];
+                size_t b = run_begin[std::min(2 * p + 2, num_runs)];
+                const uint64_t* run_a = src.data() + a;
+                const uint64_t* run_b = src.data() + mid;
+                size_t na = mid - a, nb = b - mid;
+
+                size_t out_begin = std::max(a, begin) - a;
+                size_t out_end = std::min(b, end) - a;
+                size_t i0 = coRank(run_a, na, run_b, nb, out_begin);
+                size_t i1 = coRank(run_a, na, run_b, nb, out_end);
+                std::merge(run_a + i0, run_a + i1,
+                           run_b + (out_begin - i0), run_b + (out_end - i1),
+                           dst.begin() + a + out_begin);
+            }
+        });
+
+        vector<size_t> merged_begin;
+        merged_begin.reserve(num_pairs + 1);
+        for (size_t r = 0; r < num_runs; r += 2) {
+            merged_begin.push_back(run_begin[r]);
+        }
+        merged_begin.push_back(n);
+        run_begin.swap(merged_begin);
+        src.swap(dst);
+    }
+
+    sorted_ids.resize(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            sorted_ids[i] = static_cast<uint32_t>(src[i]);
+        }
+    });
+}
@@ -0,0 +1,32 @@
+/*=====================================================================================
+                                radix_sort.h
+
+    Description:  Parallel sorting of point ids by 32-bit keys
+
+        Point ids are 32-bit, so datasets are limited to 2^32 points. The sort
+        is stable: points with equal keys keep their original order.
+=====================================================================================*/
+
+#ifndef RADIX_SORT_H_
+#define RADIX_SORT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Fill sorted_ids with 0 .. n - 1 ordered by keys. Uses a parallel LSD radix
+// sort over the bytes spanned by the key range, unless the keys consist of
+// so few ascending runs (e.g. time-ordered trajectories) that merging the
+// runs takes fewer passes.
+void sortIndicesByKey(const uint32_t* keys, size_t n,
+                      vector<uint32_t>& sorted_ids);
+
+// The two strategies, exposed for benchmarking
+void radixSortIndices(const uint32_t* keys, size_t n,
+                      vector<uint32_t>& sorted_ids);
+void mergeSortIndices(const uint32_t* keys, size_t n,
+                      vector<uint32_t>& sorted_ids);
+
+#endif /* end of include guard: RADIX_SORT_H_ */
@@ -1,13 +1,9 @@
 #include "road_generator.h"
 
-#include <pcl/common/centroid.h>
-#include <pcl/search/impl/flann_search.hpp>
 #include "latlon_converter.h"
 
 RoadGenerator::RoadGenerator(Trajectories* trajectories)
-    : m_trajectoris(trajectories),
-      m_points(new pcl::PointCloud<MapPointType>),
-      m_searchTree(new pcl::search::FlannSearch<MapPointType>(false))
+    : m_trajectoris(trajectories)
 {
 
 }
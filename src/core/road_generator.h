@@ -23,9 +23,10 @@ class RoadGenerator {
         void linkRoads();
 
     private: 
-        // Point cloud and search tree
-        pcl::PointCloud<MapPointType>::Ptr       m_points;
-        pcl::search::Search<MapPointType>::Ptr   m_searchTree;
+        // Sample points and search tree
+        vector<float>                            m_pointEasting;
+        vector<float>                            m_pointNorthing;
+        KdTree<PointSpans<float>>                m_searchTree;
 
         Trajectories*                            m_trajectoris;
 }; 
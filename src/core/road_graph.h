@@ -0,0 +1,422 @@
+/*=====================================================================================
+                                road_graph.h
+
+    Description:  Header-only compact directed graph in CSR layout
+
+        Vertices are numbered 0..n-1 and edges 0..m-1, in order of source.
+        The out-edges of a vertex are a contiguous range of edge ids (forward
+        CSR over the target array) and its in-edges a contiguous range of a
+        second array of edge ids sorted by target (reverse CSR). Vertex and
+        edge properties are stored in arrays parallel to the vertices and the
+        edges. The whole graph is built at once from an edge list, with two
+        counting sorts, instead of edge by edge.
+
+        The graph models the Boost IncidenceGraph, BidirectionalGraph,
+        AdjacencyGraph, VertexListGraph and EdgeListGraph concepts, with the
+        vertex_index and edge_index property maps, so that the Boost Graph
+        algorithms run on it. Like a Boost adjacency_list with bundled
+        properties, g[v] and g[e] return the properties of a vertex or an
+        edge, and get(&EdgeProperty::member, g) gives a property map over an
+        edge member (e.g. the edge weights of dijkstra_shortest_paths).
+=====================================================================================*/
+
+#ifndef ROAD_GRAPH_H_
+#define ROAD_GRAPH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <boost/graph/graph_traits.hpp>
+#include <boost/graph/properties.hpp>
+#include <boost/iterator/counting_iterator.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+#include <boost/property_map/property_map.hpp>
+
+using namespace std;
+
+// Edge descriptor: the edge id
+struct RoadGraphEdge {
+    RoadGraphEdge() : id(numeric_limits<uint32_t>::max()) {}
+    explicit RoadGraphEdge(uint32_t edge_id) : id(edge_id) {}
+
+    uint32_t id;
+
+    bool operator==(const RoadGraphEdge& other) const {
+        return id == other.id;
+    }
+    bool operator!=(const RoadGraphEdge& other) const {
+        return id != other.id;
+    }
+    bool operator<(const RoadGraphEdge& other) const { return id < other.id; }
+};
+
+// Iterator over a range of consecutive edge ids
+class RoadGraphEdgeIterator
+    : public boost::iterator_facade<RoadGraphEdgeIterator, RoadGraphEdge,
+                                    boost::random_access_traversal_tag,
+                                    RoadGraphEdge> {
+public:
+    RoadGraphEdgeIterator() : m_id(0) {}
+    explicit RoadGraphEdgeIterator(uint32_t edge_id) : m_id(edge_id) {}
+
+private:
+    friend class boost::iterator_core_access;
+
+    RoadGraphEdge dereference() const { return RoadGraphEdge(m_id); }
+    bool equal(const RoadGraphEdgeIterator& other) const {
+        return m_id == other.m_id;
+    }
+    void increment() { ++m_id; }
+    void decrement() { --m_id; }
+    void advance(ptrdiff_t n) { m_id = static_cast<uint32_t>(m_id + n); }
+    ptrdiff_t distance_to(const RoadGraphEdgeIterator& other) const {
+        return static_cast<ptrdiff_t>(other.m_id) -
+               static_cast<ptrdiff_t>(m_id);
+    }
+
+    uint32_t m_id;
+};
+
+template <class VertexProperty, class EdgeProperty>
+class RoadGraph {
+public:
+    // Boost graph traits
+    typedef uint32_t vertex_descriptor;
+    typedef RoadGraphEdge edge_descriptor;
+    typedef boost::directed_tag directed_category;
+    typedef boost::allow_parallel_edge_tag edge_parallel_category;
+    struct traversal_category : public boost::bidirectional_graph_tag,
+                                public boost::adjacency_graph_tag,
+                                public boost::vertex_list_graph_tag,
+                                public boost::edge_list_graph_tag {};
+    typedef RoadGraphEdgeIterator out_edge_iterator;
+    typedef const RoadGraphEdge* in_edge_iterator;
+    typedef const uint32_t* adjacency_iterator;
+    typedef boost::counting_iterator<uint32_t> vertex_iterator;
+    typedef RoadGraphEdgeIterator edge_iterator;
+    typedef size_t vertices_size_type;
+    typedef size_t edges_size_type;
+    typedef size_t degree_size_type;
+
+    static vertex_descriptor null_vertex() {
+        return numeric_limits<vertex_descriptor>::max();
+    }
+
+    RoadGraph() : m_outOffsets(1, 0), m_inOffsets(1, 0) {}
+
+    // Builds the graph from an edge list: edge i goes from sources[i] to
+    // targets[i] and has properties edge_properties[i]. Edges keep their
+    // relative order within a source. The property vectors are moved into
+    // the graph.
+    void build(vector<VertexProperty>& vertex_properties,
+               const vector<uint32_t>& sources,
+               const vector<uint32_t>& targets,
+               vector<EdgeProperty>& edge_properties);
+    // Same with edge_properties.size() sources and targets read in place,
+    // e.g. from a mapped file
+    void build(vector<VertexProperty>& vertex_properties,
+               const uint32_t* sources, const uint32_t* targets,
+               vector<EdgeProperty>& edge_properties);
+    void clear();
+
+    size_t numVertices() const { return m_vertexProperties.size(); }
+    size_t numEdges() const { return m_targets.size(); }
+
+    uint32_t source(uint32_t edge) const { return m_sources[edge]; }
+    uint32_t target(uint32_t edge) const { return m_targets[edge]; }
+    // Out-edges of v are [outBegin(v), outEnd(v))
+    uint32_t outBegin(uint32_t v) const { return m_outOffsets[v]; }
+    uint32_t outEnd(uint32_t v) const { return m_outOffsets[v + 1]; }
+    // In-edges of v are inEdges()[inBegin(v)..inEnd(v))
+    uint32_t inBegin(uint32_t v) const { return m_inOffsets[v]; }
+    uint32_t inEnd(uint32_t v) const { return m_inOffsets[v + 1]; }
+    const RoadGraphEdge* inEdges() const { return m_inEdges.data(); }
+    const uint32_t* targets() const { return m_targets.data(); }
+
+    VertexProperty& operator[](vertex_descriptor v) {
+        return m_vertexProperties[v];
+    }
+    const VertexProperty& operator[](vertex_descriptor v) const {
+        return m_vertexProperties[v];
+    }
+    EdgeProperty& operator[](edge_descriptor e) {
+        return m_edgeProperties[e.id];
+    }
+    const EdgeProperty& operator[](edge_descriptor e) const {
+        return m_edgeProperties[e.id];
+    }
+    const EdgeProperty* edgeProperties() const {
+        return m_edgeProperties.data();
+    }
+
+private:
+    vector<VertexProperty> m_vertexProperties;
+    vector<uint32_t> m_outOffsets;  // n + 1
+    vector<uint32_t> m_sources;     // by edge id
+    vector<uint32_t> m_targets;     // by edge id
+    vector<EdgeProperty> m_edgeProperties;  // by edge id
+    vector<uint32_t> m_inOffsets;  // n + 1
+    vector<RoadGraphEdge> m_inEdges;  // edge ids by target
+};
+
+template <class VertexProperty, class EdgeProperty>
+void RoadGraph<VertexProperty, EdgeProperty>::clear() {
+    vector<VertexProperty>().swap(m_vertexProperties);
+    m_outOffsets.assign(1, 0);
+    vector<uint32_t>().swap(m_sources);
+    vector<uint32_t>().swap(m_targets);
+    vector<EdgeProperty>().swap(m_edgeProperties);
+    m_inOffsets.assign(1, 0);
+    vector<RoadGraphEdge>().swap(m_inEdges);
+}
+
+template <class VertexProperty, class EdgeProperty>
+void RoadGraph<VertexProperty, EdgeProperty>::build(
+    vector<VertexProperty>& vertex_properties, const vector<uint32_t>& sources,
+    const vector<uint32_t>& targets, vector<EdgeProperty>& edge_properties) {
+    if (targets.size() != sources.size() ||
+        edge_properties.size() != sources.size()) {
+        clear();
+        fprintf(stderr,
+                "ERROR: edge lists of different sizes, cannot build the "
+                "graph.\n");
+        return;
+    }
+    build(vertex_properties, sources.data(), targets.data(), edge_properties);
+}
+
+template <class VertexProperty, class EdgeProperty>
+void RoadGraph<VertexProperty, EdgeProperty>::build(
+    vector<VertexProperty>& vertex_properties, const uint32_t* sources,
+    const uint32_t* targets, vector<EdgeProperty>& edge_properties) {
+    clear();
+    size_t n = vertex_properties.size();
+    size_t m = edge_properties.size();
+    if (n >= numeric_limits<uint32_t>::max() ||
+        m >= numeric_limits<uint32_t>::max()) {
+        fprintf(stderr,
+                "ERROR: more than 2^32 vertices or edges, cannot build the "
+                "graph.\n");
+        return;
+    }
+    m_vertexProperties.swap(vertex_properties);
+
+    // Forward CSR: counting sort of the edges by source
+    m_outOffsets.assign(n + 1, 0);
+    for (size_t i = 0; i < m; ++i) {
+        ++m_outOffsets[sources[i] + 1];
+    }
+    for (size_t v = 0; v < n; ++v) {
+        m_outOffsets[v + 1] += m_outOffsets[v];
+    }
+    vector<uint32_t> fill(m_outOffsets.begin(), m_outOffsets.end() - 1);
+    m_sources.resize(m);
+    m_targets.resize(m);
+    m_edgeProperties.resize(m);
+    for (size_t i = 0; i < m; ++i) {
+        uint32_t edge = fill[sources[i]]++;
+        m_sources[edge] = sources[i];
+        m_targets[edge] = targets[i];
+        m_edgeProperties[edge] = edge_properties[i];
+    }
+    vector<EdgeProperty>().swap(edge_properties);
+
+    // Reverse CSR: counting sort of the edge ids by target
+    m_inOffsets.assign(n + 1, 0);
+    for (size_t e = 0; e < m; ++e) {
+        ++m_inOffsets[m_targets[e] + 1];
+    }
+    for (size_t v = 0; v < n; ++v) {
+        m_inOffsets[v + 1] += m_inOffsets[v];
+    }
+    fill.assign(m_inOffsets.begin(), m_inOffsets.end() - 1);
+    m_inEdges.resize(m);
+    for (size_t e = 0; e < m; ++e) {
+        m_inEdges[fill[m_targets[e]]++] =
+            RoadGraphEdge(static_cast<uint32_t>(e));
+    }
+}
+
+/*=====================================================================================
+        Boost Graph interface
+=====================================================================================*/
+
+template <class V, class E>
+uint32_t source(RoadGraphEdge e, const RoadGraph<V, E>& g) {
+    return g.source(e.id);
+}
+
+template <class V, class E>
+uint32_t target(RoadGraphEdge e, const RoadGraph<V, E>& g) {
+    return g.target(e.id);
+}
+
+template <class V, class E>
+pair<RoadGraphEdgeIterator, RoadGraphEdgeIterator> out_edges(
+    uint32_t v, const RoadGraph<V, E>& g) {
+    return make_pair(RoadGraphEdgeIterator(g.outBegin(v)),
+                     RoadGraphEdgeIterator(g.outEnd(v)));
+}
+
+template <class V, class E>
+size_t out_degree(uint32_t v, const RoadGraph<V, E>& g) {
+    return g.outEnd(v) - g.outBegin(v);
+}
+
+template <class V, class E>
+pair<const RoadGraphEdge*, const RoadGraphEdge*> in_edges(
+    uint32_t v, const RoadGraph<V, E>& g) {
+    return make_pair(g.inEdges() + g.inBegin(v), g.inEdges() + g.inEnd(v));
+}
+
+template <class V, class E>
+size_t in_degree(uint32_t v, const RoadGraph<V, E>& g) {
+    return g.inEnd(v) - g.inBegin(v);
+}
+
+template <class V, class E>
+size_t degree(uint32_t v, const RoadGraph<V, E>& g) {
+    return out_degree(v, g) + in_degree(v, g);
+}
+
+template <class V, class E>
+pair<const uint32_t*, const uint32_t*> adjacent_vertices(
+    uint32_t v, const RoadGraph<V, E>& g) {
+    return make_pair(g.targets() + g.outBegin(v), g.targets() + g.outEnd(v));
+}
+
+template <class V, class E>
+pair<boost::counting_iterator<uint32_t>, boost::counting_iterator<uint32_t>>
+vertices(const RoadGraph<V, E>& g) {
+    return make_pair(
+        boost::counting_iterator<uint32_t>(0),
+        boost::counting_iterator<uint32_t>(
+            static_cast<uint32_t>(g.numVertices())));
+}
+
+template <class V, class E>
+size_t num_vertices(const RoadGraph<V, E>& g) {
+    return g.numVertices();
+}
+
+template <class V, class E>
+pair<RoadGraphEdgeIterator, RoadGraphEdgeIterator> edges(
+    const RoadGraph<V, E>& g) {
+    return make_pair(
+        RoadGraphEdgeIterator(0),
+        RoadGraphEdgeIterator(static_cast<uint32_t>(g.numEdges())));
+}
+
+template <class V, class E>
+size_t num_edges(const RoadGraph<V, E>& g) {
+    return g.numEdges();
+}
+
+// First edge from u to v, if any
+template <class V, class E>
+pair<RoadGraphEdge, bool> edge(uint32_t u, uint32_t v,
+                               const RoadGraph<V, E>& g) {
+    for (uint32_t e = g.outBegin(u); e < g.outEnd(u); ++e) {
+        if (g.target(e) == v) return make_pair(RoadGraphEdge(e), true);
+    }
+    return make_pair(RoadGraphEdge(), false);
+}
+
+// Edge ids as a property map
+struct RoadGraphEdgeIndexMap {
+    typedef RoadGraphEdge key_type;
+    typedef uint32_t value_type;
+    typedef uint32_t reference;
+    typedef boost::readable_property_map_tag category;
+
+    uint32_t operator[](RoadGraphEdge e) const { return e.id; }
+};
+
+inline uint32_t get(const RoadGraphEdgeIndexMap& map, RoadGraphEdge e) {
+    return map[e];
+}
+
+// A member of the edge properties as a property map
+template <class EdgeProperty, class T>
+struct RoadGraphEdgeMemberMap {
+    typedef RoadGraphEdge key_type;
+    typedef T value_type;
+    typedef const T& reference;
+    typedef boost::readable_property_map_tag category;
+
+    RoadGraphEdgeMemberMap(const EdgeProperty* edge_properties,
+                           T EdgeProperty::*edge_member)
+        : properties(edge_properties), member(edge_member) {}
+
+    const T& operator[](RoadGraphEdge e) const {
+        return properties[e.id].*member;
+    }
+
+    const EdgeProperty* properties;
+    T EdgeProperty::*member;
+};
+
+template <class EdgeProperty, class T>
+const T& get(const RoadGraphEdgeMemberMap<EdgeProperty, T>& map,
+             RoadGraphEdge e) {
+    return map[e];
+}
+
+template <class V, class E>
+boost::typed_identity_property_map<uint32_t> get(boost::vertex_index_t,
+                                                 const RoadGraph<V, E>&) {
+    return boost::typed_identity_property_map<uint32_t>();
+}
+
+template <class V, class E>
+uint32_t get(boost::vertex_index_t, const RoadGraph<V, E>&, uint32_t v) {
+    return v;
+}
+
+template <class V, class E>
+RoadGraphEdgeIndexMap get(boost::edge_index_t, const RoadGraph<V, E>&) {
+    return RoadGraphEdgeIndexMap();
+}
+
+template <class V, class E, class T>
+RoadGraphEdgeMemberMap<E, T> get(T E::*member, const RoadGraph<V, E>& g) {
+    return RoadGraphEdgeMemberMap<E, T>(g.edgeProperties(), member);
+}
+
+namespace boost {
+
+// Also found as boost::num_vertices(g) etc., like the Boost graphs
+using ::source;
+using ::target;
+using ::out_edges;
+using ::out_degree;
+using ::in_edges;
+using ::in_degree;
+using ::degree;
+using ::adjacent_vertices;
+using ::vertices;
+using ::num_vertices;
+using ::edges;
+using ::num_edges;
+using ::edge;
+using ::get;
+
+template <class V, class E>
+struct property_map<RoadGraph<V, E>, vertex_index_t> {
+    typedef typed_identity_property_map<uint32_t> type;
+    typedef type const_type;
+};
+
+template <class V, class E>
+struct property_map<RoadGraph<V, E>, edge_index_t> {
+    typedef RoadGraphEdgeIndexMap type;
+    typedef type const_type;
+};
+
+}  // namespace boost
+
+#endif /* end of include guard: ROAD_GRAPH_H_ */
@@ -0,0 +1,854 @@
+#include "road_router.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+
+#include "parallel.h"
+
+static const float INF_DISTANCE = numeric_limits<float>::infinity();
+static const uint32_t NO_ID = numeric_limits<uint32_t>::max();
+
+typedef pair<float, uint32_t> HeapEntry;
+
+static void heapPush(vector<HeapEntry>& heap, float key, uint32_t v) {
+    heap.push_back(HeapEntry(key, v));
+    std::push_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+}
+
+static HeapEntry heapPop(vector<HeapEntry>& heap) {
+    std::pop_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+    HeapEntry top = heap.back();
+    heap.pop_back();
+    return top;
+}
+
+void RouteWorkspace::Search::reset(size_t n) {
+    if (dist.size() != n) {
+        dist.assign(n, INF_DISTANCE);
+        parent.assign(n, NO_ID);
+        parentArc.assign(n, NO_ID);
+        touched.clear();
+    }
+    for (uint32_t v : touched) {
+        dist[v] = INF_DISTANCE;
+    }
+    touched.clear();
+    heap.clear();
+}
+
+void RouteWorkspace::Search::update(uint32_t v, float d, uint32_t p,
+                                    uint32_t arc) {
+    if (dist[v] == INF_DISTANCE) touched.push_back(v);
+    dist[v] = d;
+    parent[v] = p;
+    parentArc[v] = arc;
+}
+
+/*=====================================================================================
+        Baselines
+=====================================================================================*/
+
+// Lower bound of the distance from a vertex to the targets, cost included
+struct NoHeuristic {
+    float operator()(uint32_t) const { return 0.0f; }
+};
+
+struct StraightLineHeuristic {
+    StraightLineHeuristic(const graph_t& graph,
+                          const vector<RouteEndpoint>& targets)
+        : g(graph), ends(targets) {}
+
+    float operator()(uint32_t v) const {
+        float best = INF_DISTANCE;
+        for (const RouteEndpoint& end : ends) {
+            float dx = g[v].easting - g[end.vertex].easting;
+            float dy = g[v].northing - g[end.vertex].northing;
+            best = std::min(best, std::sqrt(dx * dx + dy * dy) + end.cost);
+        }
+        // Edge lengths are rounded to float: stay below them
+        return best * 0.9999f;
+    }
+
+    const graph_t& g;
+    const vector<RouteEndpoint>& ends;
+};
+
+// Dijkstra ordered by dist + heuristic(v), stopping once no key can improve
+// on the best route found
+template <class Heuristic>
+static bool graphSearch(const graph_t& graph,
+                        const vector<RouteEndpoint>& sources,
+                        const vector<RouteEndpoint>& targets,
+                        Heuristic heuristic, RoutePath& path,
+                        RouteWorkspace::Search& search) {
+    path.clear();
+    search.reset(graph.numVertices());
+    for (const RouteEndpoint& s : sources) {
+        if (s.cost < search.dist[s.vertex]) {
+            search.update(s.vertex, s.cost, NO_ID, NO_ID);
+            heapPush(search.heap, s.cost + heuristic(s.vertex), s.vertex);
+        }
+    }
+
+    float best = INF_DISTANCE;
+    uint32_t best_vertex = NO_ID;
+    const GraphEdge* edge_props = graph.edgeProperties();
+    while (!search.heap.empty()) {
+        HeapEntry top = heapPop(search.heap);
+        if (top.first >= best) break;
+        uint32_t u = top.second;
+        float du = search.dist[u];
+        if (top.first > du + heuristic(u)) continue;  // outdated entry
+
+        for (const RouteEndpoint& t : targets) {
+            if (t.vertex == u && du + t.cost < best) {
+                best = du + t.cost;
+                best_vertex = u;
+            }
+        }
+        for (uint32_t e = graph.outBegin(u); e < graph.outEnd(u); ++e) {
+            uint32_t v = graph.target(e);
+            float dv = du + edge_props[e].length;
+            if (dv < search.dist[v]) {
+                search.update(v, dv, u, e);
+                heapPush(search.heap, dv + heuristic(v), v);
+            }
+        }
+    }
+    if (best_vertex == NO_ID) return false;
+
+    path.length = best;
+    for (uint32_t v = best_vertex; v != NO_ID; v = search.parent[v]) {
+        path.vertices.push_back(v);
+        if (search.parentArc[v] != NO_ID) {
+            path.edges.push_back(graph_edge_descriptor(search.parentArc[v]));
+        }
+    }
+    std::reverse(path.vertices.begin(), path.vertices.end());
+    std::reverse(path.edges.begin(), path.edges.end());
+    return true;
+}
+
+bool RoadRouter::dijkstra(const graph_t& graph,
+                          const vector<RouteEndpoint>& sources,
+                          const vector<RouteEndpoint>& targets,
+                          RoutePath& path, RouteWorkspace& workspace) {
+    return graphSearch(graph, sources, targets, NoHeuristic(), path,
+                       workspace.m_search[0]);
+}
+
+bool RoadRouter::aStar(const graph_t& graph,
+                       const vector<RouteEndpoint>& sources,
+                       const vector<RouteEndpoint>& targets, RoutePath& path,
+                       RouteWorkspace& workspace) {
+    return graphSearch(graph, sources, targets,
+                       StraightLineHeuristic(graph, targets), path,
+                       workspace.m_search[0]);
+}
+
+/*=====================================================================================
+        Contraction
+=====================================================================================*/
+
+typedef RoadRouter::Arc Arc;
+
+// Keep the shortest of parallel arcs
+static void addArc(vector<Arc>& arcs, uint32_t node, float weight,
+                   uint32_t via) {
+    for (Arc& arc : arcs) {
+        if (arc.node == node) {
+            if (weight < arc.weight) {
+                arc.weight = weight;
+                arc.via = via;
+            }
+            return;
+        }
+    }
+    Arc arc;
+    arc.node = node;
+    arc.weight = weight;
+    arc.via = via;
+    arcs.push_back(arc);
+}
+
+static void removeArc(vector<Arc>& arcs, uint32_t node) {
+    for (size_t i = 0; i < arcs.size(); ++i) {
+        if (arcs[i].node == node) {
+            arcs[i] = arcs.back();
+            arcs.pop_back();
+            return;
+        }
+    }
+}
+
+struct Shortcut {
+    uint32_t from;
+    uint32_t to;
+    float weight;
+};
+
+// Graph being contracted: the arcs between the vertices not contracted yet
+class ContractionGraph {
+public:
+    enum State { ACTIVE = 0, SELECTED = 1, CONTRACTED = 2 };
+
+    // Witness searches give up after settling this many vertices, adding a
+    // shortcut that may not be needed
+    static const size_t MAX_SETTLED = 500;
+
+    explicit ContractionGraph(const graph_t& graph)
+        : out(graph.numVertices()),
+          in(graph.numVertices()),
+          state(graph.numVertices(), ACTIVE),
+          deletedNeighbors(graph.numVertices(), 0) {
+        for (uint32_t e = 0; e < graph.numEdges(); ++e) {
+            uint32_t u = graph.source(e);
+            uint32_t v = graph.target(e);
+            if (u == v) continue;
+            float w = graph.edgeProperties()[e].length;
+            addArc(out[u], v, w, e);
+            addArc(in[v], u, w, e);
+        }
+    }
+
+    // Shortcuts needed to contract v, avoiding the vertices that are not
+    // ACTIVE
+    void shortcuts(uint32_t v, RouteWorkspace::Search& search,
+                   vector<Shortcut>& result) const {
+        result.clear();
+        float max_out = 0.0f;
+        for (const Arc& arc : out[v]) {
+            max_out = std::max(max_out, arc.weight);
+        }
+        for (const Arc& in_arc : in[v]) {
+            uint32_t u = in_arc.node;
+            witnessSearch(u, v, in_arc.weight + max_out, out[v], search);
+            for (const Arc& out_arc : out[v]) {
+                uint32_t w = out_arc.node;
+                if (w == u) continue;
+                float weight = in_arc.weight + out_arc.weight;
+                if (search.dist[w] <= weight) continue;
+                Shortcut shortcut;
+                shortcut.from = u;
+                shortcut.to = w;
+                shortcut.weight = weight;
+                result.push_back(shortcut);
+            }
+        }
+    }
+
+    // Edge difference, with the added shortcuts counting twice as much as
+    // the removed arcs, plus the contracted neighbors, which spreads the
+    // contraction evenly over the graph
+    int priority(uint32_t v, RouteWorkspace::Search& search,
+                 vector<Shortcut>& buffer) const {
+        shortcuts(v, search, buffer);
+        return 4 * static_cast<int>(buffer.size()) -
+               2 * static_cast<int>(in[v].size() + out[v].size()) +
+               deletedNeighbors[v];
+    }
+
+    vector<vector<Arc>> out;
+    vector<vector<Arc>> in;
+    vector<uint8_t> state;
+    vector<int> deletedNeighbors;
+
+private:
+    // Distances from u to the targets avoiding v, exact up to max_dist
+    void witnessSearch(uint32_t u, uint32_t v, float max_dist,
+                       const vector<Arc>& targets,
+                       RouteWorkspace::Search& search) const {
+        search.reset(out.size());
+        search.update(u, 0.0f, NO_ID, NO_ID);
+        heapPush(search.heap, 0.0f, u);
+        size_t n_settled = 0;
+        size_t n_targets = targets.size();
+        while (!search.heap.empty() && n_settled < MAX_SETTLED &&
+               n_targets > 0) {
+            HeapEntry top = heapPop(search.heap);
+            uint32_t x = top.second;
+            if (top.first > search.dist[x]) continue;
+            if (top.first > max_dist) break;
+            ++n_settled;
+            for (const Arc& target : targets) {
+                if (target.node == x) --n_targets;
+            }
+            for (const Arc& arc : out[x]) {
+                uint32_t y = arc.node;
+                if (y == v || state[y] != ACTIVE) continue;
+                float dy = top.first + arc.weight;
+                if (dy < search.dist[y]) {
+                    search.update(y, dy, x, NO_ID);
+                    heapPush(search.heap, dy, y);
+                }
+            }
+        }
+    }
+};
+
+const size_t ContractionGraph::MAX_SETTLED;
+
+// Tie breaker of equal priorities, scattering the contracted vertices
+static uint32_t vertexHash(uint32_t v) {
+    v ^= v >> 16;
+    v *= 0x7feb352du;
+    v ^= v >> 15;
+    v *= 0x846ca68bu;
+    v ^= v >> 16;
+    return v;
+}
+
+// Arcs of each vertex, by vertex, as offsets and a flat array
+static void flattenArcs(const vector<vector<Arc>>& arcs,
+                        vector<uint32_t>& offsets, vector<Arc>& flat) {
+    offsets.assign(arcs.size() + 1, 0);
+    for (size_t v = 0; v < arcs.size(); ++v) {
+        offsets[v + 1] = offsets[v] + arcs[v].size();
+    }
+    flat.clear();
+    flat.reserve(offsets.back());
+    for (size_t v = 0; v < arcs.size(); ++v) {
+        flat.insert(flat.end(), arcs[v].begin(), arcs[v].end());
+    }
+}
+
+void RoadRouter::build(const graph_t& graph, size_t num_threads) {
+    clear();
+    // Edge ids share Arc::via with the SHORTCUT flag
+    if (graph.numEdges() >= SHORTCUT) {
+        fprintf(stderr,
+                "ERROR: 2^31 edges or more, cannot build the routing "
+                "hierarchy.\n");
+        return;
+    }
+    m_graph = &graph;
+    if (num_threads == 0) num_threads = numWorkerThreads();
+    uint32_t n = static_cast<uint32_t>(graph.numVertices());
+    ContractionGraph g(graph);
+    vector<RouteWorkspace::Search> searches(num_threads);
+    vector<vector<Shortcut>> buffers(num_threads);
+
+    vector<int> priority(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t tid) {
+        for (size_t v = begin; v < end; ++v) {
+            priority[v] = g.priority(v, searches[tid], buffers[tid]);
+        }
+    });
+
+    // Final arcs of every vertex, fixed when it is contracted
+    vector<vector<Arc>> up(n), down(n);
+    vector<uint32_t> remaining(n);
+    for (uint32_t v = 0; v < n; ++v) remaining[v] = v;
+    vector<uint32_t> selected;
+    vector<vector<Shortcut>> round_shortcuts;
+    vector<uint32_t> neighbors;
+    while (!remaining.empty()) {
+        // Vertices of minimal priority among their neighbors: no two of
+        // them are adjacent
+        auto before = [&](uint32_t a, uint32_t b) {
+            if (priority[a] != priority[b]) return priority[a] < priority[b];
+            uint32_t ha = vertexHash(a), hb = vertexHash(b);
+            return ha != hb ? ha < hb : a < b;
+        };
+        vector<uint8_t> is_minimum(remaining.size());
+        parallelFor(remaining.size(), num_threads,
+                    [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t v = remaining[i];
+                bool minimum = true;
+                for (const Arc& arc : g.out[v]) {
+                    if (before(arc.node, v)) minimum = false;
+                }
+                for (const Arc& arc : g.in[v]) {
+                    if (before(arc.node, v)) minimum = false;
+                }
+                is_minimum[i] = minimum;
+            }
+        });
+        selected.clear();
+        size_t n_remaining = 0;
+        for (size_t i = 0; i < remaining.size(); ++i) {
+            if (is_minimum[i]) {
+                selected.push_back(remaining[i]);
+                g.state[remaining[i]] = ContractionGraph::SELECTED;
+            } else {
+                remaining[n_remaining++] = remaining[i];
+            }
+        }
+        remaining.resize(n_remaining);
+
+        // Witness searches avoid all the selected vertices, which are
+        // contracted together
+        round_shortcuts.resize(selected.size());
+        parallelFor(selected.size(), num_threads,
+                    [&](size_t begin, size_t end, size_t tid) {
+            for (size_t i = begin; i < end; ++i) {
+                g.shortcuts(selected[i], searches[tid], round_shortcuts[i]);
+            }
+        });
+
+        neighbors.clear();
+        for (size_t i = 0; i < selected.size(); ++i) {
+            uint32_t v = selected[i];
+            up[v].swap(g.out[v]);
+            down[v].swap(g.in[v]);
+            for (const Arc& arc : up[v]) {
+                removeArc(g.in[arc.node], v);
+                ++g.deletedNeighbors[arc.node];
+                neighbors.push_back(arc.node);
+            }
+            for (const Arc& arc : down[v]) {
+                removeArc(g.out[arc.node], v);
+                ++g.deletedNeighbors[arc.node];
+                neighbors.push_back(arc.node);
+            }
+            for (const Shortcut& shortcut : round_shortcuts[i]) {
+                uint32_t via = v | SHORTCUT;
+                addArc(g.out[shortcut.from], shortcut.to, shortcut.weight,
+                       via);
+                addArc(g.in[shortcut.to], shortcut.from, shortcut.weight,
+                       via);
+            }
+            g.state[v] = ContractionGraph::CONTRACTED;
+        }
+
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()),
+                        neighbors.end());
+        parallelFor(neighbors.size(), num_threads,
+                    [&](size_t begin, size_t end, size_t tid) {
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t v = neighbors[i];
+                priority[v] = g.priority(v, searches[tid], buffers[tid]);
+            }
+        });
+    }
+
+    flattenArcs(up, m_upOffsets, m_upArcs);
+    flattenArcs(down, m_downOffsets, m_downArcs);
+}
+
+void RoadRouter::clear() {
+    m_graph = nullptr;
+    vector<uint32_t>().swap(m_upOffsets);
+    vector<Arc>().swap(m_upArcs);
+    vector<uint32_t>().swap(m_downOffsets);
+    vector<Arc>().swap(m_downArcs);
+}
+
+bool RoadRouter::save(const string& filename, IndexFileKey key) const {
+    key.type = INDEX_FILE_TYPE;
+    key.numPoints = numVertices();
+    vector<IndexSection> sections;
+    sections.push_back(IndexSection(m_upOffsets.data(),
+                                    m_upOffsets.size() * sizeof(uint32_t)));
+    sections.push_back(
+        IndexSection(m_upArcs.data(), m_upArcs.size() * sizeof(Arc)));
+    sections.push_back(IndexSection(m_downOffsets.data(),
+                                    m_downOffsets.size() * sizeof(uint32_t)));
+    sections.push_back(
+        IndexSection(m_downArcs.data(), m_downArcs.size() * sizeof(Arc)));
+    return writeIndexFile(filename, key, sections);
+}
+
+// Copy an offsets / arcs pair of sections, checking that they fit a graph of
+// n vertices and num_edges edges
+static bool readArcs(const IndexSection& offsets_section,
+                     const IndexSection& arcs_section, size_t n,
+                     size_t num_edges, vector<uint32_t>& offsets,
+                     vector<Arc>& arcs) {
+    if (offsets_section.bytes != (n + 1) * sizeof(uint32_t) ||
+        arcs_section.bytes % sizeof(Arc) != 0) {
+        return false;
+    }
+    const uint32_t* offset_data =
+        static_cast<const uint32_t*>(offsets_section.data);
+    const Arc* arc_data = static_cast<const Arc*>(arcs_section.data);
+    size_t n_arcs = arcs_section.bytes / sizeof(Arc);
+    if (offset_data[0] != 0 || offset_data[n] != n_arcs) return false;
+    for (size_t v = 0; v < n; ++v) {
+        if (offset_data[v] > offset_data[v + 1]) return false;
+    }
+    for (size_t i = 0; i < n_arcs; ++i) {
+        const Arc& arc = arc_data[i];
+        if (arc.node >= n) return false;
+        if (arc.via & RoadRouter::SHORTCUT) {
+            if ((arc.via & ~RoadRouter::SHORTCUT) >= n) return false;
+        } else if (arc.via >= num_edges) {
+            return false;
+        }
+    }
+    offsets.assign(offset_data, offset_data + n + 1);
+    arcs.assign(arc_data, arc_data + n_arcs);
+    return true;
+}
+
+bool RoadRouter::load(const string& filename, const graph_t& graph,
+                      IndexFileKey key) {
+    key.type = INDEX_FILE_TYPE;
+    key.numPoints = graph.numVertices();
+    vector<IndexSection> sections;
+    shared_ptr<MappedFile> file = openIndexFile(filename, key, 4, sections);
+    if (!file) return false;
+
+    clear();
+    size_t n = graph.numVertices();
+    size_t num_edges = graph.numEdges();
+    if (num_edges >= SHORTCUT ||
+        !readArcs(sections[0], sections[1], n, num_edges, m_upOffsets,
+                  m_upArcs) ||
+        !readArcs(sections[2], sections[3], n, num_edges, m_downOffsets,
+                  m_downArcs) ||
+        !validShortcuts()) {
+        fprintf(stderr, "ERROR: routing index file %s is corrupted.\n",
+                filename.c_str());
+        clear();
+        return false;
+    }
+    m_graph = &graph;
+    return true;
+}
+
+// Whether every shortcut can be unpacked: its middle vertex stores the
+// downward arc from its lower end and the upward arc to its upper end
+bool RoadRouter::validShortcuts() const {
+    for (int side = FORWARD; side <= BACKWARD; ++side) {
+        const vector<uint32_t>& offsets =
+            side == FORWARD ? m_upOffsets : m_downOffsets;
+        const vector<Arc>& arcs = side == FORWARD ? m_upArcs : m_downArcs;
+        for (uint32_t v = 0; v < numVertices(); ++v) {
+            for (uint32_t i = offsets[v]; i < offsets[v + 1]; ++i) {
+                const Arc& arc = arcs[i];
+                if (!(arc.via & SHORTCUT)) continue;
+                uint32_t from = side == FORWARD ? v : arc.node;
+                uint32_t to = side == FORWARD ? arc.node : v;
+                uint32_t middle = arc.via & ~SHORTCUT;
+                if (!hasArc(m_downOffsets, m_downArcs, middle, from) ||
+                    !hasArc(m_upOffsets, m_upArcs, middle, to)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool RoadRouter::hasArc(const vector<uint32_t>& offsets,
+                        const vector<Arc>& arcs, uint32_t v, uint32_t node) {
+    for (uint32_t i = offsets[v]; i < offsets[v + 1]; ++i) {
+        if (arcs[i].node == node) return true;
+    }
+    return false;
+}
+
+/*=====================================================================================
+        Queries
+=====================================================================================*/
+
+void RoadRouter::startSearch(const vector<RouteEndpoint>& ends,
+                             RouteWorkspace::Search& s) const {
+    s.reset(numVertices());
+    for (const RouteEndpoint& end : ends) {
+        if (end.cost < s.dist[end.vertex]) {
+            s.update(end.vertex, end.cost, NO_ID, NO_ID);
+            heapPush(s.heap, end.cost, end.vertex);
+        }
+    }
+}
+
+bool RoadRouter::stalled(int side, uint32_t u, float du,
+                         const RouteWorkspace::Search& s) const {
+    // Stall on demand: u is reached more cheaply from above, through an arc
+    // of the other direction, so the search does not go on from it
+    const vector<uint32_t>& offsets =
+        side == FORWARD ? m_downOffsets : m_upOffsets;
+    const vector<Arc>& arcs = side == FORWARD ? m_downArcs : m_upArcs;
+    for (uint32_t i = offsets[u]; i < offsets[u + 1]; ++i) {
+        if (s.dist[arcs[i].node] + arcs[i].weight < du) return true;
+    }
+    return false;
+}
+
+void RoadRouter::relax(int side, uint32_t u, float du,
+                       RouteWorkspace::Search& s) const {
+    // The forward search goes up the upward arcs from the sources, the
+    // backward one up the downward arcs from the targets
+    const vector<uint32_t>& offsets =
+        side == FORWARD ? m_upOffsets : m_downOffsets;
+    const vector<Arc>& arcs = side == FORWARD ? m_upArcs : m_downArcs;
+    for (uint32_t i = offsets[u]; i < offsets[u + 1]; ++i) {
+        const Arc& arc = arcs[i];
+        float dv = du + arc.weight;
+        if (dv < s.dist[arc.node]) {
+            s.update(arc.node, dv, u, i);
+            heapPush(s.heap, dv, arc.node);
+        }
+    }
+}
+
+uint32_t RoadRouter::search(const vector<RouteEndpoint>& sources,
+                            const vector<RouteEndpoint>& targets,
+                            float& length, RouteWorkspace& workspace) const {
+    length = INF_DISTANCE;
+    if (!m_graph) return graph_t::null_vertex();
+    RouteWorkspace::Search* searches = workspace.m_search;
+    startSearch(sources, searches[FORWARD]);
+    startSearch(targets, searches[BACKWARD]);
+
+    float best = INF_DISTANCE;
+    uint32_t meeting = graph_t::null_vertex();
+    for (;;) {
+        float tops[2];
+        for (int side = 0; side < 2; ++side) {
+            tops[side] = searches[side].heap.empty()
+                             ? INF_DISTANCE
+                             : searches[side].heap.front().first;
+        }
+        int side = tops[FORWARD] <= tops[BACKWARD] ? FORWARD : BACKWARD;
+        if (tops[side] >= best) break;
+
+        RouteWorkspace::Search& s = searches[side];
+        const RouteWorkspace::Search& other = searches[1 - side];
+        HeapEntry top = heapPop(s.heap);
+        uint32_t u = top.second;
+        float du = top.first;
+        if (du > s.dist[u]) continue;  // outdated entry
+
+        if (du + other.dist[u] < best) {
+            best = du + other.dist[u];
+            meeting = u;
+        }
+        if (!stalled(side, u, du, s)) relax(side, u, du, s);
+    }
+    length = best;
+    return meeting;
+}
+
+void RoadRouter::unpackArc(uint32_t u, const Arc& arc, uint32_t v,
+                           vector<graph_edge_descriptor>& edges) const {
+    struct Piece {
+        uint32_t from;
+        uint32_t via;
+        uint32_t to;
+    };
+    vector<Piece> stack;
+    Piece first = {u, arc.via, v};
+    stack.push_back(first);
+    while (!stack.empty()) {
+        Piece piece = stack.back();
+        stack.pop_back();
+        if (!(piece.via & SHORTCUT)) {
+            edges.push_back(graph_edge_descriptor(piece.via));
+            continue;
+        }
+        // from -> middle is a downward arc of middle, middle -> to an
+        // upward one
+        uint32_t middle = piece.via & ~SHORTCUT;
+        Piece halves[2] = {{piece.from, NO_ID, middle},
+                           {middle, NO_ID, piece.to}};
+        for (uint32_t i = m_downOffsets[middle];
+             i < m_downOffsets[middle + 1]; ++i) {
+            if (m_downArcs[i].node == piece.from) {
+                halves[0].via = m_downArcs[i].via;
+            }
+        }
+        for (uint32_t i = m_upOffsets[middle]; i < m_upOffsets[middle + 1];
+             ++i) {
+            if (m_upArcs[i].node == piece.to) {
+                halves[1].via = m_upArcs[i].via;
+            }
+        }
+        stack.push_back(halves[1]);
+        stack.push_back(halves[0]);
+    }
+}
+
+bool RoadRouter::shortestPath(const vector<RouteEndpoint>& sources,
+                              const vector<RouteEndpoint>& targets,
+                              RoutePath& path,
+                              RouteWorkspace& workspace) const {
+    path.clear();
+    float length;
+    uint32_t meeting = search(sources, targets, length, workspace);
+    if (meeting == graph_t::null_vertex()) return false;
+
+    // Hierarchy arcs from a source up to the meeting vertex, then down to a
+    // target
+    const RouteWorkspace::Search& forward = workspace.m_search[FORWARD];
+    const RouteWorkspace::Search& backward = workspace.m_search[BACKWARD];
+    vector<uint32_t> up_chain;
+    for (uint32_t v = meeting; forward.parent[v] != NO_ID;
+         v = forward.parent[v]) {
+        up_chain.push_back(v);
+    }
+    for (size_t i = up_chain.size(); i-- > 0;) {
+        uint32_t v = up_chain[i];
+        unpackArc(forward.parent[v], m_upArcs[forward.parentArc[v]], v,
+                  path.edges);
+    }
+    for (uint32_t v = meeting; backward.parent[v] != NO_ID;
+         v = backward.parent[v]) {
+        unpackArc(v, m_downArcs[backward.parentArc[v]], backward.parent[v],
+                  path.edges);
+    }
+
+    path.length = length;
+    if (path.edges.empty()) {
+        path.vertices.push_back(meeting);
+    } else {
+        path.vertices.push_back(m_graph->source(path.edges.front().id));
+        for (const graph_edge_descriptor& e : path.edges) {
+            path.vertices.push_back(m_graph->target(e.id));
+        }
+    }
+    return true;
+}
+
+float RoadRouter::distance(const vector<RouteEndpoint>& sources,
+                           const vector<RouteEndpoint>& targets,
+                           RouteWorkspace& workspace) const {
+    float length;
+    search(sources, targets, length, workspace);
+    return length;
+}
+
+/*=====================================================================================
+        Distance tables
+=====================================================================================*/
+
+void RoadRouter::buildBuckets(const vector<vector<RouteEndpoint>>& targets,
+                              float max_distance, size_t num_threads,
+                              vector<uint32_t>& offsets,
+                              vector<BucketEntry>& entries) const {
+    struct Found {
+        uint32_t vertex;
+        BucketEntry entry;
+    };
+    // Backward search space of every target, by thread
+    vector<vector<Found>> found(num_threads);
+    vector<RouteWorkspace::Search> searches(num_threads);
+    parallelFor(targets.size(), num_threads,
+                [&](size_t begin, size_t end, size_t tid) {
+        RouteWorkspace::Search& s = searches[tid];
+        for (size_t t = begin; t < end; ++t) {
+            startSearch(targets[t], s);
+            while (!s.heap.empty()) {
+                HeapEntry top = heapPop(s.heap);
+                uint32_t u = top.second;
+                float du = top.first;
+                if (du > max_distance) break;
+                if (du > s.dist[u] || stalled(BACKWARD, u, du, s)) continue;
+                Found f = {u, {static_cast<uint32_t>(t), du}};
+                found[tid].push_back(f);
+                relax(BACKWARD, u, du, s);
+            }
+        }
+    });
+
+    // Counting sort by vertex. The threads hold consecutive targets, so a
+    // bucket is sorted by target.
+    size_t n = numVertices();
+    offsets.assign(n + 1, 0);
+    for (const vector<Found>& thread_found : found) {
+        for (const Found& f : thread_found) ++offsets[f.vertex + 1];
+    }
+    for (size_t v = 0; v < n; ++v) {
+        offsets[v + 1] += offsets[v];
+    }
+    entries.resize(offsets[n]);
+    vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (const vector<Found>& thread_found : found) {
+        for (const Found& f : thread_found) {
+            entries[fill[f.vertex]++] = f.entry;
+        }
+    }
+}
+
+void RoadRouter::tableRow(const vector<RouteEndpoint>& source,
+                          float max_distance, const vector<uint32_t>& offsets,
+                          const vector<BucketEntry>& entries,
+                          RouteWorkspace::Search& s, float* row,
+                          size_t num_targets) const {
+    std::fill(row, row + num_targets, INF_DISTANCE);
+    startSearch(source, s);
+    while (!s.heap.empty()) {
+        HeapEntry top = heapPop(s.heap);
+        uint32_t u = top.second;
+        float du = top.first;
+        if (du > max_distance) break;
+        if (du > s.dist[u] || stalled(FORWARD, u, du, s)) continue;
+        // Meet the targets whose backward search reached u
+        for (uint32_t i = offsets[u]; i < offsets[u + 1]; ++i) {
+            float d = du + entries[i].distance;
+            if (d < row[entries[i].target]) row[entries[i].target] = d;
+        }
+        relax(FORWARD, u, du, s);
+    }
+    for (size_t t = 0; t < num_targets; ++t) {
+        if (row[t] > max_distance) row[t] = INF_DISTANCE;
+    }
+}
+
+void RoadRouter::distanceTable(const vector<vector<RouteEndpoint>>& sources,
+                               const vector<vector<RouteEndpoint>>& targets,
+                               DistanceTable& table, float max_distance,
+                               size_t num_threads) const {
+    table.numSources = sources.size();
+    table.numTargets = targets.size();
+    table.distances.assign(sources.size() * targets.size(), INF_DISTANCE);
+    if (!m_graph || table.distances.empty()) return;
+    if (num_threads == 0) num_threads = numWorkerThreads();
+
+    vector<uint32_t> offsets;
+    vector<BucketEntry> entries;
+    buildBuckets(targets, max_distance, num_threads, offsets, entries);
+
+    vector<RouteWorkspace::Search> searches(num_threads);
+    parallelFor(sources.size(), num_threads,
+                [&](size_t begin, size_t end, size_t tid) {
+        for (size_t i = begin; i < end; ++i) {
+            tableRow(sources[i], max_distance, offsets, entries,
+                     searches[tid], &table.distances[i * targets.size()],
+                     targets.size());
+        }
+    });
+}
+
+size_t RoadRouter::sparseDistanceTable(
+    const vector<vector<RouteEndpoint>>& sources,
+    const vector<vector<RouteEndpoint>>& targets, float max_distance,
+    vector<DistanceEntry>& table, size_t num_threads) const {
+    table.clear();
+    if (!m_graph || sources.empty() || targets.empty()) return 0;
+    if (num_threads == 0) num_threads = numWorkerThreads();
+
+    vector<uint32_t> offsets;
+    vector<BucketEntry> entries;
+    buildBuckets(targets, max_distance, num_threads, offsets, entries);
+
+    // Rows of consecutive sources by thread, concatenated in order
+    vector<vector<DistanceEntry>> rows(num_threads);
+    vector<RouteWorkspace::Search> searches(num_threads);
+    parallelFor(sources.size(), num_threads,
+                [&](size_t begin, size_t end, size_t tid) {
+        vector<float> row(targets.size());
+        for (size_t i = begin; i < end; ++i) {
+            tableRow(sources[i], max_distance, offsets, entries,
+                     searches[tid], row.data(), targets.size());
+            for (size_t t = 0; t < targets.size(); ++t) {
+                if (row[t] == INF_DISTANCE) continue;
+                DistanceEntry entry;
+                entry.source = static_cast<uint32_t>(i);
+                entry.target = static_cast<uint32_t>(t);
+                entry.distance = row[t];
+                rows[tid].push_back(entry);
+            }
+        }
+    });
+    for (const vector<DistanceEntry>& thread_rows : rows) {
+        table.insert(table.end(), thread_rows.begin(), thread_rows.end());
+    }
+    return table.size();
+}
@@ -0,0 +1,233 @@
+/*=====================================================================================
+                                road_router.h
+
+    Description:  Shortest paths on the road graph
+
+        Edge weights are the edge lengths. Routes go from a set of sources to
+        a set of targets, each reached at a cost, so that a position snapped
+        inside an edge starts at the end vertices of that edge with the rest
+        of the edge as cost.
+
+        Baselines search the graph itself: Dijkstra, and A* with the straight
+        line distance to the targets as heuristic (edge lengths are straight
+        line distances, so it never overestimates).
+
+        The contraction hierarchy answers the same queries with a
+        bidirectional search that only goes up in a node order. It is built
+        by contracting the vertices in rounds: every round takes the vertices
+        whose priority (edge difference plus contracted neighbors) is minimal
+        in their neighborhood, an independent set, looks for their witness
+        paths in parallel and adds the shortcuts that have none. Shortcuts
+        record their middle vertex, so that a path is unpacked into graph
+        edges. The hierarchy can be saved to an index file and loaded back
+        instead of being rebuilt.
+
+        Many-to-many distance tables use buckets: one backward search per
+        target, one forward search per source, instead of a query per pair.
+=====================================================================================*/
+
+#ifndef ROAD_ROUTER_H_
+#define ROAD_ROUTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "index_file.h"
+
+using namespace std;
+
+// A vertex where a route starts or ends, at a cost added to the route
+struct RouteEndpoint {
+    RouteEndpoint() : vertex(0), cost(0.0f) {}
+    RouteEndpoint(graph_vertex_descriptor endpoint_vertex, float endpoint_cost)
+        : vertex(endpoint_vertex), cost(endpoint_cost) {}
+
+    graph_vertex_descriptor vertex;
+    float cost;
+};
+
+struct RoutePath {
+    RoutePath() : length(0.0f) {}
+
+    float length;  // including the costs of its endpoints
+    vector<graph_vertex_descriptor> vertices;  // from the source to the target
+    vector<graph_edge_descriptor> edges;
+
+    void clear() {
+        length = 0.0f;
+        vertices.clear();
+        edges.clear();
+    }
+};
+
+// Buffers of the searches, reused from one query to the next. A workspace
+// must not be shared by concurrent queries.
+struct RouteWorkspace {
+    // State of one search direction
+    struct Search {
+        vector<float> dist;
+        vector<uint32_t> parent;     // previous vertex on the path
+        vector<uint32_t> parentArc;  // graph edge or hierarchy arc to it
+        vector<uint32_t> touched;    // vertices with a finite dist
+        vector<pair<float, uint32_t>> heap;
+
+        void reset(size_t n);
+        void update(uint32_t v, float d, uint32_t p, uint32_t arc);
+    };
+
+    Search m_search[2];  // forward, backward
+};
+
+// Distances from every source to every target
+struct DistanceTable {
+    DistanceTable() : numSources(0), numTargets(0) {}
+
+    size_t numSources;
+    size_t numTargets;
+    vector<float> distances;  // by source then target, infinity if none
+
+    float at(size_t source, size_t target) const {
+        return distances[source * numTargets + target];
+    }
+};
+
+// Pair of a sparse distance table
+struct DistanceEntry {
+    uint32_t source;
+    uint32_t target;
+    float distance;
+};
+
+class RoadRouter {
+public:
+    RoadRouter() : m_graph(nullptr) {}
+
+    // Build the contraction hierarchy of graph, which must outlive the
+    // router. num_threads = 0 uses numWorkerThreads(). Graphs with 2^31
+    // edges or more are rejected, leaving the router empty.
+    void build(const graph_t& graph, size_t num_threads = 0);
+    void clear();
+
+    bool empty() const { return m_graph == nullptr; }
+
+    bool save(const string& filename, IndexFileKey key) const;
+    bool load(const string& filename, const graph_t& graph, IndexFileKey key);
+
+    // Shortest path from one of the sources to one of the targets on the
+    // contraction hierarchy. Returns false if there is none.
+    bool shortestPath(const vector<RouteEndpoint>& sources,
+                      const vector<RouteEndpoint>& targets, RoutePath& path,
+                      RouteWorkspace& workspace) const;
+    // Same, only the length. Infinity if there is no path.
+    float distance(const vector<RouteEndpoint>& sources,
+                   const vector<RouteEndpoint>& targets,
+                   RouteWorkspace& workspace) const;
+
+    // Many-to-many distances on the contraction hierarchy, each source and
+    // target given as the endpoints of a route. The backward searches of
+    // the targets leave their distances in buckets at the vertices they
+    // reach, the forward search of each source scans the buckets on its
+    // way. Both run in parallel over num_threads (0 uses
+    // numWorkerThreads()). Searches stop at max_distance, the distances
+    // beyond it are infinity.
+    void distanceTable(const vector<vector<RouteEndpoint>>& sources,
+                       const vector<vector<RouteEndpoint>>& targets,
+                       DistanceTable& table,
+                       float max_distance = numeric_limits<float>::infinity(),
+                       size_t num_threads = 0) const;
+    // Same, keeping only the pairs within max_distance, sorted by source
+    // then target
+    size_t sparseDistanceTable(const vector<vector<RouteEndpoint>>& sources,
+                               const vector<vector<RouteEndpoint>>& targets,
+                               float max_distance,
+                               vector<DistanceEntry>& table,
+                               size_t num_threads = 0) const;
+
+    // Baselines on the graph itself
+    static bool dijkstra(const graph_t& graph,
+                         const vector<RouteEndpoint>& sources,
+                         const vector<RouteEndpoint>& targets,
+                         RoutePath& path, RouteWorkspace& workspace);
+    static bool aStar(const graph_t& graph,
+                      const vector<RouteEndpoint>& sources,
+                      const vector<RouteEndpoint>& targets, RoutePath& path,
+                      RouteWorkspace& workspace);
+
+    // Arc of the hierarchy, stored at its lower ranked end: an upward arc
+    // to node, or a downward arc from node
+    struct Arc {
+        uint32_t node;
+        float weight;
+        uint32_t via;  // graph edge, or middle vertex | SHORTCUT
+    };
+    // Graphs need fewer edges than this to tell them from shortcuts
+    static const uint32_t SHORTCUT = 0x80000000u;
+
+    // Upward arcs of v are upArcs()[upBegin(v)..upBegin(v + 1)), downward
+    // arcs (from higher ranked vertices to v) the same in downArcs()
+    size_t numVertices() const {
+        return m_upOffsets.empty() ? 0 : m_upOffsets.size() - 1;
+    }
+    uint32_t upBegin(uint32_t v) const { return m_upOffsets[v]; }
+    uint32_t downBegin(uint32_t v) const { return m_downOffsets[v]; }
+    const Arc* upArcs() const { return m_upArcs.data(); }
+    const Arc* downArcs() const { return m_downArcs.data(); }
+
+private:
+    static const uint32_t INDEX_FILE_TYPE = 3;
+    enum Side { FORWARD = 0, BACKWARD = 1 };
+
+    // Distance of a target to a vertex, left by its backward search
+    struct BucketEntry {
+        uint32_t target;
+        float distance;
+    };
+
+    // Checks of a loaded hierarchy
+    bool validShortcuts() const;
+    static bool hasArc(const vector<uint32_t>& offsets,
+                       const vector<Arc>& arcs, uint32_t v, uint32_t node);
+
+    // Reset a search and start it from endpoints
+    void startSearch(const vector<RouteEndpoint>& ends,
+                     RouteWorkspace::Search& s) const;
+    // True if a search of side settling u at du can stop there
+    bool stalled(int side, uint32_t u, float du,
+                 const RouteWorkspace::Search& s) const;
+    // Go on from u along the arcs of side
+    void relax(int side, uint32_t u, float du,
+               RouteWorkspace::Search& s) const;
+
+    // Bidirectional upward search, returns the meeting vertex or
+    // graph_t::null_vertex()
+    uint32_t search(const vector<RouteEndpoint>& sources,
+                    const vector<RouteEndpoint>& targets, float& length,
+                    RouteWorkspace& workspace) const;
+    // Buckets of the vertices, as offsets and a flat array
+    void buildBuckets(const vector<vector<RouteEndpoint>>& targets,
+                      float max_distance, size_t num_threads,
+                      vector<uint32_t>& offsets,
+                      vector<BucketEntry>& entries) const;
+    // Distances from source to every target
+    void tableRow(const vector<RouteEndpoint>& source, float max_distance,
+                  const vector<uint32_t>& offsets,
+                  const vector<BucketEntry>& entries,
+                  RouteWorkspace::Search& s, float* row,
+                  size_t num_targets) const;
+    // Append the graph edges of an arc from u to v
+    void unpackArc(uint32_t u, const Arc& arc, uint32_t v,
+                   vector<graph_edge_descriptor>& edges) const;
+
+    const graph_t* m_graph;
+    vector<uint32_t> m_upOffsets;  // n + 1
+    vector<Arc> m_upArcs;
+    vector<uint32_t> m_downOffsets;  // n + 1
+    vector<Arc> m_downArcs;
+};
+
+#endif /* end of include guard: ROAD_ROUTER_H_ */
@@ -0,0 +1,120 @@
+#include "rtree.h"
+
+#include <cmath>
+#include <cstdio>
+
+#include "parallel.h"
+#include "radix_sort.h"
+
+// Sort-Tile-Recursive order of boxes: by center x, then by center y inside
+// each of about sqrt(number of nodes) vertical slabs
+static void strOrder(const vector<RTreeBox>& boxes, size_t capacity,
+                     size_t num_threads, vector<uint32_t>& order) {
+    size_t n = boxes.size();
+    size_t num_leaves = (n + capacity - 1) / capacity;
+    size_t num_slabs =
+        static_cast<size_t>(std::ceil(std::sqrt(double(num_leaves))));
+    size_t slab_size = ((num_leaves + num_slabs - 1) / num_slabs) * capacity;
+
+    // Centers quantized to 32 bits for the radix sort
+    double min_x = numeric_limits<double>::max(), max_x = -min_x;
+    for (const RTreeBox& box : boxes) {
+        double x = 0.5 * (box.minX + box.maxX);
+        min_x = std::min(min_x, x);
+        max_x = std::max(max_x, x);
+    }
+    double scale = max_x > min_x ? 4294967295.0 / (max_x - min_x) : 0.0;
+    vector<uint32_t> keys(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            double x = 0.5 * (boxes[i].minX + boxes[i].maxX);
+            keys[i] = static_cast<uint32_t>((x - min_x) * scale);
+        }
+    });
+    sortIndicesByKey(keys.data(), n, order);
+
+    num_slabs = (n + slab_size - 1) / slab_size;
+    parallelFor(num_slabs, num_threads,
+                [&](size_t begin, size_t end, size_t) {
+                    for (size_t s = begin; s < end; ++s) {
+                        auto first = order.begin() + s * slab_size;
+                        auto last = order.begin() +
+                                    std::min(n, (s + 1) * slab_size);
+                        std::sort(first, last, [&](uint32_t a, uint32_t b) {
+                            return boxes[a].minY + boxes[a].maxY <
+                                   boxes[b].minY + boxes[b].maxY;
+                        });
+                    }
+                });
+}
+
+void RTree::clear() {
+    vector<Node>().swap(m_nodes);
+    m_numLeaves = 0;
+    vector<uint32_t>().swap(m_entries);
+    vector<RTreeBox>().swap(m_entryBoxes);
+}
+
+void RTree::build(const vector<RTreeBox>& boxes, size_t num_threads) {
+    clear();
+    size_t n = boxes.size();
+    if (n == 0) return;
+    if (n > numeric_limits<uint32_t>::max()) {
+        fprintf(stderr,
+                "ERROR: more than 2^32 boxes, cannot build the R-tree.\n");
+        return;
+    }
+    if (num_threads == 0) num_threads = numWorkerThreads();
+
+    // Leaves over the entries
+    strOrder(boxes, NODE_CAPACITY, num_threads, m_entries);
+    m_entryBoxes.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        m_entryBoxes[i] = boxes[m_entries[i]];
+    }
+    vector<Node> level;
+    for (size_t i = 0; i < n; i += NODE_CAPACITY) {
+        Node node;
+        node.first = static_cast<uint32_t>(i);
+        node.count = static_cast<uint32_t>(std::min(NODE_CAPACITY, n - i));
+        for (uint32_t e = node.first; e < node.first + node.count; ++e) {
+            node.box.expand(m_entryBoxes[e]);
+        }
+        level.push_back(node);
+    }
+    m_numLeaves = level.size();
+
+    // Each level is packed in STR order before its parents are created, which
+    // does not move the level below
+    size_t level_begin = 0;
+    vector<RTreeBox> level_boxes;
+    vector<uint32_t> order;
+    while (level.size() > 1) {
+        level_boxes.resize(level.size());
+        for (size_t i = 0; i < level.size(); ++i) {
+            level_boxes[i] = level[i].box;
+        }
+        strOrder(level_boxes, NODE_CAPACITY, num_threads, order);
+        for (uint32_t idx : order) {
+            m_nodes.push_back(level[idx]);
+        }
+
+        vector<Node> parents;
+        for (size_t i = 0; i < level.size(); i += NODE_CAPACITY) {
+            Node node;
+            node.first = static_cast<uint32_t>(level_begin + i);
+            node.count = static_cast<uint32_t>(
+                std::min(NODE_CAPACITY, level.size() - i));
+            for (uint32_t c = node.first; c < node.first + node.count; ++c) {
+                node.box.expand(m_nodes[c].box);
+            }
+            parents.push_back(node);
+        }
+        level_begin += level.size();
+        level.swap(parents);
+    }
+    m_nodes.push_back(level.front());
+}
+
+const size_t RTree::NODE_CAPACITY;
+const size_t RTree::MAX_DEPTH;
@@ -0,0 +1,267 @@
+/*=====================================================================================
+                                rtree.h
+
+    Description:  Static R-tree over boxes, bulk loaded with Sort-Tile-Recursive
+
+        Entries are boxes identified by their position in the input. STR packs
+        them into full leaves of NODE_CAPACITY entries: sorted by center x,
+        cut into vertical slabs, each slab sorted by center y. Upper levels
+        pack the nodes below the same way. Nodes are stored level by level,
+        leaves first and the root last, and the entry boxes in leaf order, so
+        that a query reads contiguous memory.
+
+        The tree only knows boxes. Queries report candidate entries, which the
+        caller refines against the exact geometry, using the segment helpers
+        below for polylines.
+=====================================================================================*/
+
+#ifndef RTREE_H_
+#define RTREE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// [minX, maxX] x [minY, maxY], empty if minX > maxX
+struct RTreeBox {
+    RTreeBox()
+        : minX(numeric_limits<double>::max()),
+          maxX(-numeric_limits<double>::max()),
+          minY(numeric_limits<double>::max()),
+          maxY(-numeric_limits<double>::max()) {}
+    RTreeBox(double min_x, double max_x, double min_y, double max_y)
+        : minX(min_x), maxX(max_x), minY(min_y), maxY(max_y) {}
+
+    double minX;
+    double maxX;
+    double minY;
+    double maxY;
+
+    void expand(double x, double y) {
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+    }
+    void expand(const RTreeBox& other) {
+        minX = std::min(minX, other.minX);
+        maxX = std::max(maxX, other.maxX);
+        minY = std::min(minY, other.minY);
+        maxY = std::max(maxY, other.maxY);
+    }
+    bool intersects(const RTreeBox& other) const {
+        return minX <= other.maxX && other.minX <= maxX &&
+               minY <= other.maxY && other.minY <= maxY;
+    }
+    double sqrDistance(double x, double y) const {
+        double dx = std::max(0.0, std::max(minX - x, x - maxX));
+        double dy = std::max(0.0, std::max(minY - y, y - maxY));
+        return dx * dx + dy * dy;
+    }
+};
+
+class RTree {
+public:
+    RTree() : m_numLeaves(0) {}
+
+    // Entry i is boxes[i]. num_threads = 0 uses numWorkerThreads().
+    void build(const vector<RTreeBox>& boxes, size_t num_threads = 0);
+    void clear();
+
+    size_t size() const { return m_entries.size(); }
+    bool empty() const { return m_entries.empty(); }
+
+    // Call visit(entry) for every entry whose box intersects box
+    template <class Visitor>
+    void search(const RTreeBox& box, Visitor visit) const;
+
+    // Call visit(entry, sqr_distance) for the entries by increasing distance
+    // to (x, y), as long as it returns true. entry_sqr_distance(entry) is
+    // the exact squared distance of an entry, at least that of its box.
+    template <class EntryDistance, class Visitor>
+    void nearest(double x, double y, EntryDistance entry_sqr_distance,
+                 Visitor visit) const;
+
+private:
+    struct Node {
+        RTreeBox box;
+        uint32_t first;  // first child: a node, or an entry for a leaf
+        uint32_t count;
+    };
+
+    static const size_t NODE_CAPACITY = 16;
+    // Bounds the traversal stack: 16^8 entries
+    static const size_t MAX_DEPTH = 8;
+
+    bool isLeaf(size_t node) const { return node < m_numLeaves; }
+
+    vector<Node> m_nodes;  // level by level, leaves first, root last
+    size_t m_numLeaves;
+    vector<uint32_t> m_entries;     // entry ids in leaf order
+    vector<RTreeBox> m_entryBoxes;  // boxes of m_entries
+};
+
+template <class Visitor>
+void RTree::search(const RTreeBox& box, Visitor visit) const {
+    if (m_nodes.empty()) return;
+
+    uint32_t stack[NODE_CAPACITY * MAX_DEPTH + 1];
+    size_t top = 0;
+    stack[top++] = m_nodes.size() - 1;
+    while (top > 0) {
+        size_t node_idx = stack[--top];
+        const Node& node = m_nodes[node_idx];
+        if (!node.box.intersects(box)) continue;
+        if (isLeaf(node_idx)) {
+            for (uint32_t e = node.first; e < node.first + node.count; ++e) {
+                if (m_entryBoxes[e].intersects(box)) visit(m_entries[e]);
+            }
+        } else {
+            for (uint32_t c = node.first; c < node.first + node.count; ++c) {
+                stack[top++] = c;
+            }
+        }
+    }
+}
+
+template <class EntryDistance, class Visitor>
+void RTree::nearest(double x, double y, EntryDistance entry_sqr_distance,
+                    Visitor visit) const {
+    if (m_nodes.empty()) return;
+
+    // Nodes and entries by increasing (lower bound of the) distance. An
+    // entry is queued twice: with its box distance, then its exact one.
+    struct Item {
+        double sqrDistance;
+        uint32_t index;
+        int kind;  // 0: node, 1: entry position, 2: entry with exact distance
+        bool operator<(const Item& other) const {
+            return sqrDistance > other.sqrDistance;
+        }
+    };
+    priority_queue<Item> queue;
+    Item root = {m_nodes.back().box.sqrDistance(x, y),
+                 static_cast<uint32_t>(m_nodes.size() - 1), 0};
+    queue.push(root);
+    while (!queue.empty()) {
+        Item item = queue.top();
+        queue.pop();
+        if (item.kind == 2) {
+            if (!visit(item.index, item.sqrDistance)) return;
+        } else if (item.kind == 1) {
+            uint32_t entry = m_entries[item.index];
+            Item exact = {
+                std::max(item.sqrDistance, entry_sqr_distance(entry)), entry,
+                2};
+            queue.push(exact);
+        } else if (isLeaf(item.index)) {
+            const Node& node = m_nodes[item.index];
+            for (uint32_t e = node.first; e < node.first + node.count; ++e) {
+                Item child = {m_entryBoxes[e].sqrDistance(x, y), e, 1};
+                queue.push(child);
+            }
+        } else {
+            const Node& node = m_nodes[item.index];
+            for (uint32_t c = node.first; c < node.first + node.count; ++c) {
+                Item child = {m_nodes[c].box.sqrDistance(x, y), c, 0};
+                queue.push(child);
+            }
+        }
+    }
+}
+
+/*=====================================================================================
+        Segment geometry
+=====================================================================================*/
+
+// Squared distance from (x, y) to the segment (x0, y0) - (x1, y1). If t is
+// given, it receives the position of the closest point along the segment, in
+// [0, 1].
+inline double sqrDistanceToSegment(double x, double y, double x0, double y0,
+                                   double x1, double y1,
+                                   double* t = nullptr) {
+    double dx = x1 - x0;
+    double dy = y1 - y0;
+    double sqr_length = dx * dx + dy * dy;
+    double s = 0.0;
+    if (sqr_length > 0.0) {
+        s = ((x - x0) * dx + (y - y0) * dy) / sqr_length;
+        s = std::min(1.0, std::max(0.0, s));
+    }
+    if (t) *t = s;
+    double px = x0 + s * dx - x;
+    double py = y0 + s * dy - y;
+    return px * px + py * py;
+}
+
+// Whether the closed segments a0 - a1 and b0 - b1 intersect
+inline bool segmentsIntersect(double ax0, double ay0, double ax1, double ay1,
+                              double bx0, double by0, double bx1,
+                              double by1) {
+    auto orientation = [](double x0, double y0, double x1, double y1,
+                          double x, double y) {
+        double cross = (x1 - x0) * (y - y0) - (y1 - y0) * (x - x0);
+        return (cross > 0.0) - (cross < 0.0);
+    };
+    auto on_segment = [](double x0, double y0, double x1, double y1, double x,
+                         double y) {
+        return std::min(x0, x1) <= x && x <= std::max(x0, x1) &&
+               std::min(y0, y1) <= y && y <= std::max(y0, y1);
+    };
+    int o1 = orientation(ax0, ay0, ax1, ay1, bx0, by0);
+    int o2 = orientation(ax0, ay0, ax1, ay1, bx1, by1);
+    int o3 = orientation(bx0, by0, bx1, by1, ax0, ay0);
+    int o4 = orientation(bx0, by0, bx1, by1, ax1, ay1);
+    if (o1 != o2 && o3 != o4) return true;
+    return (o1 == 0 && on_segment(ax0, ay0, ax1, ay1, bx0, by0)) ||
+           (o2 == 0 && on_segment(ax0, ay0, ax1, ay1, bx1, by1)) ||
+           (o3 == 0 && on_segment(bx0, by0, bx1, by1, ax0, ay0)) ||
+           (o4 == 0 && on_segment(bx0, by0, bx1, by1, ax1, ay1));
+}
+
+// Squared distance between the segments a0 - a1 and b0 - b1
+inline double sqrDistanceBetweenSegments(double ax0, double ay0, double ax1,
+                                         double ay1, double bx0, double by0,
+                                         double bx1, double by1) {
+    if (segmentsIntersect(ax0, ay0, ax1, ay1, bx0, by0, bx1, by1)) {
+        return 0.0;
+    }
+    return std::min(
+        std::min(sqrDistanceToSegment(ax0, ay0, bx0, by0, bx1, by1),
+                 sqrDistanceToSegment(ax1, ay1, bx0, by0, bx1, by1)),
+        std::min(sqrDistanceToSegment(bx0, by0, ax0, ay0, ax1, ay1),
+                 sqrDistanceToSegment(bx1, by1, ax0, ay0, ax1, ay1)));
+}
+
+// Whether the segment (x0, y0) - (x1, y1) intersects the closed box
+inline bool segmentIntersectsBox(double x0, double y0, double x1, double y1,
+                                 const RTreeBox& box) {
+    // Clip the segment against the box (Liang-Barsky)
+    double t0 = 0.0, t1 = 1.0;
+    double dx = x1 - x0, dy = y1 - y0;
+    double p[4] = {-dx, dx, -dy, dy};
+    double q[4] = {x0 - box.minX, box.maxX - x0, y0 - box.minY,
+                   box.maxY - y0};
+    for (int i = 0; i < 4; ++i) {
+        if (p[i] == 0.0) {
+            if (q[i] < 0.0) return false;
+        } else {
+            double r = q[i] / p[i];
+            if (p[i] < 0.0) {
+                t0 = std::max(t0, r);
+            } else {
+                t1 = std::min(t1, r);
+            }
+            if (t0 > t1) return false;
+        }
+    }
+    return true;
+}
+
+#endif /* end of include guard: RTREE_H_ */
@@ -0,0 +1,85 @@
+#include "segment_index.h"
+
+#include <cmath>
+
+#include "parallel.h"
+
+void SegmentIndex::clear() {
+    vector<Segment>().swap(m_segments);
+    m_tree.clear();
+}
+
+void SegmentIndex::build(const PointSpans<float>& starts,
+                         const PointSpans<float>& ends, size_t num_threads) {
+    clear();
+    size_t n = std::min(starts.size(), ends.size());
+    if (n == 0) return;
+    if (num_threads == 0) num_threads = numWorkerThreads();
+
+    m_segments.resize(n);
+    vector<RTreeBox> boxes(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            Segment& segment = m_segments[i];
+            segment.x0 = static_cast<float>(starts.coord(i, 0));
+            segment.y0 = static_cast<float>(starts.coord(i, 1));
+            segment.x1 = static_cast<float>(ends.coord(i, 0));
+            segment.y1 = static_cast<float>(ends.coord(i, 1));
+            boxes[i].expand(segment.x0, segment.y0);
+            boxes[i].expand(segment.x1, segment.y1);
+        }
+    });
+    m_tree.build(boxes, num_threads);
+}
+
+double SegmentIndex::sqrDistanceTo(uint32_t segment, double x, double y,
+                                   double* t) const {
+    const Segment& s = m_segments[segment];
+    return sqrDistanceToSegment(x, y, s.x0, s.y0, s.x1, s.y1, t);
+}
+
+void SegmentIndex::project(uint32_t segment, double x, double y,
+                           SegmentSnap& result) const {
+    const Segment& s = m_segments[segment];
+    double t;
+    result.segment = segment;
+    result.sqrDistance = sqrDistanceTo(segment, x, y, &t);
+    double dx = double(s.x1) - s.x0;
+    double dy = double(s.y1) - s.y0;
+    result.x = s.x0 + t * dx;
+    result.y = s.y0 + t * dy;
+    result.offset = t * std::sqrt(dx * dx + dy * dy);
+}
+
+bool SegmentIndex::snap(double x, double y, SegmentSnap& result,
+                        double max_distance) const {
+    double max_sqr_distance = max_distance * max_distance;
+    bool found = false;
+    m_tree.nearest(
+        x, y,
+        [&](uint32_t segment) { return sqrDistanceTo(segment, x, y); },
+        [&](uint32_t segment, double sqr_distance) {
+            if (sqr_distance <= max_sqr_distance) {
+                project(segment, x, y, result);
+                found = true;
+            }
+            return false;
+        });
+    return found;
+}
+
+size_t SegmentIndex::nearestKSegments(double x, double y, size_t k,
+                                      vector<SegmentSnap>& results) const {
+    results.clear();
+    if (k == 0) return 0;
+    m_tree.nearest(
+        x, y,
+        [&](uint32_t segment) { return sqrDistanceTo(segment, x, y); },
+        [&](uint32_t segment, double) {
+            SegmentSnap snap;
+            project(segment, x, y, snap);
+            results.push_back(snap);
+            return results.size() < k;
+        });
+    return results.size();
+}
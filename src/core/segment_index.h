@@ -0,0 +1,71 @@
+/*=====================================================================================
+                                segment_index.h
+
+    Description:  Nearest segment queries on an STR R-tree of segments
+
+        Each segment is one R-tree entry (see rtree.h). The best-first
+        traversal of the tree refines the candidates with their exact
+        distance, so snapping a point returns the true closest segment and
+        its orthogonal projection, instead of the closest of a set of points
+        interpolated along the segments.
+=====================================================================================*/
+
+#ifndef SEGMENT_INDEX_H_
+#define SEGMENT_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kdtree.h"
+#include "rtree.h"
+
+using namespace std;
+
+// A point snapped onto a segment
+struct SegmentSnap {
+    uint32_t segment;
+    double x;  // projected point
+    double y;
+    double offset;  // distance from the segment start to the projected point
+    double sqrDistance;
+};
+
+class SegmentIndex {
+public:
+    // Segment i goes from starts[i] to ends[i]. The coordinates are copied.
+    // num_threads = 0 uses numWorkerThreads().
+    void build(const PointSpans<float>& starts, const PointSpans<float>& ends,
+               size_t num_threads = 0);
+    void clear();
+
+    size_t size() const { return m_segments.size(); }
+    bool empty() const { return m_segments.empty(); }
+
+    // Closest segment within max_distance of (x, y). Returns false if there
+    // is none.
+    bool snap(double x, double y, SegmentSnap& result,
+              double max_distance = numeric_limits<double>::infinity()) const;
+
+    // The k closest segments by increasing distance
+    size_t nearestKSegments(double x, double y, size_t k,
+                            vector<SegmentSnap>& results) const;
+
+private:
+    struct Segment {
+        float x0;
+        float y0;
+        float x1;
+        float y1;
+    };
+
+    double sqrDistanceTo(uint32_t segment, double x, double y,
+                         double* t = nullptr) const;
+    void project(uint32_t segment, double x, double y,
+                 SegmentSnap& result) const;
+
+    vector<Segment> m_segments;
+    RTree m_tree;
+};
+
+#endif /* end of include guard: SEGMENT_INDEX_H_ */
@@ -0,0 +1,346 @@
+#include "spatiotemporal_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+#include "parallel.h"
+#include "radix_sort.h"
+
+// Cells per side, so that row-major cell ids fit in 32 bits
+static const double MAX_CELLS_PER_SIDE = 65536.0;
+// At most one bucket per point (or this many buckets for small datasets):
+// outlying timestamps get wider buckets, not huge offset arrays
+static const size_t MIN_BUCKET_LIMIT = 1 << 16;
+
+// offsets[k] = first position i of the n sorted keys with key(i) >= k, for
+// k in [0, num_keys]. Each offset is written by the position where the key
+// reaches it, so blocks fill theirs independently.
+template <class Key>
+static void sortedKeyOffsets(size_t n, size_t num_keys, size_t num_threads,
+                             Key key, vector<uint64_t>& offsets) {
+    offsets.assign(num_keys + 1, n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            size_t from = i > 0 ? key(i - 1) + 1 : 0;
+            for (size_t k = from; k <= key(i); ++k) {
+                offsets[k] = i;
+            }
+        }
+    });
+}
+
+SpatioTemporalIndex::SpatioTemporalIndex()
+    : m_timestamps(nullptr),
+      m_trajectories(nullptr),
+      m_minTime(0),
+      m_maxTime(0),
+      m_minX(0.0),
+      m_minY(0.0),
+      m_cellSize(0.0),
+      m_numCellsX(0),
+      m_numCellsY(0) {}
+
+void SpatioTemporalIndex::clear() {
+    m_positions = PointSpans<int32_t>();
+    m_timestamps = nullptr;
+    m_trajectories = nullptr;
+    m_numCellsX = m_numCellsY = 0;
+    vector<uint32_t>().swap(m_points);
+    vector<uint32_t>().swap(m_pointCells);
+    vector<uint64_t>().swap(m_bucketOffsets);
+    vector<uint64_t>().swap(m_bucketTrajOffsets);
+    vector<uint32_t>().swap(m_bucketTrajs);
+}
+
+long SpatioTemporalIndex::cellX(double x) const {
+    double c = std::floor((x - m_minX) / m_cellSize);
+    if (!(c > 0.0)) return 0;
+    if (c >= static_cast<double>(m_numCellsX)) return m_numCellsX - 1;
+    return static_cast<long>(c);
+}
+
+long SpatioTemporalIndex::cellY(double y) const {
+    double c = std::floor((y - m_minY) / m_cellSize);
+    if (!(c > 0.0)) return 0;
+    if (c >= static_cast<double>(m_numCellsY)) return m_numCellsY - 1;
+    return static_cast<long>(c);
+}
+
+// Calls f with every bucket holding a sample of traj or bridged by two
+// consecutive samples at most maxGap apart, once each in ascending order
+template <class Func>
+void SpatioTemporalIndex::forEachSnapshotBucket(TrajectoryView traj,
+                                                Func f) const {
+    size_t next_bucket = 0;  // first bucket not reported yet
+    uint32_t prev_t = 0;
+    for (auto it = traj.begin(); it != traj.end(); ++it) {
+        uint32_t t = m_timestamps[*it];
+        size_t b = bucketOf(t);
+        bool bridged = it != traj.begin() && t >= prev_t &&
+                       t - prev_t <= m_params.maxGap;
+        size_t from = bridged ? bucketOf(prev_t) : b;
+        for (size_t k = std::max(from, next_bucket); k <= b; ++k) {
+            f(k);
+        }
+        next_bucket = std::max(next_bucket, b + 1);
+        prev_t = t;
+    }
+}
+
+void SpatioTemporalIndex::build(const PointSpans<int32_t>& positions,
+                                const uint32_t* timestamps,
+                                const TrajectoryCSR* trajectories) {
+    clear();
+    size_t n = positions.size();
+    if (n == 0) return;
+    if (n > numeric_limits<uint32_t>::max()) {
+        fprintf(stderr,
+                "ERROR: more than 2^32 points, cannot build the "
+                "spatio-temporal index.\n");
+        return;
+    }
+    m_positions = positions;
+    m_timestamps = timestamps;
+    m_trajectories = trajectories;
+    if (m_params.bucketSeconds < 1) m_params.bucketSeconds = 1;
+    size_t num_threads = m_params.buildThreads > 0 ? m_params.buildThreads
+                                                   : numWorkerThreads();
+
+    // Time range and bounding box
+    struct Range {
+        uint32_t minTime, maxTime;
+        double box[4];
+    };
+    vector<Range> thread_range(num_threads);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t tid) {
+        Range range = {numeric_limits<uint32_t>::max(),
+                       0,
+                       {numeric_limits<double>::max(),
+                        -numeric_limits<double>::max(),
+                        numeric_limits<double>::max(),
+                        -numeric_limits<double>::max()}};
+        for (size_t i = begin; i < end; ++i) {
+            double x = positions.coord(i, 0);
+            double y = positions.coord(i, 1);
+            range.minTime = std::min(range.minTime, timestamps[i]);
+            range.maxTime = std::max(range.maxTime, timestamps[i]);
+            range.box[0] = std::min(range.box[0], x);
+            range.box[1] = std::max(range.box[1], x);
+            range.box[2] = std::min(range.box[2], y);
+            range.box[3] = std::max(range.box[3], y);
+        }
+        thread_range[tid] = range;
+    });
+    Range range = thread_range[0];
+    for (size_t t = 1; t < num_threads; ++t) {
+        const Range& other = thread_range[t];
+        range.minTime = std::min(range.minTime, other.minTime);
+        range.maxTime = std::max(range.maxTime, other.maxTime);
+        range.box[0] = std::min(range.box[0], other.box[0]);
+        range.box[1] = std::max(range.box[1], other.box[1]);
+        range.box[2] = std::min(range.box[2], other.box[2]);
+        range.box[3] = std::max(range.box[3], other.box[3]);
+    }
+    m_minTime = range.minTime;
+    m_maxTime = range.maxTime;
+    size_t max_buckets = std::max<size_t>(n, MIN_BUCKET_LIMIT);
+    size_t time_span = size_t(m_maxTime) - m_minTime + 1;
+    if (bucketOf(m_maxTime) >= max_buckets) {
+        m_params.bucketSeconds = static_cast<uint32_t>(
+            (time_span + max_buckets - 1) / max_buckets);
+        fprintf(stderr,
+                "WARNING: timestamps span %zu s, widening the time buckets "
+                "of the spatio-temporal index to %u s.\n",
+                time_span, m_params.bucketSeconds);
+    }
+    size_t num_buckets = bucketOf(m_maxTime) + 1;
+
+    // At most one cell per point, which bounds the rows scanned per bucket
+    m_minX = range.box[0];
+    m_minY = range.box[2];
+    double width = range.box[1] - range.box[0];
+    double height = range.box[3] - range.box[2];
+    m_cellSize = std::max<double>(m_params.cellSize, 1e-3);
+    m_cellSize = std::max(m_cellSize,
+                          std::max(width, height) / (MAX_CELLS_PER_SIDE - 1));
+    double area = (width + m_cellSize) * (height + m_cellSize);
+    if (area / (m_cellSize * m_cellSize) > n) {
+        m_cellSize = std::sqrt(area / n);
+    }
+    m_numCellsX = std::min<size_t>(width / m_cellSize + 1, MAX_CELLS_PER_SIDE);
+    m_numCellsY = std::min<size_t>(height / m_cellSize + 1, MAX_CELLS_PER_SIDE);
+
+    // Sort by cell, then stably by bucket
+    vector<uint32_t> keys(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            keys[i] = static_cast<uint32_t>(
+                cellY(positions.coord(i, 1)) * m_numCellsX +
+                cellX(positions.coord(i, 0)));
+        }
+    });
+    vector<uint32_t> by_cell;
+    sortIndicesByKey(keys.data(), n, by_cell);
+    vector<uint32_t> cells(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            cells[i] = keys[by_cell[i]];
+        }
+    });
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            keys[i] = static_cast<uint32_t>(bucketOf(timestamps[by_cell[i]]));
+        }
+    });
+    vector<uint32_t> order;
+    sortIndicesByKey(keys.data(), n, order);
+    m_points.resize(n);
+    m_pointCells.resize(n);
+    parallelFor(n, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            m_points[i] = by_cell[order[i]];
+            m_pointCells[i] = cells[order[i]];
+        }
+    });
+
+    // keys[order[i]] is the bucket of m_points[i]
+    sortedKeyOffsets(n, num_buckets, num_threads,
+                     [&](size_t i) { return keys[order[i]]; },
+                     m_bucketOffsets);
+
+    // Buckets in which a snapshot can find each trajectory: those holding
+    // its samples, and those between two samples at most maxGap apart
+    size_t n_traj = trajectories ? trajectories->size() : 0;
+    vector<uint64_t> traj_entries(n_traj + 1, 0);
+    parallelFor(n_traj, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            size_t count = 0;
+            forEachSnapshotBucket((*trajectories)[i],
+                                  [&](size_t) { ++count; });
+            traj_entries[i + 1] = count;
+        }
+    });
+    for (size_t i = 0; i < n_traj; ++i) {
+        traj_entries[i + 1] += traj_entries[i];
+    }
+    size_t num_entries = traj_entries.back();
+    if (num_entries > numeric_limits<uint32_t>::max()) {
+        fprintf(stderr,
+                "ERROR: more than 2^32 trajectory buckets, snapshots of the "
+                "spatio-temporal index are disabled.\n");
+        m_bucketTrajOffsets.assign(num_buckets + 1, 0);
+        return;
+    }
+    vector<uint32_t> entry_buckets(num_entries), entry_trajs(num_entries);
+    parallelFor(n_traj, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            size_t e = traj_entries[i];
+            forEachSnapshotBucket((*trajectories)[i], [&](size_t b) {
+                entry_buckets[e] = static_cast<uint32_t>(b);
+                entry_trajs[e++] = static_cast<uint32_t>(i);
+            });
+        }
+    });
+
+    // Stable: the trajectories of a bucket stay in ascending order
+    sortIndicesByKey(entry_buckets.data(), num_entries, order);
+    m_bucketTrajs.resize(num_entries);
+    parallelFor(num_entries, num_threads,
+                [&](size_t begin, size_t end, size_t) {
+        for (size_t e = begin; e < end; ++e) {
+            m_bucketTrajs[e] = entry_trajs[order[e]];
+        }
+    });
+    sortedKeyOffsets(num_entries, num_buckets, num_threads,
+                     [&](size_t e) { return entry_buckets[order[e]]; },
+                     m_bucketTrajOffsets);
+}
+
+size_t SpatioTemporalIndex::rangeSearch(double min_x, double max_x,
+                                        double min_y, double max_y,
+                                        uint32_t t_begin, uint32_t t_end,
+                                        vector<uint32_t>& indices) const {
+    indices.clear();
+    if (m_points.empty() || min_x > max_x || min_y > max_y ||
+        t_begin > t_end || t_end < m_minTime || t_begin > m_maxTime) {
+        return 0;
+    }
+
+    size_t b0 = bucketOf(std::max(t_begin, m_minTime));
+    size_t b1 = bucketOf(std::min(t_end, m_maxTime));
+    long cx0 = cellX(min_x), cx1 = cellX(max_x);
+    long cy0 = cellY(min_y), cy1 = cellY(max_y);
+    for (size_t b = b0; b <= b1; ++b) {
+        auto bucket_begin = m_pointCells.begin() + m_bucketOffsets[b];
+        auto bucket_end = m_pointCells.begin() + m_bucketOffsets[b + 1];
+        // Only the first and last buckets can hold points out of the window
+        bool check_time = b == b0 || b == b1;
+        for (long cy = cy0; cy <= cy1; ++cy) {
+            uint32_t first_cell = cy * m_numCellsX + cx0;
+            uint32_t last_cell = cy * m_numCellsX + cx1;
+            auto it = std::lower_bound(bucket_begin, bucket_end, first_cell);
+            for (; it != bucket_end && *it <= last_cell; ++it) {
+                uint32_t pt_idx = m_points[it - m_pointCells.begin()];
+                double x = m_positions.coord(pt_idx, 0);
+                double y = m_positions.coord(pt_idx, 1);
+                uint32_t t = m_timestamps[pt_idx];
+                if (x >= min_x && x <= max_x && y >= min_y && y <= max_y &&
+                    (!check_time || (t >= t_begin && t <= t_end))) {
+                    indices.push_back(pt_idx);
+                }
+            }
+            bucket_begin = it;
+        }
+    }
+    return indices.size();
+}
+
+size_t SpatioTemporalIndex::snapshot(
+    uint32_t t, vector<TrajectoryPosition>& positions) const {
+    positions.clear();
+    if (m_points.empty() || !m_trajectories || t < m_minTime ||
+        t > m_maxTime) {
+        return 0;
+    }
+
+    size_t b = bucketOf(t);
+    for (uint64_t k = m_bucketTrajOffsets[b]; k < m_bucketTrajOffsets[b + 1];
+         ++k) {
+        uint32_t traj_idx = m_bucketTrajs[k];
+        TrajectoryView traj = (*m_trajectories)[traj_idx];
+
+        // First sample after t
+        auto next = std::upper_bound(
+            traj.begin(), traj.end(), t,
+            [this](uint32_t time, size_t pt_idx) {
+                return time < m_timestamps[pt_idx];
+            });
+        if (next == traj.begin()) continue;
+        size_t prev_pt = *(next - 1);
+        uint32_t prev_t = m_timestamps[prev_pt];
+
+        TrajectoryPosition position;
+        position.trajectory = traj_idx;
+        position.sample = static_cast<uint32_t>(prev_pt);
+        position.ratio = 0.0f;
+        position.easting = m_positions.coord(prev_pt, 0);
+        position.northing = m_positions.coord(prev_pt, 1);
+        if (prev_t != t) {
+            if (next == traj.end()) continue;
+            size_t next_pt = *next;
+            uint32_t next_t = m_timestamps[next_pt];
+            if (next_t - prev_t > m_params.maxGap) continue;
+
+            double ratio = double(t - prev_t) / (next_t - prev_t);
+            position.ratio = static_cast<float>(ratio);
+            position.easting +=
+                ratio * (m_positions.coord(next_pt, 0) - position.easting);
+            position.northing +=
+                ratio * (m_positions.coord(next_pt, 1) - position.northing);
+        }
+        positions.push_back(position);
+    }
+    return positions.size();
+}
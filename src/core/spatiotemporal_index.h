@@ -0,0 +1,106 @@
+/*=====================================================================================
+                                spatiotemporal_index.h
+
+    Description:  Bounding box x time window index over trajectory points
+
+        Time is cut into buckets of bucketSeconds and space into square cells.
+        Point ids are sorted by (bucket, row-major cell), so that inside a
+        bucket the cells of a row of a query box are one contiguous range,
+        found by binary search. Building is two parallel radix sorts.
+
+        Every bucket also lists the trajectories with a sample in it, or with
+        two consecutive samples at most maxGap apart around it, which answers
+        snapshots: the position of every car at time t, interpolated between
+        the two samples around t. The samples of a trajectory must be sorted
+        by timestamp, as produced by the loaders.
+=====================================================================================*/
+
+#ifndef SPATIOTEMPORAL_INDEX_H_
+#define SPATIOTEMPORAL_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kdtree.h"
+#include "trajectory_csr.h"
+
+using namespace std;
+
+struct SpatioTemporalParams {
+    SpatioTemporalParams()
+        : bucketSeconds(300), cellSize(200.0f), maxGap(300), buildThreads(0) {}
+
+    // Width of a time bucket, widened by build() if the time range would
+    // need more buckets than points
+    uint32_t bucketSeconds;
+    float cellSize;          // in meters
+    uint32_t maxGap;         // no interpolation across larger sample gaps
+    size_t buildThreads;     // 0: numWorkerThreads()
+};
+
+// Position of a trajectory at the time of a snapshot
+struct TrajectoryPosition {
+    uint32_t trajectory;
+    uint32_t sample;  // point id of the last sample at or before the time
+    float ratio;      // from sample toward the next one, in [0, 1)
+    double easting;   // interpolated position in meters
+    double northing;
+};
+
+class SpatioTemporalIndex {
+public:
+    SpatioTemporalIndex();
+
+    void setParams(const SpatioTemporalParams& params) { m_params = params; }
+    const SpatioTemporalParams& params() const { return m_params; }
+
+    // The columns are read in place and must outlive the index
+    void build(const PointSpans<int32_t>& positions,
+               const uint32_t* timestamps, const TrajectoryCSR* trajectories);
+    void clear();
+
+    size_t size() const { return m_points.size(); }
+    bool empty() const { return m_points.empty(); }
+
+    // Points with min_x <= x <= max_x, min_y <= y <= max_y and
+    // t_begin <= timestamp <= t_end
+    size_t rangeSearch(double min_x, double max_x, double min_y, double max_y,
+                       uint32_t t_begin, uint32_t t_end,
+                       vector<uint32_t>& indices) const;
+
+    // Position at time t of every trajectory with samples before and after
+    // t (or exactly at t) at most maxGap apart
+    size_t snapshot(uint32_t t, vector<TrajectoryPosition>& positions) const;
+
+private:
+    size_t bucketOf(uint32_t t) const {
+        return (t - m_minTime) / m_params.bucketSeconds;
+    }
+    template <class Func>
+    void forEachSnapshotBucket(TrajectoryView traj, Func f) const;
+    long cellX(double x) const;
+    long cellY(double y) const;
+
+    SpatioTemporalParams m_params;
+    PointSpans<int32_t> m_positions;
+    const uint32_t* m_timestamps;
+    const TrajectoryCSR* m_trajectories;
+
+    uint32_t m_minTime;
+    uint32_t m_maxTime;
+    double m_minX;
+    double m_minY;
+    double m_cellSize;
+    size_t m_numCellsX;
+    size_t m_numCellsY;
+
+    vector<uint32_t> m_points;         // sorted by (bucket, cell)
+    vector<uint32_t> m_pointCells;     // cell of m_points[i]
+    vector<uint64_t> m_bucketOffsets;  // range of each bucket in m_points
+    // Trajectories a snapshot can find in each bucket, in CSR layout
+    vector<uint64_t> m_bucketTrajOffsets;
+    vector<uint32_t> m_bucketTrajs;
+};
+
+#endif /* end of include guard: SPATIOTEMPORAL_INDEX_H_ */
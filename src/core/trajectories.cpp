@@ -3,28 +3,50 @@
 #include "shader.h"
 #include "renderable_object.h"
 
-#include <fcntl.h>
+#include <atomic>
+#include <cstring>
+#include <mutex>
 #include "gps_trajectory.pb.h"
 #include <google/protobuf/io/coded_stream.h>
-#include <google/protobuf/io/zero_copy_stream_impl.h>
-
-#include <pcl/common/centroid.h>
-#include <pcl/search/impl/flann_search.hpp>
 
+#include "index_file.h"
 #include "latlon_converter.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "radix_sort.h"
+#include "trajectory_reader.h"
 #include "common.h"
 
 Trajectories::Trajectories()
-    : m_gpsPoints(new pcl::PointCloud<GpsPointType>),
-      m_searchTree(new pcl::search::FlannSearch<GpsPointType>(false)),
-      m_vboPoints(new RenderableObject),
+    : m_vboPoints(new RenderableObject),
       m_vboAnimation(new RenderableObject),
+      m_origin(0.0, 0.0),
+      m_spatioTemporalIndexBuilt(false),
+      m_trajectoryTreeBuilt(false),
+      m_compactStorage(false),
       m_renderMode(POINTS),
       m_animationTime(0.0f) {}
 
 Trajectories::~Trajectories() {}
 
-bool Trajectories::load(const string& filename) { return loadPBF(filename); }
+constexpr double Trajectories::POSITION_RESOLUTION;
+
+bool Trajectories::load(const string& filename) {
+    string cache_filename = filename + ".cache";
+    if (loadCache(cache_filename, filename)) {
+        return true;
+    }
+
+    if (!loadPBF(filename)) {
+        return false;
+    }
+
+    // Only a complete load of the file is cached
+    if (m_sourceFilename == filename) {
+        saveCache(cache_filename, filename);
+    }
+    return true;
+}
 
 bool Trajectories::save(const string& filename) {
     if (savePBF(filename)) {
@@ -36,7 +58,12 @@ bool Trajectories::save(const string& filename) {
 }
 
 void Trajectories::clear() {
-    if (m_gpsPoints->size() > 0) m_gpsPoints->clear();
+    m_searchTree.clear();
+    m_spatioTemporalIndex.clear();
+    m_spatioTemporalIndexBuilt = false;
+    m_trajectoryTree.clear();
+    m_trajectoryTreeBuilt = false;
+    m_sourceFilename.clear();
 
     m_boundBox = Eigen::Vector4f(POSITIVE_INFINITY, -POSITIVE_INFINITY,
                                  POSITIVE_INFINITY, -POSITIVE_INFINITY);
@@ -50,20 +77,27 @@ void Trajectories::clear() {
     m_heavy.clear();
 
     m_indexedTraj.clear();
-    m_trajIdx.clear();
-    m_sampleIdxInTraj.clear();
-    m_easting.clear();
-    m_northing.clear();
+    m_trajRecord.clear();
+    m_origin = Eigen::Vector2d(0.0, 0.0);
+    m_posX.clear();
+    m_posY.clear();
 
     m_sortedPointIdx.clear();
 }
 
 bool Trajectories::isEmpty() {
-    if (m_gpsPoints->size() == 0) return true;
+    if (m_posX.empty()) return true;
 
     return false;
 }
 
+void Trajectories::setSearchBackend(SearchBackend backend) {
+    m_searchTree.setBackend(backend);
+    if (!m_posX.empty()) {
+        buildSearchIndex();
+    }
+}
+
 void Trajectories::update(float delta) {
     if (m_renderMode == ANIMATE) {
         m_animationTime += delta;
@@ -117,9 +151,9 @@ void Trajectories::updatePointVBO() {
     glm::vec4 color(1.0f, 1.0f, 0.0f, 0.3f);
 
     float scale = params::inst().scale;
-    for (size_t i = 0; i < m_easting.size(); ++i) {
+    for (size_t i = 0; i < m_posX.size(); ++i) {
         RenderableObject::Vertex newPt;
-        glm::vec3 normalizedV = BBOXNormalize(m_easting[i], m_northing[i], 0.0);
+        glm::vec3 normalizedV = BBOXNormalize(easting(i), northing(i), 0.0);
         newPt.Position =
             glm::vec3(normalizedV.x * scale, 1.0f, -normalizedV.y * scale);
 
@@ -143,7 +177,7 @@ void Trajectories::updateAnimateVBO() {
     float cur_t = m_animationTime / 10.0f;
     float scale = params::inst().scale;
     for (size_t i = 0; i < m_indexedTraj.size(); ++i) {
-        vector<size_t>& traj = m_indexedTraj[i];
+        TrajectoryView traj = m_indexedTraj[i];
 
         float traj_t0 = m_timestamp[traj[0]];
         float dt = 0.0f;
@@ -155,7 +189,7 @@ void Trajectories::updateAnimateVBO() {
 
             RenderableObject::Vertex newPt;
             glm::vec3 normalizedV =
-                BBOXNormalize(m_easting[traj[j]], m_northing[traj[j]], 0.0);
+                BBOXNormalize(easting(traj[j]), northing(traj[j]), 0.0);
             newPt.Position =
                 glm::vec3(normalizedV.x * scale, 1.0f, -normalizedV.y * scale);
 
@@ -181,189 +215,974 @@ void Trajectories::updateAnimateVBO() {
         End of Updating VBOs
 =====================================================================================*/
 
+/*=====================================================================================
+        Parallel PBF Loading
+
+        The trajectory file is a uint32 count followed by [uint32 length][GpsTraj]
+        records. loadPBF maps the file, scans the record boundaries, then decodes
+        and re-heads disjoint record ranges on all cores into per-thread column
+        buffers. Once the UTM zone is known from the centroid of the data, the
+        buffers are projected in parallel and concatenated in record order.
+=====================================================================================*/
+struct TrajRecord {
+    size_t offset;  // byte offset of the GpsTraj message in the file
+    uint32_t length;
+};
+
+// Decoded columns of a contiguous range of trajectories
+struct TrajectoryColumns {
+    vector<int32_t> carIdx;
+    vector<uint32_t> timestamp;
+    vector<int32_t> lon;
+    vector<int32_t> lat;
+    vector<int16_t> heading;
+    vector<int16_t> speed;
+    vector<bool> heavy;
+    vector<int32_t> posX;  // fixed-point, see Trajectories::m_origin
+    vector<int32_t> posY;
+
+    vector<uint32_t> trajRecord;  // record id of each kept trajectory
+    vector<size_t> trajSize;
+
+    size_t size() const { return timestamp.size(); }
+
+    void reserve(size_t n_pt, size_t n_traj) {
+        carIdx.reserve(n_pt);
+        timestamp.reserve(n_pt);
+        lon.reserve(n_pt);
+        lat.reserve(n_pt);
+        heading.reserve(n_pt);
+        speed.reserve(n_pt);
+        heavy.reserve(n_pt);
+        posX.reserve(n_pt);
+        posY.reserve(n_pt);
+        trajRecord.reserve(n_traj);
+        trajSize.reserve(n_traj);
+    }
+};
+
+// Scan record boundaries of a trajectory file in memory. truncated is set
+// when the file ends before the number of trajectories of its header.
+static bool scanTrajectoryRecords(const char* data, size_t size,
+                                  vector<TrajRecord>& records,
+                                  bool& truncated) {
+    records.clear();
+    truncated = false;
+    if (size < sizeof(uint32_t)) return false;
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    uint32_t num_trajectory;
+    google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+        bytes, &num_trajectory);
+    if (num_trajectory > 1e9) {
+        printf(
+            "ERROR: more than 1e9 trajectories in the trajectory file? We "
+            "cannot handle that...\n");
+        return false;
+    }
+
+    records.reserve(num_trajectory);
+    size_t pos = sizeof(uint32_t);
+    for (size_t id_traj = 0; id_traj < num_trajectory; ++id_traj) {
+        if (pos + sizeof(uint32_t) > size) {
+            // Same as TrajectoryReader::next()
+            fprintf(stderr,
+                    "ERROR: Protobuf trajectory file truncated after %zu of "
+                    "%u trajectories!\n",
+                    id_traj, num_trajectory);
+            truncated = true;
+            break;
+        }
+        TrajRecord record;
+        google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+            bytes + pos, &record.length);
+        record.offset = pos + sizeof(uint32_t);
+        if (record.offset + record.length > size) {
+            fprintf(stderr,
+                    "ERROR: Protobuf trajectory file possibly contaminated!\n");
+            return false;
+        }
+        records.push_back(record);
+        pos = record.offset + record.length;
+    }
+    return true;
+}
+
+// Number of points projected at once when filling fixed-point positions
+static const size_t PROJECTION_CHUNK_SIZE = 4096;
+
+static inline int32_t toFixedPoint(double value, double origin) {
+    return static_cast<int32_t>(
+        std::lround((value - origin) / Trajectories::POSITION_RESOLUTION));
+}
+
+static inline int16_t saturateInt16(int32_t value) {
+    return static_cast<int16_t>(
+        std::max<int32_t>(numeric_limits<int16_t>::min(),
+                          std::min<int32_t>(numeric_limits<int16_t>::max(),
+                                            value)));
+}
+
+// Project every point of a trajectory to easting / northing
+static void projectTrajectory(const GpsTraj& traj, vector<int32_t>& lat,
+                              vector<int32_t>& lon, vector<double>& easting,
+                              vector<double>& northing) {
+    size_t n = traj.point_size();
+    lat.resize(n);
+    lon.resize(n);
+    easting.resize(n);
+    northing.resize(n);
+    for (size_t pt_idx = 0; pt_idx < n; ++pt_idx) {
+        lat[pt_idx] = traj.point(pt_idx).lat();
+        lon[pt_idx] = traj.point(pt_idx).lon();
+    }
+    Converter::getInstance().convertLatLonToXY(n, lat.data(), lon.data(),
+                                               easting.data(), northing.data());
+}
+
+// Append samples [begin, end) of a trajectory as a new trajectory, with
+// positions relative to origin. If easting is null, the positions are left
+// for the caller to project.
+static void appendTrajectory(const GpsTraj& traj, size_t begin, size_t end,
+                             const double* easting, const double* northing,
+                             const Eigen::Vector2d& origin, size_t record,
+                             TrajectoryColumns& columns) {
+    for (size_t pt_idx = begin; pt_idx < end; ++pt_idx) {
+        const TrajPoint& pt = traj.point(pt_idx);
+        columns.carIdx.push_back(pt.car_id());
+        columns.timestamp.push_back(pt.timestamp());
+        columns.lon.push_back(pt.lon());
+        columns.lat.push_back(pt.lat());
+
+        int new_traj_point_head = 450 - pt.head();
+        if (new_traj_point_head > 360) {
+            new_traj_point_head -= 360;
+        }
+        columns.heading.push_back(saturateInt16(new_traj_point_head));
+        columns.speed.push_back(saturateInt16(pt.speed()));
+        columns.heavy.push_back(pt.heavy());
+
+        if (easting != nullptr) {
+            columns.posX.push_back(toFixedPoint(easting[pt_idx], origin[0]));
+            columns.posY.push_back(toFixedPoint(northing[pt_idx], origin[1]));
+        }
+    }
+    columns.trajRecord.push_back(record);
+    columns.trajSize.push_back(end - begin);
+}
+
+// Locate records [first, first + count) through the index at the end of the
+// file. Returns false if the file has no usable index.
+static bool findTrajectoryRecords(const char* data, size_t size,
+                                  TrajectoryFileIndex& index, size_t first,
+                                  size_t count, vector<TrajRecord>& records) {
+    records.clear();
+    if (!index.read(data, size) || size < sizeof(uint32_t)) return false;
+
+    uint32_t num_trajectory;
+    google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+        reinterpret_cast<const uint8_t*>(data), &num_trajectory);
+    if (index.numRecords() != num_trajectory) return false;
+
+    first = std::min(first, index.numRecords());
+    size_t last = first + std::min(count, index.numRecords() - first);
+    records.reserve(last - first);
+    for (size_t i = first; i < last; ++i) {
+        TrajRecord record;
+        uint64_t offset = index.recordOffset[i];
+        if (offset + sizeof(uint32_t) > size) return false;
+        google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+            reinterpret_cast<const uint8_t*>(data + offset), &record.length);
+        record.offset = offset + sizeof(uint32_t);
+        if (record.offset + record.length > size) return false;
+        records.push_back(record);
+    }
+    return true;
+}
+
+// Decode records [begin, end), dropping trajectories with less than 2 points.
+// first_record is the id of records[0] in the file.
+static bool decodeTrajectoryRecords(const char* data,
+                                    const vector<TrajRecord>& records,
+                                    size_t begin, size_t end,
+                                    size_t first_record,
+                                    TrajectoryColumns& columns) {
+    GpsTraj new_traj;
+    for (size_t id_traj = begin; id_traj < end; ++id_traj) {
+        new_traj.Clear();
+        if (!new_traj.ParsePartialFromArray(data + records[id_traj].offset,
+                                            records[id_traj].length)) {
+            fprintf(stderr,
+                    "ERROR: Protobuf trajectory file possibly contaminated!\n");
+            return false;
+        }
+
+        // Remove trajectory that has less than 2 points
+        if (new_traj.point_size() < 2) continue;
+
+        appendTrajectory(new_traj, 0, new_traj.point_size(), nullptr, nullptr,
+                         Eigen::Vector2d::Zero(), first_record + id_traj,
+                         columns);
+    }
+    return true;
+}
+
+// Select the UTM zone from the centroid of the decoded points (unless one is
+// already selected), place the dataset origin at the projected centroid, then
+// compute the fixed-point positions of every buffer
+static void projectColumns(vector<TrajectoryColumns>& buffers,
+                           Eigen::Vector2d& origin) {
+    Converter& latlon_converter = Converter::getInstance();
+    double sum_lat = 0.0, sum_lon = 0.0;
+    size_t n_pt = 0;
+    for (const auto& columns : buffers) {
+        int64_t buffer_lat = 0, buffer_lon = 0;
+        for (size_t i = 0; i < columns.size(); ++i) {
+            buffer_lat += columns.lat[i];
+            buffer_lon += columns.lon[i];
+        }
+        sum_lat += buffer_lat;
+        sum_lon += buffer_lon;
+        n_pt += columns.size();
+    }
+    if (n_pt == 0) return;
+
+    double center_lat = 1e-6 * sum_lat / n_pt;
+    double center_lon = 1e-6 * sum_lon / n_pt;
+    latlon_converter.selectUTMZone(center_lat, center_lon);
+    latlon_converter.convertLatLonToXY(1, &center_lat, &center_lon,
+                                       &origin[0], &origin[1]);
+    origin = Eigen::Vector2d(std::round(origin[0]), std::round(origin[1]));
+
+    parallelFor(buffers.size(), buffers.size(),
+                [&](size_t begin, size_t end, size_t /* thread_id */) {
+        vector<double> easting(PROJECTION_CHUNK_SIZE);
+        vector<double> northing(PROJECTION_CHUNK_SIZE);
+        for (size_t k = begin; k < end; ++k) {
+            TrajectoryColumns& columns = buffers[k];
+            columns.posX.resize(columns.size());
+            columns.posY.resize(columns.size());
+            for (size_t first = 0; first < columns.size();
+                 first += PROJECTION_CHUNK_SIZE) {
+                size_t count =
+                    std::min(PROJECTION_CHUNK_SIZE, columns.size() - first);
+                latlon_converter.convertLatLonToXY(
+                    count, columns.lat.data() + first,
+                    columns.lon.data() + first, easting.data(),
+                    northing.data());
+                for (size_t i = 0; i < count; ++i) {
+                    columns.posX[first + i] = toFixedPoint(easting[i], origin[0]);
+                    columns.posY[first + i] =
+                        toFixedPoint(northing[i], origin[1]);
+                }
+            }
+        }
+    });
+}
+
+// Copy a buffer column into a member column at offset, then free it
+template <typename T>
+static void moveColumn(vector<T>& column, vector<T>& member, size_t offset) {
+    std::copy(column.begin(), column.end(), member.begin() + offset);
+    vector<T>().swap(column);
+}
+
+// Concatenate column buffers, in order, into the (empty) member columns.
+// Positions must be relative to m_origin. Buffers are released as they are
+// copied, to bound the peak memory of loading.
+void Trajectories::mergeColumns(vector<TrajectoryColumns>& buffers) {
+    size_t num_buffers = buffers.size();
+    vector<size_t> point_offset(num_buffers + 1, 0);
+    vector<size_t> traj_offset(num_buffers + 1, 0);
+    for (size_t k = 0; k < num_buffers; ++k) {
+        point_offset[k + 1] = point_offset[k] + buffers[k].size();
+        traj_offset[k + 1] = traj_offset[k] + buffers[k].trajSize.size();
+    }
+    size_t n_pt = point_offset[num_buffers];
+    m_carIdx.resize(n_pt);
+    m_timestamp.owned().resize(n_pt);
+    if (!m_compactStorage) {
+        m_lon.owned().resize(n_pt);
+        m_lat.owned().resize(n_pt);
+    }
+    m_heading.resize(n_pt);
+    m_speed.resize(n_pt);
+    m_heavy.reserve(n_pt);
+    m_posX.resize(n_pt);
+    m_posY.resize(n_pt);
+
+    // Trajectories of the buffers are consecutive runs of points
+    vector<uint64_t> offsets(traj_offset[num_buffers] + 1, 0);
+    m_trajRecord.resize(traj_offset[num_buffers]);
+    for (size_t k = 0; k < num_buffers; ++k) {
+        const TrajectoryColumns& columns = buffers[k];
+        for (size_t j = 0; j < columns.trajSize.size(); ++j) {
+            size_t id_traj = traj_offset[k] + j;
+            offsets[id_traj + 1] = offsets[id_traj] + columns.trajSize[j];
+            m_trajRecord[id_traj] = columns.trajRecord[j];
+        }
+    }
+    m_indexedTraj.assign(offsets);
+
+    // vector<bool> packs bits, so it cannot be filled concurrently
+    for (size_t k = 0; k < num_buffers; ++k) {
+        m_heavy.insert(m_heavy.end(), buffers[k].heavy.begin(),
+                       buffers[k].heavy.end());
+        vector<bool>().swap(buffers[k].heavy);
+    }
+
+    parallelFor(num_buffers, numWorkerThreads(),
+                [&](size_t begin, size_t end, size_t /* thread_id */) {
+        for (size_t k = begin; k < end; ++k) {
+            TrajectoryColumns& columns = buffers[k];
+            size_t offset = point_offset[k];
+            moveColumn(columns.carIdx, m_carIdx, offset);
+            moveColumn(columns.timestamp, m_timestamp.owned(), offset);
+            if (!m_compactStorage) {
+                moveColumn(columns.lon, m_lon.owned(), offset);
+                moveColumn(columns.lat, m_lat.owned(), offset);
+            }
+            vector<int32_t>().swap(columns.lon);
+            vector<int32_t>().swap(columns.lat);
+            moveColumn(columns.heading, m_heading, offset);
+            moveColumn(columns.speed, m_speed, offset);
+            moveColumn(columns.posX, m_posX, offset);
+            moveColumn(columns.posY, m_posY, offset);
+        }
+    });
+}
+
 bool Trajectories::loadPBF(const string& filename) {
+    return loadRecords(filename, 0, numeric_limits<size_t>::max());
+}
+
+bool Trajectories::loadTrajectoryRange(const string& filename, size_t first,
+                                       size_t count) {
+    return loadRecords(filename, first, count);
+}
+
+bool Trajectories::loadRecords(const string& filename, size_t first,
+                               size_t count) {
     clear();
+    // Only a complete load matches the index file of the source
+    bool whole_file = first == 0 && count == numeric_limits<size_t>::max();
 
     GOOGLE_PROTOBUF_VERIFY_VERSION;
 
-    int fid = open(filename.c_str(), O_RDONLY);
-    if (fid == -1) {
+    MappedFile file;
+    if (!file.open(filename)) {
         fprintf(stderr, "ERROR! Cannot open trajectory file!%s\n",
                 filename.c_str());
         return false;
     }
 
-    google::protobuf::io::ZeroCopyInputStream* raw_input =
-        new google::protobuf::io::FileInputStream(fid);
-    google::protobuf::io::CodedInputStream* coded_input =
-        new google::protobuf::io::CodedInputStream(raw_input);
-    coded_input->SetTotalBytesLimit(1e9, 9e8);
-
-    uint32_t num_trajectory;
-    if (!coded_input->ReadLittleEndian32(&num_trajectory)) {
+    // Locate records through the index when the file has one, otherwise scan
+    // the record boundaries up to the requested range.
+    vector<TrajRecord> records;
+    vector<uint32_t> record_num_points;
+    TrajectoryFileIndex index;
+    bool truncated = false;
+    if (findTrajectoryRecords(file.data(), file.size(), index, first, count,
+                              records)) {
+        first = std::min(first, index.numRecords());
+        record_num_points.assign(index.recordNumPoints.begin() + first,
+                                 index.recordNumPoints.begin() + first +
+                                     records.size());
+    } else if (scanTrajectoryRecords(file.data(), file.size(), records,
+                                     truncated)) {
+        if (truncated) {
+            // Keep the trajectories read, like the extractors do, but do not
+            // save a cache or an index of the partial data
+            fprintf(stderr,
+                    "WARNING: %s is truncated, only its first %zu "
+                    "trajectories can be loaded.\n",
+                    filename.c_str(), records.size());
+            whole_file = false;
+        }
+        first = std::min(first, records.size());
+        records.erase(records.begin(), records.begin() + first);
+        if (count < records.size()) {
+            records.resize(count);
+        }
+    } else {
         printf(
             "Ooops, something bad happened when reading the trajectory "
             "file.\n");
         return false;
     }
 
-    if (num_trajectory > 1e9) {
-        printf(
-            "ERROR: more than 1e9 trajectories in the trajectory file? We "
-            "cannot handle that...\n");
+    if (records.empty()) {
+        printf("No trajectory to load from %s\n", filename.c_str());
         return false;
     }
 
-    printf("Start loading trajectories: %u trajectories detected...\n",
-           num_trajectory);
-
-    // Clear existing data
-    clock_t t_begin = clock();
-    Converter& latlon_converter = Converter::getInstance();
-    GpsPointType point;
-    // int32_t has min value of -2,147,483,647 to 2,147,483,647
-    vector<pair<size_t, uint32_t>> tmp_timestamp;
-    for (size_t id_traj = 0; id_traj < num_trajectory; ++id_traj) {
-        uint32_t msg_length;
-        if (!coded_input->ReadLittleEndian32(&msg_length)) {
-            break;  // end of the file
+    printf("Start loading trajectories: %zu trajectories detected...\n",
+           records.size());
+
+    HPTimer timer;  // wall clock, since decoding runs on all cores
+
+    // Split records into contiguous ranges of roughly equal byte size
+    size_t num_threads = numWorkerThreads();
+    size_t first_byte = records.front().offset;
+    size_t total_bytes = records.back().offset + records.back().length -
+                         first_byte;
+    vector<size_t> range_begin(num_threads + 1, records.size());
+    range_begin[0] = 0;
+    size_t t = 1;
+    for (size_t i = 0; i < records.size() && t < num_threads; ++i) {
+        if (records[i].offset - first_byte >=
+            t * total_bytes / num_threads) {
+            range_begin[t++] = i;
         }
-        auto limit = coded_input->PushLimit(msg_length);
-        GpsTraj new_traj;
-        if (!new_traj.MergePartialFromCodedStream(coded_input)) {
-            fprintf(stderr,
-                    "ERROR: Protobuf trajectory file possibly contaminated!\n");
-            return false;
-        }
-        coded_input->PopLimit(limit);
-
-        // Remove trajectory that has less than 2 points
-        if (new_traj.point_size() < 2) continue;
+    }
+    for (; t < num_threads; ++t) {
+        range_begin[t] = records.size();
+    }
 
-        // Process data
-        vector<size_t> a_traj;
-        for (size_t pt_idx = 0; pt_idx < new_traj.point_size(); ++pt_idx) {
-            m_carIdx.push_back(new_traj.point(pt_idx).car_id());
-            m_timestamp.push_back(new_traj.point(pt_idx).timestamp());
-            tmp_timestamp.push_back(pair<size_t, uint32_t>(
-                m_gpsPoints->size(), new_traj.point(pt_idx).timestamp()));
-            m_lon.push_back(new_traj.point(pt_idx).lon());
-            m_lat.push_back(new_traj.point(pt_idx).lat());
-
-            int new_traj_point_head = 450 - new_traj.point(pt_idx).head();
-            if (new_traj_point_head > 360) {
-                new_traj_point_head -= 360;
+    vector<TrajectoryColumns> buffers(num_threads);
+    vector<char> decoded(num_threads, 0);
+    parallelFor(num_threads, num_threads,
+                [&](size_t begin, size_t end, size_t /* thread_id */) {
+        for (size_t k = begin; k < end; ++k) {
+            if (!record_num_points.empty()) {
+                size_t n_pt = 0;
+                for (size_t i = range_begin[k]; i < range_begin[k + 1]; ++i) {
+                    n_pt += record_num_points[i];
+                }
+                buffers[k].reserve(n_pt, range_begin[k + 1] - range_begin[k]);
             }
-            m_heading.push_back(new_traj_point_head);
-            m_speed.push_back(new_traj.point(pt_idx).speed());
-            m_heavy.push_back(new_traj.point(pt_idx).heavy());
-
-            // Derived data
-            a_traj.push_back(m_gpsPoints->size());
-            m_trajIdx.push_back(id_traj);
-            m_sampleIdxInTraj.push_back(pt_idx);
-
-            // Compute easting and northing
-            float easting, northing;
-            double lat =
-                static_cast<double>(new_traj.point(pt_idx).lat()) / 1.0e6;
-            double lon =
-                static_cast<double>(new_traj.point(pt_idx).lon()) / 1.0e6;
-            latlon_converter.convertLatLonToXY(lat, lon, easting, northing);
-
-            m_easting.push_back(easting);
-            m_northing.push_back(northing);
-
-            // Store point
-            point.setCoordinate(easting, northing, 0.0f);
-            m_gpsPoints->push_back(point);
+            decoded[k] = decodeTrajectoryRecords(
+                file.data(), records, range_begin[k], range_begin[k + 1],
+                first, buffers[k]);
         }
-        m_indexedTraj.push_back(a_traj);
+    });
+    for (size_t k = 0; k < num_threads; ++k) {
+        if (!decoded[k]) return false;
     }
+    projectColumns(buffers, m_origin);
 
-    delete coded_input;
-    delete raw_input;
-    close(fid);
+    // Concatenate per-thread buffers in record order
+    mergeColumns(buffers);
+    buffers.clear();
+    file.close();
 
-    // Sort timestamp
-    printf("\tsorting points by timestamp ...");
-    std::sort(tmp_timestamp.begin(), tmp_timestamp.end(),
-              [](const pair<size_t, uint32_t>& a,
-                 const pair<size_t, uint32_t>& b) -> bool {
-                  return a.second < b.second;
-              });
+    if (m_indexedTraj.empty()) {
+        printf("No trajectory with at least 2 points in %s\n",
+               filename.c_str());
+        return false;
+    }
+
+    sortPointsByTimestamp();
+
+    double elapsed_secs = timer.time() / 1000.0;
+
+    computeBoundBox();
+    if (whole_file) {
+        m_sourceFilename = filename;
+    }
+    buildSearchIndex();
+
+    printf("Loading complete. Time elapsed: %.1f sec\n", elapsed_secs);
+    printSummary();
+
+    return true;
+}
 
-    m_sortedPointIdx.resize(tmp_timestamp.size(), 0);
-    for (size_t i = 0; i < tmp_timestamp.size(); ++i) {
-        m_sortedPointIdx[i] = tmp_timestamp[i].first;
+void Trajectories::sortPointsByTimestamp() {
+    size_t n_pt = m_timestamp.size();
+    if (n_pt > numeric_limits<uint32_t>::max()) {
+        fprintf(stderr,
+                "ERROR: more than 2^32 points, cannot index them by "
+                "timestamp.\n");
+        m_sortedPointIdx.clear();
+        return;
     }
 
-    m_minTimestamp = tmp_timestamp.front().second;
-    m_maxTimestamp = tmp_timestamp.back().second;
+    // Sort timestamp
+    printf("\tsorting points by timestamp ...");
+    sortIndicesByKey(m_timestamp.data(), n_pt, m_sortedPointIdx.owned());
+
+    m_minTimestamp = m_timestamp[m_sortedPointIdx.front()];
+    m_maxTimestamp = m_timestamp[m_sortedPointIdx.back()];
     cout << "min timestamp " << m_minTimestamp << endl;
     cout << "max timestamp " << m_maxTimestamp << endl;
     printf("... Done.\n");
+}
 
-    clock_t t_end = clock();
-    double elapsed_secs = double(t_end - t_begin) / CLOCKS_PER_SEC;
-
-    GpsPointType min_pt, max_pt;
-    pcl::getMinMax3D(*m_gpsPoints, min_pt, max_pt);
+void Trajectories::computeBoundBox() {
+    if (m_posX.empty()) return;
 
-    m_boundBox[0] = min_pt.x;
-    m_boundBox[1] = max_pt.x;
-    m_boundBox[2] = min_pt.y;
-    m_boundBox[3] = max_pt.y;
+    auto x_range = std::minmax_element(m_posX.begin(), m_posX.end());
+    auto y_range = std::minmax_element(m_posY.begin(), m_posY.end());
+    m_boundBox[0] = m_origin[0] + *x_range.first * POSITION_RESOLUTION;
+    m_boundBox[1] = m_origin[0] + *x_range.second * POSITION_RESOLUTION;
+    m_boundBox[2] = m_origin[1] + *y_range.first * POSITION_RESOLUTION;
+    m_boundBox[3] = m_origin[1] + *y_range.second * POSITION_RESOLUTION;
+}
 
+void Trajectories::buildSearchIndex() {
     // Update Scene Bounding Box
-    updateBBOX(min_pt.x, max_pt.x, min_pt.y, max_pt.y);
+    updateBBOX(m_boundBox[0], m_boundBox[1], m_boundBox[2], m_boundBox[3]);
     printf("traj updated bbox: %.2f, %.2f, %.2f, %.2f\n", m_boundBox[0],
            m_boundBox[1], m_boundBox[2], m_boundBox[3]);
 
-    m_searchTree->setInputCloud(m_gpsPoints);
+    // The tree reads the fixed-point columns in place
+    PointSpans<int32_t> points = positionSpans();
+
+    // Reuse the index saved next to the source file while it is up to date.
+    // The positions only depend on the source, the origin and the UTM zone,
+    // the index also on its build parameters.
+    FileFingerprint source;
+    bool persistent = !m_sourceFilename.empty() &&
+                      FileFingerprint::get(m_sourceFilename, source);
+    string index_filename = m_sourceFilename + ".index";
+    IndexFileKey key;
+    if (persistent) {
+        Converter& latlon_converter = Converter::getInstance();
+        key.setSource(source);
+        key.params[0] = m_origin[0];
+        key.params[1] = m_origin[1];
+        key.params[2] = POSITION_RESOLUTION;
+        key.params[3] = latlon_converter.utmZone();
+        key.params[4] = latlon_converter.isSouth() ? 1.0 : 0.0;
+        // Build parameters of the backends (the backend is the key type)
+        key.params[5] = m_searchTree.kdTree().params().leafSize;
+        key.params[6] = m_searchTree.grid().params().cellSize;
+        if (m_searchTree.load(index_filename, points, key)) {
+            printf("Search index loaded from %s\n", index_filename.c_str());
+            return;
+        }
+    }
 
-    printf("Loading complete. Time elapsed: %.1f sec\n", elapsed_secs);
+    m_searchTree.build(points);
+    if (persistent) {
+        m_searchTree.save(index_filename, key);
+    }
+}
+
+const SpatioTemporalIndex& Trajectories::spatioTemporalIndex() const {
+    if (!m_spatioTemporalIndexBuilt.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(m_lazyIndexMutex);
+        if (!m_spatioTemporalIndexBuilt.load(std::memory_order_relaxed)) {
+            m_spatioTemporalIndex.build(positionSpans(), m_timestamp.data(),
+                                        &m_indexedTraj);
+            m_spatioTemporalIndexBuilt.store(true, std::memory_order_release);
+        }
+    }
+    return m_spatioTemporalIndex;
+}
+
+void Trajectories::setSpatioTemporalParams(
+    const SpatioTemporalParams& params) {
+    m_spatioTemporalIndex.clear();
+    m_spatioTemporalIndex.setParams(params);
+    m_spatioTemporalIndexBuilt = false;
+}
+
+const TrajectoryRTree& Trajectories::trajectoryTree() const {
+    if (!m_trajectoryTreeBuilt.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(m_lazyIndexMutex);
+        if (!m_trajectoryTreeBuilt.load(std::memory_order_relaxed)) {
+            m_trajectoryTree.build(positionSpans(), &m_indexedTraj);
+            m_trajectoryTreeBuilt.store(true, std::memory_order_release);
+        }
+    }
+    return m_trajectoryTree;
+}
+
+void Trajectories::radiusSearchBatch(const PointSpans<double>& queries,
+                                     double radius, Neighborhoods& result,
+                                     size_t max_nn) const {
+    ::radiusSearchBatch(m_searchTree, queries, radius, result, max_nn);
+}
+
+void Trajectories::nearestKSearchBatch(const PointSpans<double>& queries,
+                                       size_t k, Neighborhoods& result) const {
+    ::nearestKSearchBatch(m_searchTree, queries, k, result);
+}
+
+void Trajectories::radiusSearchAllPoints(double radius, Neighborhoods& result,
+                                         size_t max_nn) const {
+    ::radiusSearchBatch(m_searchTree, positionSpans(), radius, result, max_nn);
+}
+
+void Trajectories::nearestKSearchAllPoints(size_t k,
+                                           Neighborhoods& result) const {
+    ::nearestKSearchBatch(m_searchTree, positionSpans(), k, result);
+}
+
+void Trajectories::printSummary() {
     printf("\t%zu trajectories\t%zu points\n", m_indexedTraj.size(),
-           m_gpsPoints->size());
+           m_posX.size());
 
     time_t start_date = static_cast<time_t>(m_minTimestamp);
     time_t end_date = static_cast<time_t>(m_maxTimestamp);
     printf("\tFrom: %s", ctime(&start_date));
     printf("\tTo:   %s", ctime(&end_date));
+}
+
+/*=====================================================================================
+        Columnar Cache
+
+        Binary file stored next to the .pbf (<filename>.cache). Layout:
+            TrajCacheHeader
+            column 0 ... column NUM_CACHE_COLUMNS - 1 (each 64-byte aligned)
+        The cache is only used when the size / mtime of the source file match
+        the ones recorded in the header. The timestamp, lat / lon and sorted
+        index columns are served in place from the mapped file, the columns
+        the class writes to are copied.
+=====================================================================================*/
+static const char TRAJ_CACHE_MAGIC[8] = {'T', 'R', 'J', 'C', 'A', 'C', 'H', 'E'};
+static const uint32_t TRAJ_CACHE_VERSION = 6;
+static const size_t TRAJ_CACHE_ALIGNMENT = 64;
+
+enum TrajCacheColumn {
+    CACHE_CAR_IDX = 0,
+    CACHE_TIMESTAMP,
+    CACHE_LON,
+    CACHE_LAT,
+    CACHE_HEADING,
+    CACHE_SPEED,
+    CACHE_HEAVY,  // bit-packed, 8 points per byte
+    CACHE_POS_X,
+    CACHE_POS_Y,
+    CACHE_TRAJ_OFFSET,  // numTrajectories + 1 offsets into the point columns
+    CACHE_TRAJ_RECORD,  // record id of each trajectory in the source file
+    CACHE_SORTED_IDX,
+    NUM_CACHE_COLUMNS
+};
+
+struct TrajCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numColumns;
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t numPoints;
+    uint64_t numTrajectories;
+    uint32_t minTimestamp;
+    uint32_t maxTimestamp;
+    int32_t utmZone;  // projection of the position columns
+    uint32_t utmSouth;
+    double origin[2];
+    uint32_t hasLatLon;  // 0 if saved in compact storage mode
+    float boundBox[4];
+    uint64_t columnOffset[NUM_CACHE_COLUMNS];
+    uint64_t columnBytes[NUM_CACHE_COLUMNS];
+};
+
+template <typename T>
+static bool writeCacheColumn(FILE* fp, const T* data, size_t n,
+                             TrajCacheColumn column, TrajCacheHeader& header) {
+    static const char padding[TRAJ_CACHE_ALIGNMENT] = {0};
+    long pos = ftell(fp);
+    if (pos < 0) return false;
+    size_t pad = (TRAJ_CACHE_ALIGNMENT - pos % TRAJ_CACHE_ALIGNMENT) %
+                 TRAJ_CACHE_ALIGNMENT;
+    if (pad > 0 && fwrite(padding, 1, pad, fp) != pad) return false;
+
+    header.columnOffset[column] = pos + pad;
+    header.columnBytes[column] = n * sizeof(T);
+    if (n > 0 && fwrite(data, sizeof(T), n, fp) != n) return false;
+    return true;
+}
 
+// Column of n values inside the mapped cache, or nullptr if it does not fit
+// the file
+template <typename T>
+static const T* cacheColumn(const MappedFile& file,
+                            const TrajCacheHeader& header,
+                            TrajCacheColumn column, size_t n) {
+    uint64_t offset = header.columnOffset[column];
+    uint64_t bytes = header.columnBytes[column];
+    if (bytes != n * sizeof(T) || offset % alignof(T) != 0 ||
+        offset > file.size() || bytes > file.size() - offset) {
+        return nullptr;
+    }
+    return reinterpret_cast<const T*>(file.data() + offset);
+}
+
+// Copy a column out of the mapping, for the columns the class writes to
+template <typename T>
+static bool readCacheColumn(const MappedFile& file,
+                            const TrajCacheHeader& header,
+                            TrajCacheColumn column, size_t n, vector<T>& out) {
+    const T* begin = cacheColumn<T>(file, header, column, n);
+    if (!begin) return false;
+    out.assign(begin, begin + n);
     return true;
 }
 
-bool Trajectories::savePBF(const string& filename) {
-    GOOGLE_PROTOBUF_VERIFY_VERSION;
+// Serve a read-only column in place from the mapping
+template <typename T>
+static bool mapCacheColumn(const shared_ptr<MappedFile>& file,
+                           const TrajCacheHeader& header,
+                           TrajCacheColumn column, size_t n,
+                           MappedColumn<T>& out) {
+    const T* begin = cacheColumn<T>(*file, header, column, n);
+    if (!begin) return false;
+    out.map(file, begin, n);
+    return true;
+}
+
+static void packBits(const vector<bool>& bits, vector<uint8_t>& bytes) {
+    bytes.assign((bits.size() + 7) / 8, 0);
+    for (size_t i = 0; i < bits.size(); ++i) {
+        if (bits[i]) bytes[i / 8] |= 1 << (i % 8);
+    }
+}
 
-    // Read the trajectory collection from file.
-    int fid = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+static void unpackBits(const vector<uint8_t>& bytes, size_t n,
+                       vector<bool>& bits) {
+    bits.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        bits[i] = (bytes[i / 8] >> (i % 8)) & 1;
+    }
+}
 
-    if (fid == -1) {
-        fprintf(stderr, "ERROR! Cannot create protobuf trajectory file!\n");
+bool Trajectories::loadCache(const string& cache_filename,
+                             const string& source_filename) {
+    FileFingerprint source;
+    if (!FileFingerprint::get(source_filename, source)) {
         return false;
     }
 
-    google::protobuf::io::ZeroCopyOutputStream* raw_output =
-        new google::protobuf::io::FileOutputStream(fid);
-    google::protobuf::io::CodedOutputStream* coded_output =
-        new google::protobuf::io::CodedOutputStream(raw_output);
+    // The read-only columns keep the mapping open
+    shared_ptr<MappedFile> mapping(new MappedFile);
+    if (!mapping->open(cache_filename)) {
+        return false;
+    }
+    const MappedFile& file = *mapping;
 
-    uint32_t num_trajectory = m_indexedTraj.size();
+    TrajCacheHeader header;
+    if (file.size() < sizeof(TrajCacheHeader)) {
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(TrajCacheHeader));
+    if (memcmp(header.magic, TRAJ_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRAJ_CACHE_VERSION ||
+        header.numColumns != NUM_CACHE_COLUMNS || header.utmZone < 1 ||
+        header.utmZone > 60) {
+        return false;
+    }
+    if (header.sourceSize != source.size ||
+        header.sourceMtime != source.mtime) {
+        printf("Trajectory cache %s is outdated, reloading from source.\n",
+               cache_filename.c_str());
+        return false;
+    }
 
-    coded_output->WriteLittleEndian32(num_trajectory);
+    // The cached positions are only valid in the zone they were projected to
+    Converter& latlon_converter = Converter::getInstance();
+    if (latlon_converter.hasUTMZone() &&
+        (latlon_converter.utmZone() != header.utmZone ||
+         latlon_converter.isSouth() != (header.utmSouth != 0))) {
+        printf(
+            "Trajectory cache %s is in another UTM zone, reloading from "
+            "source.\n",
+            cache_filename.c_str());
+        return false;
+    }
+    if (header.hasLatLon == 0 && !m_compactStorage) {
+        printf(
+            "Trajectory cache %s has no lat / lon columns, reloading from "
+            "source.\n",
+            cache_filename.c_str());
+        return false;
+    }
 
+    clear();
+    HPTimer timer;
+
+    size_t n_pt = header.numPoints;
+    size_t n_traj = header.numTrajectories;
+    vector<uint8_t> heavy;
+    vector<uint64_t> traj_offsets;
+    bool read_latlon = !m_compactStorage;
+    bool success =
+        readCacheColumn(file, header, CACHE_CAR_IDX, n_pt, m_carIdx) &&
+        mapCacheColumn(mapping, header, CACHE_TIMESTAMP, n_pt, m_timestamp) &&
+        (!read_latlon ||
+         (mapCacheColumn(mapping, header, CACHE_LON, n_pt, m_lon) &&
+          mapCacheColumn(mapping, header, CACHE_LAT, n_pt, m_lat))) &&
+        readCacheColumn(file, header, CACHE_HEADING, n_pt, m_heading) &&
+        readCacheColumn(file, header, CACHE_SPEED, n_pt, m_speed) &&
+        readCacheColumn(file, header, CACHE_HEAVY, (n_pt + 7) / 8, heavy) &&
+        readCacheColumn(file, header, CACHE_POS_X, n_pt, m_posX) &&
+        readCacheColumn(file, header, CACHE_POS_Y, n_pt, m_posY) &&
+        readCacheColumn(file, header, CACHE_TRAJ_OFFSET, n_traj + 1,
+                        traj_offsets) &&
+        readCacheColumn(file, header, CACHE_TRAJ_RECORD, n_traj,
+                        m_trajRecord) &&
+        mapCacheColumn(mapping, header, CACHE_SORTED_IDX, n_pt,
+                       m_sortedPointIdx);
+    // The offsets and the sorted ids index the point columns
+    success = success && traj_offsets.front() == 0 &&
+              traj_offsets.back() == n_pt;
+    for (size_t i = 0; i < n_traj && success; ++i) {
+        success = traj_offsets[i] <= traj_offsets[i + 1];
+    }
+    for (size_t i = 0; i < n_pt && success; ++i) {
+        success = m_sortedPointIdx[i] < n_pt;
+    }
+    if (!success) {
+        fprintf(stderr, "ERROR: trajectory cache %s is corrupted.\n",
+                cache_filename.c_str());
+        clear();
+        return false;
+    }
+
+    unpackBits(heavy, n_pt, m_heavy);
+    m_origin = Eigen::Vector2d(header.origin[0], header.origin[1]);
+
+    m_indexedTraj.assign(traj_offsets);
+
+    m_minTimestamp = header.minTimestamp;
+    m_maxTimestamp = header.maxTimestamp;
+    for (int i = 0; i < 4; ++i) {
+        m_boundBox[i] = header.boundBox[i];
+    }
+    if (!latlon_converter.hasUTMZone()) {
+        latlon_converter.setUTMZone(header.utmZone, header.utmSouth != 0);
+    }
+
+    printf("Loading trajectories from cache %s\n", cache_filename.c_str());
+    m_sourceFilename = source_filename;
+    buildSearchIndex();
+
+    double elapsed_secs = timer.time() / 1000.0;
+    printf("Loading complete. Time elapsed: %.1f sec\n", elapsed_secs);
+    printSummary();
+
+    return true;
+}
+
+bool Trajectories::saveCache(const string& cache_filename,
+                             const string& source_filename) {
+    FileFingerprint source;
+    if (!FileFingerprint::get(source_filename, source)) {
+        return false;
+    }
+
+    // The cache stores trajectories as contiguous runs of points
+    size_t n_pt = m_posX.size();
+    const vector<uint64_t>& traj_offsets = m_indexedTraj.offsets();
+    if (m_indexedTraj.hasPermutation() || traj_offsets.back() != n_pt) {
+        return false;
+    }
+
+    vector<uint8_t> heavy;
+    packBits(m_heavy, heavy);
+
+    TrajCacheHeader header;
+    memset(&header, 0, sizeof(TrajCacheHeader));
+    memcpy(header.magic, TRAJ_CACHE_MAGIC, sizeof(header.magic));
+    header.version = TRAJ_CACHE_VERSION;
+    header.numColumns = NUM_CACHE_COLUMNS;
+    header.sourceSize = source.size;
+    header.sourceMtime = source.mtime;
+    header.numPoints = n_pt;
+    header.numTrajectories = m_indexedTraj.size();
+    header.minTimestamp = m_minTimestamp;
+    header.maxTimestamp = m_maxTimestamp;
+    header.utmZone = Converter::getInstance().utmZone();
+    header.utmSouth = Converter::getInstance().isSouth() ? 1 : 0;
+    header.origin[0] = m_origin[0];
+    header.origin[1] = m_origin[1];
+    header.hasLatLon = m_lon.size() == n_pt ? 1 : 0;
+    for (int i = 0; i < 4; ++i) {
+        header.boundBox[i] = m_boundBox[i];
+    }
+
+    string tmp_filename = cache_filename + ".tmp";
+    FILE* fp = fopen(tmp_filename.c_str(), "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "WARNING: cannot create trajectory cache %s\n",
+                cache_filename.c_str());
+        return false;
+    }
+
+    bool success =
+        fwrite(&header, sizeof(TrajCacheHeader), 1, fp) == 1 &&
+        writeCacheColumn(fp, m_carIdx.data(), n_pt, CACHE_CAR_IDX, header) &&
+        writeCacheColumn(fp, m_timestamp.data(), n_pt, CACHE_TIMESTAMP,
+                         header) &&
+        writeCacheColumn(fp, m_lon.data(), m_lon.size(), CACHE_LON, header) &&
+        writeCacheColumn(fp, m_lat.data(), m_lat.size(), CACHE_LAT, header) &&
+        writeCacheColumn(fp, m_heading.data(), n_pt, CACHE_HEADING, header) &&
+        writeCacheColumn(fp, m_speed.data(), n_pt, CACHE_SPEED, header) &&
+        writeCacheColumn(fp, heavy.data(), heavy.size(), CACHE_HEAVY,
+                         header) &&
+        writeCacheColumn(fp, m_posX.data(), n_pt, CACHE_POS_X, header) &&
+        writeCacheColumn(fp, m_posY.data(), n_pt, CACHE_POS_Y, header) &&
+        writeCacheColumn(fp, traj_offsets.data(), traj_offsets.size(),
+                         CACHE_TRAJ_OFFSET, header) &&
+        writeCacheColumn(fp, m_trajRecord.data(), m_trajRecord.size(),
+                         CACHE_TRAJ_RECORD, header) &&
+        writeCacheColumn(fp, m_sortedPointIdx.data(), n_pt, CACHE_SORTED_IDX,
+                         header);
+
+    // Rewrite the header now that the column offsets are known
+    success = success && fseek(fp, 0, SEEK_SET) == 0 &&
+              fwrite(&header, sizeof(TrajCacheHeader), 1, fp) == 1;
+    success = (fclose(fp) == 0) && success;
+
+    if (!success || !commitTemporaryFile(tmp_filename, cache_filename)) {
+        fprintf(stderr, "WARNING: failed to write trajectory cache %s\n",
+                cache_filename.c_str());
+        remove(tmp_filename.c_str());
+        return false;
+    }
+
+    printf("Trajectory cache saved to %s\n", cache_filename.c_str());
+    return true;
+}
+/*=====================================================================================
+        End of Columnar Cache
+=====================================================================================*/
+
+bool Trajectories::savePBF(const string& filename) {
+    TrajectoryWriter writer;
+    if (!writer.open(filename)) {
+        return false;
+    }
+
+    // In compact storage mode, lat / lon are recovered from the positions and
+    // rounded to the 1e-6 degrees of the file
+    bool recover_latlon = m_lon.size() != m_timestamp.size();
+    vector<double> traj_easting, traj_northing, traj_lat, traj_lon;
+
+    size_t num_trajectory = m_indexedTraj.size();
     for (size_t id_traj = 0; id_traj < num_trajectory; ++id_traj) {
+        TrajectoryView traj = m_indexedTraj[id_traj];
+        if (recover_latlon) {
+            size_t n = traj.size();
+            traj_easting.resize(n);
+            traj_northing.resize(n);
+            traj_lat.resize(n);
+            traj_lon.resize(n);
+            for (size_t k = 0; k < n; ++k) {
+                traj_easting[k] = easting(traj[k]);
+                traj_northing[k] = northing(traj[k]);
+            }
+            Converter::getInstance().convertXYToLatLon(
+                n, traj_easting.data(), traj_northing.data(), traj_lat.data(),
+                traj_lon.data());
+        }
+
         GpsTraj new_traj;
-        for (size_t k = 0; k < m_indexedTraj[id_traj].size(); ++k) {
+        for (size_t k = 0; k < traj.size(); ++k) {
             TrajPoint* new_pt = new_traj.add_point();
 
-            size_t ptIdx = m_indexedTraj[id_traj][k];
-            size_t carIdx = m_carIdx[ptIdx];
+            size_t ptIdx = traj[k];
+            int32_t carIdx = m_carIdx[ptIdx];
             uint32_t timestamp = m_timestamp[ptIdx];
-            int32_t lon = m_lon[ptIdx];
-            int32_t lat = m_lat[ptIdx];
+            int32_t lon = recover_latlon
+                              ? static_cast<int32_t>(std::lround(traj_lon[k] * 1e6))
+                              : m_lon[ptIdx];
+            int32_t lat = recover_latlon
+                              ? static_cast<int32_t>(std::lround(traj_lat[k] * 1e6))
+                              : m_lat[ptIdx];
             int32_t heading = m_heading[ptIdx];
             int32_t speed = m_speed[ptIdx];
             bool heavy = m_heavy[ptIdx];
@@ -382,16 +1201,13 @@ bool Trajectories::savePBF(const string& filename) {
             new_pt->set_timestamp(timestamp);
             new_pt->set_heavy(heavy);
         }
-        string s;
-        new_traj.SerializeToString(&s);
-        coded_output->WriteLittleEndian32(s.size());
-        coded_output->WriteString(s);
+        if (!writer.write(new_traj)) {
+            return false;
+        }
     }
-    delete coded_output;
-    delete raw_output;
-    close(fid);
 
-    return true;
+    // Also appends the record index used by loadPBF / loadTrajectoryRange
+    return writer.close();
 }
 
 // Extract trajectories from multiple files
@@ -410,182 +1226,85 @@ bool Trajectories::extractFromMultipleFiles(const QStringList& filenames,
         return false;
     }
 
-    GpsPointType point;
-    vector<pair<size_t, uint32_t>> tmp_timestamp;
-    size_t id_traj = 0;
-    for (size_t i = 0; i < filenames.size(); ++i) {
-        string filename(filenames.at(i).toLocal8Bit().constData());
-        printf("\tExtracting trajectories from %s\n", filename.c_str());
-        Trajectories* new_trajectories = new Trajectories();
-        new_trajectories->load(filename);
-
-        // Iterate over the trajectories
-        for (size_t j = 0; j < new_trajectories->m_indexedTraj.size(); ++j) {
-            vector<size_t> traj = new_trajectories->m_indexedTraj[j];
-            bool recording = false;
-
-            // Traverse the trajectory and chop into segments
-            vector<size_t> candidate_traj;
-            for (size_t k = 0; k < traj.size(); ++k) {
-                size_t ptIdx = traj[k];
-                float easting = new_trajectories->m_easting[ptIdx];
-                float northing = new_trajectories->m_northing[ptIdx];
-                if (easting < boundbox[1] && easting > boundbox[0] &&
-                    northing < boundbox[3] && northing > boundbox[2]) {
-                    // Point is inside the query boundbox
-                    if (!recording) {
-                        recording = true;
-                        candidate_traj.clear();
-                        candidate_traj.push_back(ptIdx);
-                    } else {
-                        // Insert point
-                        candidate_traj.push_back(ptIdx);
-                    }
-                } else {
-                    // Point is outside the query boundbox
-                    if (recording) {
-                        recording = false;
-                        if (candidate_traj.size() > minNumPt) {
-                            // Insert the candidate trajectory
-                            vector<size_t> a_traj;
-                            for (size_t s = 0; s < candidate_traj.size(); ++s) {
-                                size_t ptIdx = candidate_traj[s];
-                                size_t carIdx =
-                                    new_trajectories->m_carIdx[ptIdx];
-                                uint32_t timestamp =
-                                    new_trajectories->m_timestamp[ptIdx];
-                                int32_t lon = new_trajectories->m_lon[ptIdx];
-                                int32_t lat = new_trajectories->m_lat[ptIdx];
-                                int32_t heading =
-                                    new_trajectories->m_heading[ptIdx];
-                                int32_t speed =
-                                    new_trajectories->m_speed[ptIdx];
-                                bool heavy = new_trajectories->m_heavy[ptIdx];
-                                float easting =
-                                    new_trajectories->m_easting[ptIdx];
-                                float northing =
-                                    new_trajectories->m_northing[ptIdx];
-
-                                m_carIdx.push_back(carIdx);
-                                m_timestamp.push_back(timestamp);
-                                tmp_timestamp.push_back(pair<size_t, uint32_t>(
-                                    m_gpsPoints->size(), timestamp));
-                                m_lon.push_back(lon);
-                                m_lat.push_back(lat);
-
-                                m_heading.push_back(heading);
-                                m_speed.push_back(speed);
-                                m_heavy.push_back(heavy);
-
-                                // Derived data
-                                a_traj.push_back(m_gpsPoints->size());
-                                m_trajIdx.push_back(id_traj);
-                                m_sampleIdxInTraj.push_back(s);
-
-                                m_easting.push_back(easting);
-                                m_northing.push_back(northing);
-
-                                // Store point
-                                point.setCoordinate(easting, northing, 0.0f);
-                                m_gpsPoints->push_back(point);
-                            }
-                            m_indexedTraj.push_back(a_traj);
-                            id_traj++;
-                            candidate_traj.clear();
-                        }
-                    }
-                }
-            }
+    vector<string> inputs;
+    for (int i = 0; i < filenames.size(); ++i) {
+        inputs.push_back(string(filenames.at(i).toLocal8Bit().constData()));
+    }
 
-            if (recording) {
-                if (candidate_traj.size() > minNumPt) {
-                    // Insert the candidate trajectory
-                    vector<size_t> a_traj;
-                    for (size_t s = 0; s < candidate_traj.size(); ++s) {
-                        size_t ptIdx = candidate_traj[s];
-                        size_t carIdx = new_trajectories->m_carIdx[ptIdx];
-                        uint32_t timestamp =
-                            new_trajectories->m_timestamp[ptIdx];
-                        int32_t lon = new_trajectories->m_lon[ptIdx];
-                        int32_t lat = new_trajectories->m_lat[ptIdx];
-                        int32_t heading = new_trajectories->m_heading[ptIdx];
-                        int32_t speed = new_trajectories->m_speed[ptIdx];
-                        bool heavy = new_trajectories->m_heavy[ptIdx];
-                        float easting = new_trajectories->m_easting[ptIdx];
-                        float northing = new_trajectories->m_northing[ptIdx];
-
-                        m_carIdx.push_back(carIdx);
-                        m_timestamp.push_back(timestamp);
-                        tmp_timestamp.push_back(pair<size_t, uint32_t>(
-                            m_gpsPoints->size(), timestamp));
-                        m_lon.push_back(lon);
-                        m_lat.push_back(lat);
-
-                        m_heading.push_back(heading);
-                        m_speed.push_back(speed);
-                        m_heavy.push_back(heavy);
-
-                        // Derived data
-                        a_traj.push_back(m_gpsPoints->size());
-                        m_trajIdx.push_back(id_traj);
-                        m_sampleIdxInTraj.push_back(s);
-
-                        m_easting.push_back(easting);
-                        m_northing.push_back(northing);
-
-                        // Store point
-                        point.setCoordinate(easting, northing, 0.0f);
-                        m_gpsPoints->push_back(point);
-                    }
-                    m_indexedTraj.push_back(a_traj);
-                    id_traj++;
-                    candidate_traj.clear();
+    // The bounding box is in projected coordinates: fix the zone up front.
+    // Positions are stored relative to the center of the bounding box.
+    selectUTMZoneFromFiles(inputs);
+    m_origin = Eigen::Vector2d(std::round(0.5 * (boundbox[0] + boundbox[1])),
+                               std::round(0.5 * (boundbox[2] + boundbox[3])));
+
+    // Stream every file on a pool of workers and keep only the clipped
+    // segments. Each file has its own buffer so that the merged result does
+    // not depend on scheduling.
+    vector<TrajectoryColumns> buffers(inputs.size());
+    std::atomic<size_t> next_file(0);
+    std::mutex print_mutex;
+    parallelFor(numWorkerThreads(), numWorkerThreads(),
+                [&](size_t, size_t, size_t) {
+        GpsTraj traj;
+        vector<int32_t> lat;
+        vector<int32_t> lon;
+        vector<double> easting;
+        vector<double> northing;
+        vector<pair<size_t, size_t>> segments;
+        size_t i;
+        while ((i = next_file++) < inputs.size()) {
+            {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                printf("\tExtracting trajectories from %s\n",
+                       inputs[i].c_str());
+            }
+            TrajectoryReader reader;
+            if (!reader.open(inputs[i])) continue;
+
+            while (reader.next(traj)) {
+                if (traj.point_size() < 2) continue;
+
+                projectTrajectory(traj, lat, lon, easting, northing);
+                clipTrajectoryToBoundBox(easting.data(), northing.data(),
+                                         easting.size(), boundbox, minNumPt,
+                                         segments);
+                for (const auto& range : segments) {
+                    appendTrajectory(traj, range.first, range.second,
+                                     easting.data(), northing.data(),
+                                     m_origin, 0, buffers[i]);
                 }
             }
+            if (reader.hasError()) {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                fprintf(stderr,
+                        "WARNING: %s is truncated or corrupted, only its "
+                        "first %zu trajectories were extracted.\n",
+                        inputs[i].c_str(), reader.position());
+            }
         }
+    });
 
-        delete new_trajectories;
-    }
-
-    // Sort timestamp
-    printf("\tsorting points by timestamp ...");
-    std::sort(tmp_timestamp.begin(), tmp_timestamp.end(),
-              [](const pair<size_t, uint32_t>& a,
-                 const pair<size_t, uint32_t>& b) -> bool {
-                  return a.second < b.second;
-              });
+    mergeColumns(buffers);
+    buffers.clear();
 
-    m_sortedPointIdx.resize(tmp_timestamp.size(), 0);
-    for (size_t i = 0; i < tmp_timestamp.size(); ++i) {
-        m_sortedPointIdx[i] = tmp_timestamp[i].first;
+    if (m_indexedTraj.empty()) {
+        printf("No trajectory inside the bounding box.\n");
+        return false;
     }
 
-    m_minTimestamp = tmp_timestamp.front().second;
-    m_maxTimestamp = tmp_timestamp.back().second;
-    cout << "min timestamp " << m_minTimestamp << endl;
-    cout << "max timestamp " << m_maxTimestamp << endl;
-    printf("... Done.\n");
-
-    GpsPointType min_pt, max_pt;
-    pcl::getMinMax3D(*m_gpsPoints, min_pt, max_pt);
+    // Extracted segments are numbered sequentially
+    for (size_t id_traj = 0; id_traj < m_trajRecord.size(); ++id_traj) {
+        m_trajRecord[id_traj] = id_traj;
+    }
 
-    m_boundBox[0] = min_pt.x;
-    m_boundBox[1] = max_pt.x;
-    m_boundBox[2] = min_pt.y;
-    m_boundBox[3] = max_pt.y;
+    sortPointsByTimestamp();
+    computeBoundBox();
 
     // Update Scene Bounding Box
     resetBBOX();
-    updateBBOX(min_pt.x, max_pt.x, min_pt.y, max_pt.y);
-    printf("Totally %lu trajectories, %lu points.\n", m_indexedTraj.size(),
-           m_gpsPoints->size());
-
-    m_searchTree->setInputCloud(m_gpsPoints);
+    buildSearchIndex();
 
-    time_t start_date = static_cast<time_t>(m_minTimestamp);
-    time_t end_date = static_cast<time_t>(m_maxTimestamp);
-    printf("\tFrom: %s", ctime(&start_date));
-    printf("\tTo:   %s", ctime(&end_date));
+    printSummary();
 
     return true;
 }
@@ -10,14 +10,20 @@
 
 #include "headers.h"
 
-#include <pcl/common/common.h>
-#include <pcl/search/search.h>
-
-#include "pcl_wrapper.h"
+#include <atomic>
+#include <mutex>
+
+#include "mapped_column.h"
+#include "neighborhoods.h"
+#include "point_index.h"
+#include "spatiotemporal_index.h"
+#include "trajectory_csr.h"
+#include "trajectory_rtree.h"
 #include <Eigen/Dense>
 
 class Shader;
 class RenderableObject;
+struct TrajectoryColumns;
 
 class Trajectories {
 public:
@@ -30,6 +36,11 @@ public:
     bool load(const string& filename);
     bool save(const string& filename);
 
+    // Load count trajectories starting from trajectory (record) first. Uses
+    // the record index of the file for random access when present.
+    bool loadTrajectoryRange(const string& filename, size_t first,
+                             size_t count);
+
     // Extract from files
     // boundbox: (min_easting, max_easting, min_northing, max_northing)
     bool extractFromMultipleFiles(const QStringList& filenames,
@@ -47,12 +58,49 @@ public:
 
     bool isEmpty();
 
+    // In compact storage mode the raw lon / lat columns are not kept: they
+    // are recovered from the fixed-point positions when saving. Takes effect
+    // at the next load.
+    void setCompactStorage(bool compact) { m_compactStorage = compact; }
+    bool compactStorage() const { return m_compactStorage; }
+
+    // Backend of m_searchTree, rebuilt if data is loaded
+    void setSearchBackend(SearchBackend backend);
+
+    // Position of point i in meters
+    double easting(size_t i) const {
+        return m_origin[0] + m_posX[i] * POSITION_RESOLUTION;
+    }
+    double northing(size_t i) const {
+        return m_origin[1] + m_posY[i] * POSITION_RESOLUTION;
+    }
+
+    // Neighborhoods of many query points (in meters) at once, on all cores,
+    // in CSR layout (see neighborhoods.h)
+    void radiusSearchBatch(const PointSpans<double>& queries, double radius,
+                           Neighborhoods& result, size_t max_nn = 0) const;
+    void nearestKSearchBatch(const PointSpans<double>& queries, size_t k,
+                             Neighborhoods& result) const;
+    // Same with every point as a query: each point is its own neighbor
+    void radiusSearchAllPoints(double radius, Neighborhoods& result,
+                               size_t max_nn = 0) const;
+    void nearestKSearchAllPoints(size_t k, Neighborhoods& result) const;
+
+    // Bounding box x time window queries and snapshots at a given time. The
+    // index is built on first use, so that loading does not pay for it.
+    const SpatioTemporalIndex& spatioTemporalIndex() const;
+    // Takes effect at the next spatioTemporalIndex()
+    void setSpatioTemporalParams(const SpatioTemporalParams& params);
+    // Trajectories crossing a region or close to a polyline. Also built on
+    // first use.
+    const TrajectoryRTree& trajectoryTree() const;
+
 public:
     // Data that can be accessible from outside
 
-    // Point cloud and search tree
-    pcl::PointCloud<GpsPointType>::Ptr m_gpsPoints;
-    pcl::search::Search<GpsPointType>::Ptr m_searchTree;
+    // Search index over the positions, queried in meters
+    typedef PointIndex<PointSpans<int32_t>> SearchTree;
+    SearchTree m_searchTree;
     Eigen::Vector4f m_boundBox;  // [minX, maxX, minY, maxY]
 
     // Two indexing scheme:
@@ -60,27 +108,67 @@ public:
     //  file.
     //  - Sorted indexing: according to sorting points by timestamp.
 
-    // Raw data
-    vector<size_t> m_carIdx;
-    vector<uint32_t> m_timestamp;
-    vector<int32_t> m_lon;
-    vector<int32_t> m_lat;
-    vector<int32_t> m_heading;  // in degrees
-    vector<int32_t> m_speed;    // in cm/s
-    vector<bool> m_heavy;
+    // Raw data. The read-only columns are served in place from the cache
+    // file when loaded from it.
+    vector<int32_t> m_carIdx;
+    MappedColumn<uint32_t> m_timestamp;
+    MappedColumn<int32_t> m_lon;  // empty in compact storage mode
+    MappedColumn<int32_t> m_lat;
+    vector<int16_t> m_heading;  // in degrees
+    vector<int16_t> m_speed;    // in cm/s, saturated to the int16 range
+    vector<bool> m_heavy;       // bit-packed
 
     // Derived data
-    vector<vector<size_t>> m_indexedTraj;
-    vector<size_t> m_trajIdx;
-    vector<size_t> m_sampleIdxInTraj;
-    vector<float> m_easting;
-    vector<float> m_northing;
+    TrajectoryCSR m_indexedTraj;  // point ids of each trajectory
+    vector<uint32_t> m_trajRecord;  // record id of each trajectory in the file
+
+    // Positions as fixed-point offsets from m_origin (easting, northing), in
+    // units of POSITION_RESOLUTION. Use easting(i) / northing(i) for meters.
+    static constexpr double POSITION_RESOLUTION = 0.01;  // meters
+    Eigen::Vector2d m_origin;
+    vector<int32_t> m_posX;
+    vector<int32_t> m_posY;
 
-    vector<size_t> m_sortedPointIdx;  // by timestamp
+    MappedColumn<uint32_t> m_sortedPointIdx;  // by timestamp
 
 private:
     bool loadPBF(const string& filename);
     bool savePBF(const string& filename);
+    bool loadRecords(const string& filename, size_t first, size_t count);
+
+    // Columnar binary cache of the loaded data, stored next to the .pbf
+    bool loadCache(const string& cache_filename,
+                   const string& source_filename);
+    bool saveCache(const string& cache_filename,
+                   const string& source_filename);
+
+    // Concatenate per-thread column buffers into the member columns
+    void mergeColumns(vector<TrajectoryColumns>& buffers);
+    void sortPointsByTimestamp();
+
+    // Update scene bounding box and build the search tree after loading.
+    // When the data is a complete load of m_sourceFilename, the tree is
+    // mapped from / saved to <m_sourceFilename>.index.
+    void computeBoundBox();
+    void buildSearchIndex();
+    // The positions as seen by m_searchTree
+    PointSpans<int32_t> positionSpans() const {
+        return PointSpans<int32_t>(m_posX.data(), m_posY.data(),
+                                   m_posX.size(), POSITION_RESOLUTION,
+                                   m_origin[0], m_origin[1]);
+    }
+    void printSummary();
+
+    // Built by spatioTemporalIndex() / trajectoryTree() on first use.
+    // m_lazyIndexMutex guards the builds, the flags publish them.
+    mutable SpatioTemporalIndex m_spatioTemporalIndex;
+    mutable std::atomic<bool> m_spatioTemporalIndexBuilt;
+    mutable TrajectoryRTree m_trajectoryTree;
+    mutable std::atomic<bool> m_trajectoryTreeBuilt;
+    mutable std::mutex m_lazyIndexMutex;
+
+    bool m_compactStorage;
+    string m_sourceFilename;  // file the data was loaded from, if complete
 
     // Indexed trajectories
     uint32_t m_minTimestamp;  // minimum timestamp
@@ -0,0 +1,194 @@
+/*=====================================================================================
+                                trajectory_csr.h
+
+    Description:  Trajectories as a compressed sparse row structure
+
+        The points of trajectory i occupy positions offsets[i] to
+        offsets[i + 1] - 1. Without a permutation, positions are point ids, so
+        every trajectory is a contiguous run of the point columns (the layout
+        produced by the loaders). With a permutation, position p holds point
+        permutation[p].
+=====================================================================================*/
+
+#ifndef TRAJECTORY_CSR_H_
+#define TRAJECTORY_CSR_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+using namespace std;
+
+// Point ids of one trajectory, valid as long as the TrajectoryCSR is unchanged
+class TrajectoryView {
+public:
+    class const_iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef size_t value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const size_t* pointer;
+        typedef size_t reference;
+
+        const_iterator() : m_pos(0), m_permutation(nullptr) {}
+        const_iterator(size_t pos, const uint32_t* permutation)
+            : m_pos(pos), m_permutation(permutation) {}
+
+        size_t operator*() const {
+            return m_permutation ? m_permutation[m_pos] : m_pos;
+        }
+        size_t operator[](ptrdiff_t k) const { return *(*this + k); }
+
+        const_iterator& operator++() {
+            ++m_pos;
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator old = *this;
+            ++m_pos;
+            return old;
+        }
+        const_iterator& operator--() {
+            --m_pos;
+            return *this;
+        }
+        const_iterator operator--(int) {
+            const_iterator old = *this;
+            --m_pos;
+            return old;
+        }
+        const_iterator& operator+=(ptrdiff_t k) {
+            m_pos += k;
+            return *this;
+        }
+        const_iterator& operator-=(ptrdiff_t k) {
+            m_pos -= k;
+            return *this;
+        }
+        const_iterator operator+(ptrdiff_t k) const {
+            return const_iterator(m_pos + k, m_permutation);
+        }
+        const_iterator operator-(ptrdiff_t k) const {
+            return const_iterator(m_pos - k, m_permutation);
+        }
+        ptrdiff_t operator-(const const_iterator& other) const {
+            return static_cast<ptrdiff_t>(m_pos - other.m_pos);
+        }
+
+        bool operator==(const const_iterator& o) const {
+            return m_pos == o.m_pos;
+        }
+        bool operator!=(const const_iterator& o) const {
+            return m_pos != o.m_pos;
+        }
+        bool operator<(const const_iterator& o) const {
+            return m_pos < o.m_pos;
+        }
+        bool operator>(const const_iterator& o) const {
+            return m_pos > o.m_pos;
+        }
+        bool operator<=(const const_iterator& o) const {
+            return m_pos <= o.m_pos;
+        }
+        bool operator>=(const const_iterator& o) const {
+            return m_pos >= o.m_pos;
+        }
+
+    private:
+        size_t m_pos;
+        const uint32_t* m_permutation;
+    };
+
+    TrajectoryView() : m_begin(0), m_end(0), m_permutation(nullptr) {}
+    TrajectoryView(size_t begin, size_t end, const uint32_t* permutation)
+        : m_begin(begin), m_end(end), m_permutation(permutation) {}
+
+    size_t size() const { return m_end - m_begin; }
+    bool empty() const { return m_end == m_begin; }
+
+    // Point id of the k-th sample
+    size_t operator[](size_t k) const {
+        return m_permutation ? m_permutation[m_begin + k] : m_begin + k;
+    }
+    size_t front() const { return (*this)[0]; }
+    size_t back() const { return (*this)[size() - 1]; }
+
+    const_iterator begin() const {
+        return const_iterator(m_begin, m_permutation);
+    }
+    const_iterator end() const { return const_iterator(m_end, m_permutation); }
+
+    // True if the samples are the consecutive points front() .. back()
+    bool isContiguous() const { return m_permutation == nullptr; }
+
+private:
+    size_t m_begin;  // position range in the CSR structure
+    size_t m_end;
+    const uint32_t* m_permutation;
+};
+
+class TrajectoryCSR {
+public:
+    TrajectoryCSR() : m_offsets(1, 0) {}
+
+    void clear() {
+        m_offsets.assign(1, 0);
+        vector<uint32_t>().swap(m_permutation);
+        vector<uint32_t>().swap(m_position);
+    }
+
+    // Replace the structure. offsets has one more entry than trajectories,
+    // starts at 0 and ends at the number of points. permutation is either
+    // empty or a permutation of the point ids.
+    void assign(vector<uint64_t>& offsets, vector<uint32_t>& permutation) {
+        m_offsets.swap(offsets);
+        m_permutation.swap(permutation);
+        if (m_offsets.empty()) m_offsets.assign(1, 0);
+
+        m_position.assign(m_permutation.size(), 0);
+        for (size_t pos = 0; pos < m_permutation.size(); ++pos) {
+            m_position[m_permutation[pos]] = static_cast<uint32_t>(pos);
+        }
+    }
+    void assign(vector<uint64_t>& offsets) {
+        vector<uint32_t> identity;
+        assign(offsets, identity);
+    }
+
+    size_t size() const { return m_offsets.size() - 1; }
+    bool empty() const { return size() == 0; }
+    size_t numPoints() const { return m_offsets.back(); }
+
+    TrajectoryView operator[](size_t i) const {
+        return TrajectoryView(m_offsets[i], m_offsets[i + 1],
+                              m_permutation.empty() ? nullptr
+                                                    : m_permutation.data());
+    }
+
+    // Trajectory containing point pt_idx, and the index of the point in it
+    size_t trajectoryOf(size_t pt_idx) const {
+        return std::upper_bound(m_offsets.begin(), m_offsets.end(),
+                                positionOf(pt_idx)) -
+               m_offsets.begin() - 1;
+    }
+    size_t sampleIndexOf(size_t pt_idx) const {
+        return positionOf(pt_idx) - m_offsets[trajectoryOf(pt_idx)];
+    }
+
+    bool hasPermutation() const { return !m_permutation.empty(); }
+    const vector<uint64_t>& offsets() const { return m_offsets; }
+    const vector<uint32_t>& permutation() const { return m_permutation; }
+
+private:
+    size_t positionOf(size_t pt_idx) const {
+        return m_position.empty() ? pt_idx : m_position[pt_idx];
+    }
+
+    vector<uint64_t> m_offsets;
+    vector<uint32_t> m_permutation;  // CSR position -> point id, or empty
+    vector<uint32_t> m_position;     // inverse of m_permutation
+};
+
+#endif /* end of include guard: TRAJECTORY_CSR_H_ */
@@ -0,0 +1,445 @@
+#include "trajectory_reader.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+
+#include "latlon_converter.h"
+#include "mapped_file.h"
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+
+/*=====================================================================================
+        TrajectoryFileIndex
+=====================================================================================*/
+static const char TRAJ_INDEX_MAGIC[8] = {'T', 'R', 'J', 'I', 'N', 'D', 'E', 'X'};
+static const uint32_t TRAJ_INDEX_VERSION = 1;
+// version, num points, lon / lat range, time range, num records
+static const size_t TRAJ_INDEX_FIXED_SIZE = 4 + 8 + 4 * 4 + 2 * 4 + 8;
+static const size_t TRAJ_INDEX_RECORD_SIZE = 8 + 4;
+
+void TrajectoryFileIndex::clear() {
+    numPoints = 0;
+    minLon = minLat = numeric_limits<int32_t>::max();
+    maxLon = maxLat = numeric_limits<int32_t>::min();
+    minTimestamp = numeric_limits<uint32_t>::max();
+    maxTimestamp = 0;
+    recordOffset.clear();
+    recordNumPoints.clear();
+}
+
+void TrajectoryFileIndex::addRecord(uint64_t offset, const GpsTraj& traj) {
+    recordOffset.push_back(offset);
+    recordNumPoints.push_back(traj.point_size());
+    numPoints += traj.point_size();
+    for (int k = 0; k < traj.point_size(); ++k) {
+        const TrajPoint& pt = traj.point(k);
+        minLon = std::min(minLon, pt.lon());
+        maxLon = std::max(maxLon, pt.lon());
+        minLat = std::min(minLat, pt.lat());
+        maxLat = std::max(maxLat, pt.lat());
+        minTimestamp = std::min(minTimestamp, pt.timestamp());
+        maxTimestamp = std::max(maxTimestamp, pt.timestamp());
+    }
+}
+
+bool TrajectoryFileIndex::write(CodedOutputStream* output) const {
+    uint64_t payload_size =
+        TRAJ_INDEX_FIXED_SIZE + numRecords() * TRAJ_INDEX_RECORD_SIZE;
+
+    output->WriteLittleEndian32(TRAJ_INDEX_VERSION);
+    output->WriteLittleEndian64(numPoints);
+    output->WriteLittleEndian32(minLon);
+    output->WriteLittleEndian32(maxLon);
+    output->WriteLittleEndian32(minLat);
+    output->WriteLittleEndian32(maxLat);
+    output->WriteLittleEndian32(minTimestamp);
+    output->WriteLittleEndian32(maxTimestamp);
+    output->WriteLittleEndian64(numRecords());
+    for (size_t i = 0; i < numRecords(); ++i) {
+        output->WriteLittleEndian64(recordOffset[i]);
+    }
+    for (size_t i = 0; i < numRecords(); ++i) {
+        output->WriteLittleEndian32(recordNumPoints[i]);
+    }
+    output->WriteLittleEndian64(payload_size);
+    output->WriteRaw(TRAJ_INDEX_MAGIC, sizeof(TRAJ_INDEX_MAGIC));
+    return !output->HadError();
+}
+
+bool TrajectoryFileIndex::read(const char* data, size_t size) {
+    clear();
+
+    const size_t trailer_size = sizeof(uint64_t) + sizeof(TRAJ_INDEX_MAGIC);
+    if (size < trailer_size + TRAJ_INDEX_FIXED_SIZE ||
+        memcmp(data + size - sizeof(TRAJ_INDEX_MAGIC), TRAJ_INDEX_MAGIC,
+               sizeof(TRAJ_INDEX_MAGIC)) != 0) {
+        return false;
+    }
+
+    const uint8_t* end = reinterpret_cast<const uint8_t*>(data) + size;
+    uint64_t payload_size;
+    CodedInputStream::ReadLittleEndian64FromArray(end - trailer_size,
+                                                  &payload_size);
+    if (payload_size < TRAJ_INDEX_FIXED_SIZE ||
+        payload_size > size - trailer_size) {
+        return false;
+    }
+
+    const uint8_t* ptr = end - trailer_size - payload_size;
+    uint32_t version, value;
+    uint64_t num_records;
+    ptr = CodedInputStream::ReadLittleEndian32FromArray(ptr, &version);
+    if (version != TRAJ_INDEX_VERSION) {
+        return false;
+    }
+    ptr = CodedInputStream::ReadLittleEndian64FromArray(ptr, &numPoints);
+    ptr = CodedInputStream::ReadLittleEndian32FromArray(ptr, &value);
+    minLon = static_cast<int32_t>(value);
+    ptr = CodedInputStream::ReadLittleEndian32FromArray(ptr, &value);
+    maxLon = static_cast<int32_t>(value);
+    ptr = CodedInputStream::ReadLittleEndian32FromArray(ptr, &value);
+    minLat = static_cast<int32_t>(value);
+    ptr = CodedInputStream::ReadLittleEndian32FromArray(ptr, &value);
+    maxLat = static_cast<int32_t>(value);
+    ptr = CodedInputStream::ReadLittleEndian32FromArray(ptr, &minTimestamp);
+    ptr = CodedInputStream::ReadLittleEndian32FromArray(ptr, &maxTimestamp);
+    ptr = CodedInputStream::ReadLittleEndian64FromArray(ptr, &num_records);
+    if (payload_size !=
+        TRAJ_INDEX_FIXED_SIZE + num_records * TRAJ_INDEX_RECORD_SIZE) {
+        clear();
+        return false;
+    }
+
+    recordOffset.resize(num_records);
+    recordNumPoints.resize(num_records);
+    for (size_t i = 0; i < num_records; ++i) {
+        ptr = CodedInputStream::ReadLittleEndian64FromArray(ptr,
+                                                            &recordOffset[i]);
+    }
+    for (size_t i = 0; i < num_records; ++i) {
+        ptr = CodedInputStream::ReadLittleEndian32FromArray(
+            ptr, &recordNumPoints[i]);
+    }
+    return true;
+}
+
+/*=====================================================================================
+        TrajectoryReader
+=====================================================================================*/
+TrajectoryReader::TrajectoryReader()
+    : m_fid(-1), m_numTrajectories(0), m_position(0), m_error(false) {}
+
+TrajectoryReader::~TrajectoryReader() { close(); }
+
+bool TrajectoryReader::open(const string& filename) {
+    close();
+
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    m_fid = ::open(filename.c_str(), O_RDONLY);
+    if (m_fid == -1) {
+        fprintf(stderr, "ERROR! Cannot open trajectory file!%s\n",
+                filename.c_str());
+        return false;
+    }
+    m_rawInput.reset(new google::protobuf::io::FileInputStream(m_fid));
+
+    CodedInputStream coded_input(m_rawInput.get());
+    if (!coded_input.ReadLittleEndian32(&m_numTrajectories)) {
+        fprintf(stderr, "ERROR! Empty trajectory file %s\n",
+                filename.c_str());
+        close();
+        return false;
+    }
+    return true;
+}
+
+void TrajectoryReader::close() {
+    m_rawInput.reset();
+    if (m_fid != -1) {
+        ::close(m_fid);
+    }
+    m_fid = -1;
+    m_numTrajectories = 0;
+    m_position = 0;
+    m_error = false;
+}
+
+bool TrajectoryReader::next(GpsTraj& traj) {
+    if (!m_rawInput || m_error || m_position >= m_numTrajectories) {
+        return false;
+    }
+
+    // A fresh CodedInputStream per record keeps us clear of the total bytes
+    // limit of protobuf, so files of any size can be streamed.
+    CodedInputStream coded_input(m_rawInput.get());
+    uint32_t msg_length;
+    if (!coded_input.ReadLittleEndian32(&msg_length)) {
+        // The header announced more trajectories than the file holds
+        fprintf(stderr,
+                "ERROR: Protobuf trajectory file truncated after %zu of %u "
+                "trajectories!\n",
+                m_position, m_numTrajectories);
+        m_error = true;
+        return false;
+    }
+
+    auto limit = coded_input.PushLimit(msg_length);
+    traj.Clear();
+    if (!traj.MergePartialFromCodedStream(&coded_input) ||
+        !coded_input.ConsumedEntireMessage()) {
+        fprintf(stderr,
+                "ERROR: Protobuf trajectory file possibly contaminated!\n");
+        m_error = true;
+        return false;
+    }
+    coded_input.PopLimit(limit);
+
+    ++m_position;
+    return true;
+}
+
+size_t TrajectoryReader::nextBatch(vector<GpsTraj>& batch, size_t max_count) {
+    if (batch.size() < max_count) {
+        batch.resize(max_count);
+    }
+
+    size_t count = 0;
+    while (count < max_count && next(batch[count])) {
+        ++count;
+    }
+    batch.resize(count);
+    return count;
+}
+
+/*=====================================================================================
+        TrajectoryWriter
+=====================================================================================*/
+TrajectoryWriter::TrajectoryWriter() : m_fid(-1), m_error(false) {}
+
+TrajectoryWriter::~TrajectoryWriter() { close(); }
+
+bool TrajectoryWriter::open(const string& filename) {
+    close();
+
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    m_fid = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m_fid == -1) {
+        fprintf(stderr, "ERROR! Cannot create protobuf trajectory file!\n");
+        return false;
+    }
+    m_rawOutput.reset(new google::protobuf::io::FileOutputStream(m_fid));
+    m_index.clear();
+    m_error = false;
+
+    // Placeholder, patched by close()
+    CodedOutputStream coded_output(m_rawOutput.get());
+    coded_output.WriteLittleEndian32(0);
+    return true;
+}
+
+bool TrajectoryWriter::write(const GpsTraj& traj) {
+    if (!m_rawOutput || m_error) {
+        return false;
+    }
+
+    string s;
+    if (!traj.SerializeToString(&s)) {
+        m_error = true;
+        return false;
+    }
+
+    uint64_t offset = m_rawOutput->ByteCount();
+    {
+        CodedOutputStream coded_output(m_rawOutput.get());
+        coded_output.WriteLittleEndian32(s.size());
+        coded_output.WriteString(s);
+        if (coded_output.HadError()) {
+            m_error = true;
+            return false;
+        }
+    }
+
+    m_index.addRecord(offset, traj);
+    return true;
+}
+
+bool TrajectoryWriter::close() {
+    if (m_fid == -1) {
+        return false;
+    }
+
+    bool success = !m_error;
+    if (success) {
+        CodedOutputStream coded_output(m_rawOutput.get());
+        success = m_index.write(&coded_output);
+    }
+    success = success && m_rawOutput->Flush();
+    m_rawOutput.reset();
+
+    uint8_t count[sizeof(uint32_t)];
+    CodedOutputStream::WriteLittleEndian32ToArray(m_index.numRecords(), count);
+    success = success && pwrite(m_fid, count, sizeof(count), 0) ==
+                             static_cast<ssize_t>(sizeof(count));
+
+    ::close(m_fid);
+    m_fid = -1;
+    return success;
+}
+
+/*=====================================================================================
+        Streaming extraction
+=====================================================================================*/
+void clipTrajectoryToBoundBox(const double* easting, const double* northing,
+                              size_t n, const Eigen::Vector4f& boundbox,
+                              int minNumPt,
+                              vector<pair<size_t, size_t>>& segments) {
+    segments.clear();
+
+    size_t start = 0;
+    bool recording = false;
+    for (size_t k = 0; k <= n; ++k) {
+        bool inside = k < n && easting[k] < boundbox[1] &&
+                      easting[k] > boundbox[0] && northing[k] < boundbox[3] &&
+                      northing[k] > boundbox[2];
+        if (inside && !recording) {
+            recording = true;
+            start = k;
+        } else if (!inside && recording) {
+            recording = false;
+            if (k - start > static_cast<size_t>(minNumPt)) {
+                segments.push_back(pair<size_t, size_t>(start, k));
+            }
+        }
+    }
+}
+
+void selectUTMZoneFromFiles(const vector<string>& filenames) {
+    Converter& latlon_converter = Converter::getInstance();
+    GpsTraj traj;
+    for (size_t i = 0; i < filenames.size(); ++i) {
+        if (latlon_converter.hasUTMZone()) return;
+
+        // Center of the bounding box recorded in the index, if any
+        MappedFile file;
+        TrajectoryFileIndex index;
+        if (file.open(filenames[i]) && index.read(file.data(), file.size()) &&
+            index.numPoints > 0) {
+            latlon_converter.selectUTMZone(
+                0.5e-6 * (static_cast<double>(index.minLat) + index.maxLat),
+                0.5e-6 * (static_cast<double>(index.minLon) + index.maxLon));
+            return;
+        }
+
+        // Otherwise the centroid of the first trajectory
+        TrajectoryReader reader;
+        if (!reader.open(filenames[i])) continue;
+        while (reader.next(traj)) {
+            if (traj.point_size() == 0) continue;
+            double sum_lat = 0.0, sum_lon = 0.0;
+            for (int k = 0; k < traj.point_size(); ++k) {
+                sum_lat += traj.point(k).lat();
+                sum_lon += traj.point(k).lon();
+            }
+            latlon_converter.selectUTMZone(1e-6 * sum_lat / traj.point_size(),
+                                           1e-6 * sum_lon / traj.point_size());
+            return;
+        }
+    }
+}
+
+bool extractTrajectoriesToFile(const vector<string>& input_filenames,
+                               const string& output_filename,
+                               const Eigen::Vector4f& boundbox,
+                               int minNumPt) {
+    // Check bounding box
+    if (boundbox[1] < boundbox[0] || boundbox[3] < boundbox[2]) {
+        fprintf(stderr,
+                "extractTrajectoriesToFile: Bounding Box "
+                "ERROR.\n\t(min_easting = %.2f, max_easting = %.2f, "
+                "min_northing = %.2f, max_northing = %.2f)\n",
+                boundbox[0], boundbox[1], boundbox[2], boundbox[3]);
+        return false;
+    }
+
+    TrajectoryWriter writer;
+    if (!writer.open(output_filename)) {
+        return false;
+    }
+
+    selectUTMZoneFromFiles(input_filenames);
+    Converter& latlon_converter = Converter::getInstance();
+    GpsTraj traj;
+    GpsTraj segment;
+    vector<int32_t> lat;
+    vector<int32_t> lon;
+    vector<double> easting;
+    vector<double> northing;
+    vector<pair<size_t, size_t>> segments;
+    size_t n_points = 0;
+    for (size_t i = 0; i < input_filenames.size(); ++i) {
+        printf("\tExtracting trajectories from %s\n",
+               input_filenames[i].c_str());
+        TrajectoryReader reader;
+        if (!reader.open(input_filenames[i])) {
+            continue;
+        }
+
+        while (reader.next(traj)) {
+            // Drop trajectories with less than 2 points, as Trajectories does
+            if (traj.point_size() < 2) continue;
+
+            size_t n = traj.point_size();
+            lat.resize(n);
+            lon.resize(n);
+            easting.resize(n);
+            northing.resize(n);
+            for (size_t k = 0; k < n; ++k) {
+                lat[k] = traj.point(k).lat();
+                lon[k] = traj.point(k).lon();
+            }
+            latlon_converter.convertLatLonToXY(n, lat.data(), lon.data(),
+                                               easting.data(),
+                                               northing.data());
+
+            clipTrajectoryToBoundBox(easting.data(), northing.data(),
+                                     easting.size(), boundbox, minNumPt,
+                                     segments);
+            for (const auto& range : segments) {
+                segment.Clear();
+                for (size_t k = range.first; k < range.second; ++k) {
+                    *segment.add_point() = traj.point(k);
+                }
+                if (!writer.write(segment)) {
+                    writer.close();
+                    return false;
+                }
+                n_points += segment.point_size();
+            }
+        }
+        if (reader.hasError()) {
+            fprintf(stderr,
+                    "WARNING: %s is truncated or corrupted, only its first "
+                    "%zu trajectories were extracted.\n",
+                    input_filenames[i].c_str(), reader.position());
+        }
+    }
+
+    if (!writer.close()) {
+        fprintf(stderr, "ERROR! Failed to write %s\n",
+                output_filename.c_str());
+        return false;
+    }
+    printf("Totally %lu trajectories, %lu points written to %s.\n",
+           writer.numWritten(), n_points, output_filename.c_str());
+    return true;
+}
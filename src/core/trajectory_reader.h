@@ -0,0 +1,138 @@
+/*=====================================================================================
+                                trajectory_reader.h
+
+    Description:  Streaming access to protobuf trajectory files.
+
+        A trajectory file is a uint32 trajectory count followed by
+        [uint32 length][GpsTraj] records. TrajectoryReader decodes one record
+        (or a batch of them) at a time, so memory stays bounded regardless of
+        the file size. TrajectoryWriter produces files in the same format.
+=====================================================================================*/
+
+#ifndef TRAJECTORY_READER_H_
+#define TRAJECTORY_READER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "gps_trajectory.pb.h"
+
+namespace google {
+namespace protobuf {
+namespace io {
+class CodedOutputStream;
+class FileInputStream;
+class FileOutputStream;
+}
+}
+}
+
+using namespace std;
+
+// Optional index appended after the last record of a trajectory file:
+//      [index payload][uint64 payload size][8 byte magic "TRJINDEX"]
+// Readers that stop after the announced number of records never look at it.
+struct TrajectoryFileIndex {
+    uint64_t numPoints;
+    int32_t minLon, maxLon;  // 1e-6 degrees, as in TrajPoint
+    int32_t minLat, maxLat;
+    uint32_t minTimestamp, maxTimestamp;
+    vector<uint64_t> recordOffset;  // file offset of each [length][GpsTraj]
+    vector<uint32_t> recordNumPoints;
+
+    TrajectoryFileIndex() { clear(); }
+    void clear();
+
+    size_t numRecords() const { return recordOffset.size(); }
+    void addRecord(uint64_t offset, const GpsTraj& traj);
+
+    bool write(google::protobuf::io::CodedOutputStream* output) const;
+    // Parse the index at the end of a file in memory. Returns false if the
+    // file has no (valid) index.
+    bool read(const char* data, size_t size);
+};
+
+class TrajectoryReader {
+public:
+    TrajectoryReader();
+    ~TrajectoryReader();
+
+    bool open(const string& filename);
+    void close();
+
+    // Number of trajectories announced at the beginning of the file
+    uint32_t numTrajectories() const { return m_numTrajectories; }
+    // Record id of the next trajectory returned by next()
+    size_t position() const { return m_position; }
+    // True if the last read stopped because of a corrupted or truncated
+    // record
+    bool hasError() const { return m_error; }
+
+    // Decode the next trajectory. Returns false at the end of the file or on
+    // error (check hasError()).
+    bool next(GpsTraj& traj);
+
+    // Decode up to max_count trajectories into batch, reusing its messages.
+    // batch is resized to the number of trajectories read.
+    size_t nextBatch(vector<GpsTraj>& batch, size_t max_count);
+
+private:
+    TrajectoryReader(const TrajectoryReader&);
+    TrajectoryReader& operator=(const TrajectoryReader&);
+
+    int m_fid;
+    unique_ptr<google::protobuf::io::FileInputStream> m_rawInput;
+    uint32_t m_numTrajectories;
+    size_t m_position;
+    bool m_error;
+};
+
+class TrajectoryWriter {
+public:
+    TrajectoryWriter();
+    ~TrajectoryWriter();
+
+    bool open(const string& filename);
+    bool write(const GpsTraj& traj);
+    // Append the index, flush and patch the trajectory count at the beginning
+    // of the file
+    bool close();
+
+    size_t numWritten() const { return m_index.numRecords(); }
+
+private:
+    TrajectoryWriter(const TrajectoryWriter&);
+    TrajectoryWriter& operator=(const TrajectoryWriter&);
+
+    int m_fid;
+    unique_ptr<google::protobuf::io::FileOutputStream> m_rawOutput;
+    TrajectoryFileIndex m_index;
+    bool m_error;
+};
+
+// Chop a trajectory into the maximal runs of points strictly inside boundbox
+// (min_easting, max_easting, min_northing, max_northing). Only runs with more
+// than minNumPt points are returned, as [begin, end) sample ranges.
+void clipTrajectoryToBoundBox(const double* easting, const double* northing,
+                              size_t n, const Eigen::Vector4f& boundbox,
+                              int minNumPt,
+                              vector<pair<size_t, size_t>>& segments);
+
+// Select the UTM zone of the Converter from the first of filenames holding
+// data, unless a zone is already selected. Extraction bounding boxes are given
+// in projected coordinates, so the zone must be fixed before clipping.
+void selectUTMZoneFromFiles(const vector<string>& filenames);
+
+// Stream the trajectories of input_filenames, clip them to boundbox and write
+// the resulting segments to output_filename without loading the inputs.
+bool extractTrajectoriesToFile(const vector<string>& input_filenames,
+                               const string& output_filename,
+                               const Eigen::Vector4f& boundbox,
+                               int minNumPt = 3);
+
+#endif /* end of include guard: TRAJECTORY_READER_H_ */
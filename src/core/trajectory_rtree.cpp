@@ -0,0 +1,171 @@
+#include "trajectory_rtree.h"
+
+#include <algorithm>
+
+#include "parallel.h"
+
+// Sort and remove the duplicates of trajectory ids
+static size_t uniqueIds(vector<uint32_t>& ids) {
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return ids.size();
+}
+
+// Even-odd rule
+static bool insidePolygon(const PointSpans<double>& polygon, double x,
+                          double y) {
+    bool inside = false;
+    size_t n = polygon.size();
+    for (size_t i = 0, j = n - 1; i < n; j = i++) {
+        double xi = polygon.coord(i, 0), yi = polygon.coord(i, 1);
+        double xj = polygon.coord(j, 0), yj = polygon.coord(j, 1);
+        if ((yi > y) != (yj > y) &&
+            x < (xj - xi) * (y - yi) / (yj - yi) + xi) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+void TrajectoryRTree::clear() {
+    m_positions = PointSpans<int32_t>();
+    m_trajectories = nullptr;
+    m_tree.clear();
+    vector<uint32_t>().swap(m_pieceTraj);
+    vector<uint32_t>().swap(m_pieceFirst);
+}
+
+void TrajectoryRTree::build(const PointSpans<int32_t>& positions,
+                            const TrajectoryCSR* trajectories,
+                            size_t num_threads) {
+    clear();
+    if (!trajectories || trajectories->size() == 0) return;
+    m_positions = positions;
+    m_trajectories = trajectories;
+    if (num_threads == 0) num_threads = numWorkerThreads();
+
+    // Pieces of each trajectory
+    size_t n_traj = trajectories->size();
+    for (size_t i = 0; i < n_traj; ++i) {
+        size_t n_pt = (*trajectories)[i].size();
+        if (n_pt == 0) continue;
+        size_t n_segments = std::max<size_t>(n_pt - 1, 1);
+        for (size_t first = 0; first < n_segments;
+             first += SEGMENTS_PER_PIECE) {
+            m_pieceTraj.push_back(static_cast<uint32_t>(i));
+            m_pieceFirst.push_back(static_cast<uint32_t>(first));
+        }
+    }
+
+    size_t n_pieces = m_pieceTraj.size();
+    vector<RTreeBox> boxes(n_pieces);
+    parallelFor(n_pieces, num_threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t p = begin; p < end; ++p) {
+            TrajectoryView traj = (*trajectories)[m_pieceTraj[p]];
+            size_t last = std::min<size_t>(m_pieceFirst[p] + SEGMENTS_PER_PIECE,
+                                           traj.size() - 1);
+            for (size_t j = m_pieceFirst[p]; j <= last; ++j) {
+                boxes[p].expand(positions.coord(traj[j], 0),
+                                positions.coord(traj[j], 1));
+            }
+        }
+    });
+    m_tree.build(boxes, num_threads);
+}
+
+template <class SegmentTest>
+bool TrajectoryRTree::anySegment(uint32_t piece, SegmentTest test) const {
+    TrajectoryView traj = (*m_trajectories)[m_pieceTraj[piece]];
+    size_t first = m_pieceFirst[piece];
+    size_t last = std::min<size_t>(first + SEGMENTS_PER_PIECE, traj.size() - 1);
+    double x0 = m_positions.coord(traj[first], 0);
+    double y0 = m_positions.coord(traj[first], 1);
+    if (first == last) return test(x0, y0, x0, y0);
+    for (size_t j = first + 1; j <= last; ++j) {
+        double x1 = m_positions.coord(traj[j], 0);
+        double y1 = m_positions.coord(traj[j], 1);
+        if (test(x0, y0, x1, y1)) return true;
+        x0 = x1;
+        y0 = y1;
+    }
+    return false;
+}
+
+size_t TrajectoryRTree::trajectoriesInBox(double min_x, double max_x,
+                                          double min_y, double max_y,
+                                          vector<uint32_t>& trajs) const {
+    trajs.clear();
+    RTreeBox box(min_x, max_x, min_y, max_y);
+    m_tree.search(box, [&](uint32_t piece) {
+        if (anySegment(piece, [&](double x0, double y0, double x1, double y1) {
+                return segmentIntersectsBox(x0, y0, x1, y1, box);
+            })) {
+            trajs.push_back(m_pieceTraj[piece]);
+        }
+    });
+    return uniqueIds(trajs);
+}
+
+size_t TrajectoryRTree::trajectoriesInPolygon(const PointSpans<double>& polygon,
+                                              vector<uint32_t>& trajs) const {
+    trajs.clear();
+    size_t n = polygon.size();
+    if (n < 3) return 0;
+
+    RTreeBox box;
+    for (size_t i = 0; i < n; ++i) {
+        box.expand(polygon.coord(i, 0), polygon.coord(i, 1));
+    }
+    // A segment meets the polygon if it has an end inside or crosses an edge
+    auto meets_polygon = [&](double x0, double y0, double x1, double y1) {
+        if (insidePolygon(polygon, x0, y0) || insidePolygon(polygon, x1, y1)) {
+            return true;
+        }
+        for (size_t i = 0, j = n - 1; i < n; j = i++) {
+            if (segmentsIntersect(x0, y0, x1, y1, polygon.coord(j, 0),
+                                  polygon.coord(j, 1), polygon.coord(i, 0),
+                                  polygon.coord(i, 1))) {
+                return true;
+            }
+        }
+        return false;
+    };
+    m_tree.search(box, [&](uint32_t piece) {
+        if (anySegment(piece, meets_polygon)) {
+            trajs.push_back(m_pieceTraj[piece]);
+        }
+    });
+    return uniqueIds(trajs);
+}
+
+size_t TrajectoryRTree::trajectoriesNearPolyline(
+    const PointSpans<double>& polyline, double distance,
+    vector<uint32_t>& trajs) const {
+    trajs.clear();
+    size_t n = polyline.size();
+    if (n == 0) return 0;
+
+    double sqr_distance = distance * distance;
+    for (size_t i = 0; i + 1 < std::max<size_t>(n, 2); ++i) {
+        size_t j = std::min(i + 1, n - 1);
+        double px0 = polyline.coord(i, 0), py0 = polyline.coord(i, 1);
+        double px1 = polyline.coord(j, 0), py1 = polyline.coord(j, 1);
+        RTreeBox box(std::min(px0, px1) - distance,
+                     std::max(px0, px1) + distance,
+                     std::min(py0, py1) - distance,
+                     std::max(py0, py1) + distance);
+        m_tree.search(box, [&](uint32_t piece) {
+            if (anySegment(piece, [&](double x0, double y0, double x1,
+                                      double y1) {
+                    return sqrDistanceBetweenSegments(x0, y0, x1, y1, px0, py0,
+                                                      px1, py1) <=
+                           sqr_distance;
+                })) {
+                trajs.push_back(m_pieceTraj[piece]);
+            }
+        });
+    }
+    return uniqueIds(trajs);
+}
+
+const size_t TrajectoryRTree::SEGMENTS_PER_PIECE;
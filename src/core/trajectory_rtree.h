@@ -0,0 +1,69 @@
+/*=====================================================================================
+                                trajectory_rtree.h
+
+    Description:  Trajectory-level queries on an R-tree of trajectory pieces
+
+        Every trajectory is cut into pieces of SEGMENTS_PER_PIECE segments
+        (consecutive pieces share their end sample). The bounding boxes of the
+        pieces are packed into an STR R-tree (see rtree.h). A query collects
+        the candidate pieces from the tree, refines only their segments
+        against the exact geometry and returns each matching trajectory once,
+        instead of every matching point.
+=====================================================================================*/
+
+#ifndef TRAJECTORY_RTREE_H_
+#define TRAJECTORY_RTREE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kdtree.h"
+#include "rtree.h"
+#include "trajectory_csr.h"
+
+using namespace std;
+
+class TrajectoryRTree {
+public:
+    TrajectoryRTree() : m_trajectories(nullptr) {}
+
+    // The columns are read in place and must outlive the tree
+    void build(const PointSpans<int32_t>& positions,
+               const TrajectoryCSR* trajectories, size_t num_threads = 0);
+    void clear();
+
+    size_t size() const { return m_pieceTraj.size(); }
+    bool empty() const { return m_pieceTraj.empty(); }
+
+    // Ids of the trajectories passing through a closed rectangle, sorted
+    size_t trajectoriesInBox(double min_x, double max_x, double min_y,
+                             double max_y, vector<uint32_t>& trajs) const;
+
+    // Ids of the trajectories passing through a simple polygon, sorted. The
+    // vertices are in order, without repeating the first one.
+    size_t trajectoriesInPolygon(const PointSpans<double>& polygon,
+                                 vector<uint32_t>& trajs) const;
+
+    // Ids of the trajectories within distance of a polyline, sorted
+    size_t trajectoriesNearPolyline(const PointSpans<double>& polyline,
+                                    double distance,
+                                    vector<uint32_t>& trajs) const;
+
+private:
+    static const size_t SEGMENTS_PER_PIECE = 8;
+
+    // Call test(x0, y0, x1, y1) on the segments of a piece until it returns
+    // true. A single sample trajectory is one degenerate segment.
+    template <class SegmentTest>
+    bool anySegment(uint32_t piece, SegmentTest test) const;
+
+    PointSpans<int32_t> m_positions;
+    const TrajectoryCSR* m_trajectories;
+
+    RTree m_tree;                  // entries are pieces
+    vector<uint32_t> m_pieceTraj;  // trajectory of each piece
+    vector<uint32_t> m_pieceFirst;  // its first sample in the trajectory
+};
+
+#endif /* end of include guard: TRAJECTORY_RTREE_H_ */
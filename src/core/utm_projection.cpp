@@ -0,0 +1,499 @@
+#include "utm_projection.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTM_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+
+// WGS84 ellipsoid and UTM constants
+static const double WGS84_A = 6378137.0;
+static const double WGS84_F = 1.0 / 298.257223563;
+static const double UTM_K0 = 0.9996;
+static const double UTM_FALSE_EASTING = 500000.0;
+static const double UTM_FALSE_NORTHING_SOUTH = 10000000.0;
+
+static const double UTM_PI = 3.14159265358979323846;
+static const double UTM_DEG_TO_RAD = UTM_PI / 180.0;
+static const double UTM_RAD_TO_DEG = 180.0 / UTM_PI;
+
+// Eccentricity
+static const double WGS84_E2 = WGS84_F * (2.0 - WGS84_F);
+static const double WGS84_E = std::sqrt(WGS84_E2);
+
+UtmProjection::UtmProjection()
+    : m_zone(0),
+      m_south(false),
+      m_lon0(0.0),
+      m_falseNorthing(0.0),
+      m_k0A(0.0) {
+    for (int i = 0; i < 6; ++i) {
+        m_alpha[i] = 0.0;
+        m_beta[i] = 0.0;
+    }
+}
+
+UtmProjection::UtmProjection(int zone, bool south) : UtmProjection() {
+    if (zone < 1 || zone > 60) {
+        return;
+    }
+    m_zone = zone;
+    m_south = south;
+    m_lon0 = zone * 6.0 - 183.0;
+    m_falseNorthing = south ? UTM_FALSE_NORTHING_SOUTH : 0.0;
+
+    // Series in the third flattening n, Karney (2011) eqs. (14), (35), (36)
+    double n = WGS84_F / (2.0 - WGS84_F);
+    double n2 = n * n, n3 = n2 * n, n4 = n3 * n, n5 = n4 * n, n6 = n5 * n;
+    double A = WGS84_A / (1.0 + n) *
+               (1.0 + n2 / 4.0 + n4 / 64.0 + n6 / 256.0);
+    m_k0A = UTM_K0 * A;
+
+    m_alpha[0] = n / 2.0 - 2.0 * n2 / 3.0 + 5.0 * n3 / 16.0 +
+                 41.0 * n4 / 180.0 - 127.0 * n5 / 288.0 +
+                 7891.0 * n6 / 37800.0;
+    m_alpha[1] = 13.0 * n2 / 48.0 - 3.0 * n3 / 5.0 + 557.0 * n4 / 1440.0 +
+                 281.0 * n5 / 630.0 - 1983433.0 * n6 / 1935360.0;
+    m_alpha[2] = 61.0 * n3 / 240.0 - 103.0 * n4 / 140.0 +
+                 15061.0 * n5 / 26880.0 + 167603.0 * n6 / 181440.0;
+    m_alpha[3] = 49561.0 * n4 / 161280.0 - 179.0 * n5 / 168.0 +
+                 6601661.0 * n6 / 7257600.0;
+    m_alpha[4] = 34729.0 * n5 / 80640.0 - 3418889.0 * n6 / 1995840.0;
+    m_alpha[5] = 212378941.0 * n6 / 319334400.0;
+
+    m_beta[0] = n / 2.0 - 2.0 * n2 / 3.0 + 37.0 * n3 / 96.0 - n4 / 360.0 -
+                81.0 * n5 / 512.0 + 96199.0 * n6 / 604800.0;
+    m_beta[1] = n2 / 48.0 + n3 / 15.0 - 437.0 * n4 / 1440.0 +
+                46.0 * n5 / 105.0 - 1118711.0 * n6 / 3870720.0;
+    m_beta[2] = 17.0 * n3 / 480.0 - 37.0 * n4 / 840.0 - 209.0 * n5 / 4480.0 +
+                5569.0 * n6 / 90720.0;
+    m_beta[3] = 4397.0 * n4 / 161280.0 - 11.0 * n5 / 504.0 -
+                830251.0 * n6 / 7257600.0;
+    m_beta[4] = 4583.0 * n5 / 161280.0 - 108847.0 * n6 / 3991680.0;
+    m_beta[5] = 20648693.0 * n6 / 638668800.0;
+}
+
+int UtmProjection::zoneFromLatLon(double lat, double lon) {
+    lon -= 360.0 * std::floor((lon + 180.0) / 360.0);  // [-180, 180)
+    int zone = static_cast<int>(std::floor((lon + 180.0) / 6.0)) + 1;
+    if (zone > 60) zone = 60;
+    if (zone < 1) zone = 1;
+
+    // Southwest Norway
+    if (lat >= 56.0 && lat < 64.0 && lon >= 3.0 && lon < 12.0) {
+        return 32;
+    }
+    // Svalbard
+    if (lat >= 72.0 && lat < 84.0 && lon >= 0.0 && lon < 42.0) {
+        if (lon < 9.0) return 31;
+        if (lon < 21.0) return 33;
+        if (lon < 33.0) return 35;
+        return 37;
+    }
+    return zone;
+}
+
+// Longitude relative to the central meridian, wrapped to [-180, 180]
+static inline double relativeLongitude(double lon, double lon0) {
+    double dlon = lon - lon0;
+    return dlon - 360.0 * std::round(dlon / 360.0);
+}
+
+// sum_{k=1..6} a[k-1] sin(k w), for the complex angle w given by sin(w) and
+// cos(w), evaluated with Clenshaw's recurrence
+static inline void clenshawSin(const double* a, double sin_r, double sin_i,
+                               double cos_r, double cos_i, double& sum_r,
+                               double& sum_i) {
+    double ar = 2.0 * cos_r, ai = 2.0 * cos_i;
+    double b1r = 0.0, b1i = 0.0, b2r = 0.0, b2i = 0.0;
+    for (int k = 5; k >= 0; --k) {
+        double br = a[k] + ar * b1r - ai * b1i - b2r;
+        double bi = ar * b1i + ai * b1r - b2i;
+        b2r = b1r;
+        b2i = b1i;
+        b1r = br;
+        b1i = bi;
+    }
+    sum_r = b1r * sin_r - b1i * sin_i;
+    sum_i = b1r * sin_i + b1i * sin_r;
+}
+
+/*=====================================================================================
+        Forward projection
+
+        With T = tan(chi) cos(phi), chi the conformal latitude, and
+        C = cos(lambda) cos(phi), the conformal sphere coordinates are
+            xi'  = atan2(T, C)
+            eta' = atanh(u),  u = sin(lambda) cos(phi) / sqrt(cos^2(phi) + T^2)
+        and sin / cos of 2 xi', sinh / cosh of 2 eta' follow algebraically,
+        so that a point costs two sincos, one atan2 and one log. Multiplying
+        through by cos(phi) keeps everything finite at the poles.
+=====================================================================================*/
+void UtmProjection::forward(size_t n, const double* lat, const double* lon,
+                            double* x, double* y) const {
+#if defined(__x86_64__) || defined(__i386__)
+    if (hasSimdKernel()) {
+        forwardAVX2(n, lat, lon, x, y);
+        return;
+    }
+#endif
+    forwardScalar(n, lat, lon, x, y);
+}
+
+void UtmProjection::forwardScalar(size_t n, const double* lat,
+                                  const double* lon, double* x,
+                                  double* y) const {
+    for (size_t i = 0; i < n; ++i) {
+        double phi = lat[i] * UTM_DEG_TO_RAD;
+        double lambda = relativeLongitude(lon[i], m_lon0) * UTM_DEG_TO_RAD;
+        double sin_phi = std::sin(phi), cos_phi = std::cos(phi);
+        double sin_lambda = std::sin(lambda), cos_lambda = std::cos(lambda);
+
+        double sigma = std::sinh(WGS84_E * std::atanh(WGS84_E * sin_phi));
+        double T = sin_phi * std::sqrt(1.0 + sigma * sigma) - sigma;
+        double C = cos_lambda * cos_phi;
+
+        double xip = std::atan2(T, C);
+        double u = sin_lambda * cos_phi / std::sqrt(cos_phi * cos_phi + T * T);
+        double etap = std::atanh(u);
+
+        double r2 = T * T + C * C;
+        double sin_2xi = 2.0 * T * C / r2;
+        double cos_2xi = (C * C - T * T) / r2;
+        double d = 1.0 - u * u;
+        double cosh_2eta = (1.0 + u * u) / d;
+        double sinh_2eta = 2.0 * u / d;
+
+        double sum_r, sum_i;
+        clenshawSin(m_alpha, sin_2xi * cosh_2eta, cos_2xi * sinh_2eta,
+                    cos_2xi * cosh_2eta, -sin_2xi * sinh_2eta, sum_r, sum_i);
+
+        x[i] = UTM_FALSE_EASTING + m_k0A * (etap + sum_i);
+        y[i] = m_falseNorthing + m_k0A * (xip + sum_r);
+    }
+}
+
+/*=====================================================================================
+        Inverse projection
+
+        Reverses the series, then solves tan(phi) from tan(chi) with Newton's
+        method (Karney 2011, eqs. (19) - (21)). Not on any hot path, so it uses
+        the C math library.
+=====================================================================================*/
+void UtmProjection::inverse(size_t n, const double* x, const double* y,
+                            double* lat, double* lon) const {
+    const double e2m = 1.0 - WGS84_E2;
+    for (size_t i = 0; i < n; ++i) {
+        double xi = (y[i] - m_falseNorthing) / m_k0A;
+        double eta = (x[i] - UTM_FALSE_EASTING) / m_k0A;
+
+        double sin_2xi = std::sin(2.0 * xi), cos_2xi = std::cos(2.0 * xi);
+        double sinh_2eta = std::sinh(2.0 * eta);
+        double cosh_2eta = std::cosh(2.0 * eta);
+        double sum_r, sum_i;
+        clenshawSin(m_beta, sin_2xi * cosh_2eta, cos_2xi * sinh_2eta,
+                    cos_2xi * cosh_2eta, -sin_2xi * sinh_2eta, sum_r, sum_i);
+        double xip = xi - sum_r;
+        double etap = eta - sum_i;
+
+        double sinh_etap = std::sinh(etap);
+        double cos_xip = std::cos(xip);
+        double taup = std::sin(xip) / std::hypot(sinh_etap, cos_xip);
+        double lambda = std::atan2(sinh_etap, cos_xip);
+
+        // Newton iterations on tau = tan(phi)
+        double tau = taup;
+        for (int iter = 0; iter < 5; ++iter) {
+            double tau1 = std::sqrt(1.0 + tau * tau);
+            double sigma =
+                std::sinh(WGS84_E * std::atanh(WGS84_E * tau / tau1));
+            double taupi = tau * std::sqrt(1.0 + sigma * sigma) - sigma * tau1;
+            double dtau = (taup - taupi) / std::sqrt(1.0 + taupi * taupi) *
+                          (1.0 + e2m * tau * tau) / (e2m * tau1);
+            tau += dtau;
+            if (std::fabs(dtau) < 1e-14 * std::max(1.0, std::fabs(tau))) {
+                break;
+            }
+        }
+
+        double out_lon = m_lon0 + lambda * UTM_RAD_TO_DEG;
+        lat[i] = std::atan(tau) * UTM_RAD_TO_DEG;
+        lon[i] = out_lon - 360.0 * std::round(out_lon / 360.0);
+    }
+}
+
+/*=====================================================================================
+        AVX2 kernel
+
+        Four points per iteration. sincos, atan2 and log are evaluated with
+        range reduction and truncated Taylor series, accurate to a few 1e-16
+        in absolute terms, i.e. nanometres once scaled by k0 * A.
+=====================================================================================*/
+#if defined(__x86_64__) || defined(__i386__)
+
+bool UtmProjection::hasSimdKernel() {
+    static const bool supported =
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+}
+
+// Horner evaluation of c[0] + c[1] z + ... + c[N - 1] z^(N - 1)
+template <int N>
+UTM_AVX2_TARGET static inline __m256d polyAVX2(__m256d z, const double* c) {
+    __m256d p = _mm256_set1_pd(c[N - 1]);
+    for (int k = N - 2; k >= 0; --k) {
+        p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(c[k]));
+    }
+    return p;
+}
+
+// (-1)^k / (2k + 1)!
+static const double SIN_COEFFS[9] = {
+    1.0,
+    -1.0 / 6.0,
+    1.0 / 120.0,
+    -1.0 / 5040.0,
+    1.0 / 362880.0,
+    -1.0 / 39916800.0,
+    1.0 / 6227020800.0,
+    -1.0 / 1307674368000.0,
+    1.0 / 355687428096000.0};
+// (-1)^k / (2k)!
+static const double COS_COEFFS[9] = {
+    1.0,
+    -1.0 / 2.0,
+    1.0 / 24.0,
+    -1.0 / 720.0,
+    1.0 / 40320.0,
+    -1.0 / 3628800.0,
+    1.0 / 479001600.0,
+    -1.0 / 87178291200.0,
+    1.0 / 20922789888000.0};
+
+// sin and cos of |x| <= pi (the inputs are latitudes and wrapped longitudes)
+UTM_AVX2_TARGET static inline void sincosAVX2(__m256d x, __m256d& s,
+                                              __m256d& c) {
+    const __m256d pio2_hi = _mm256_set1_pd(1.5707963267948966);
+    const __m256d pio2_lo = _mm256_set1_pd(6.123233995736766e-17);
+    __m256d q = _mm256_round_pd(
+        _mm256_mul_pd(x, _mm256_set1_pd(2.0 / UTM_PI)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(q, pio2_hi, x);
+    r = _mm256_fnmadd_pd(q, pio2_lo, r);
+
+    __m256d r2 = _mm256_mul_pd(r, r);
+    __m256d sin_r = _mm256_mul_pd(r, polyAVX2<9>(r2, SIN_COEFFS));
+    __m256d cos_r = polyAVX2<9>(r2, COS_COEFFS);
+
+    // Quadrant q mod 4: swap sin / cos on odd quadrants, then fix the signs
+    __m256i qi = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(q));
+    __m256i one = _mm256_set1_epi64x(1);
+    __m256i two = _mm256_set1_epi64x(2);
+    __m256d swap = _mm256_castsi256_pd(
+        _mm256_cmpeq_epi64(_mm256_and_si256(qi, one), one));
+    __m256d sin_sign = _mm256_castsi256_pd(
+        _mm256_slli_epi64(_mm256_and_si256(qi, two), 62));
+    __m256d cos_sign = _mm256_castsi256_pd(_mm256_slli_epi64(
+        _mm256_and_si256(_mm256_add_epi64(qi, one), two), 62));
+    s = _mm256_xor_pd(_mm256_blendv_pd(sin_r, cos_r, swap), sin_sign);
+    c = _mm256_xor_pd(_mm256_blendv_pd(cos_r, sin_r, swap), cos_sign);
+}
+
+// (-1)^k / (2k + 1)
+static const double ATAN_COEFFS[12] = {
+    1.0,         -1.0 / 3.0,  1.0 / 5.0,   -1.0 / 7.0,
+    1.0 / 9.0,   -1.0 / 11.0, 1.0 / 13.0,  -1.0 / 15.0,
+    1.0 / 17.0,  -1.0 / 19.0, 1.0 / 21.0,  -1.0 / 23.0};
+
+UTM_AVX2_TARGET static inline __m256d atan2AVX2(__m256d y, __m256d x) {
+    const __m256d sign_mask = _mm256_set1_pd(-0.0);
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256d ay = _mm256_andnot_pd(sign_mask, y);
+    __m256d ax = _mm256_andnot_pd(sign_mask, x);
+    __m256d mn = _mm256_min_pd(ay, ax);
+    __m256d mx = _mm256_max_pd(ay, ax);
+
+    // z in [0, 1], 0 / 0 -> 0
+    __m256d z = _mm256_div_pd(mn, mx);
+    z = _mm256_and_pd(
+        z, _mm256_cmp_pd(mx, _mm256_setzero_pd(), _CMP_GT_OQ));
+
+    // atan(z) = 2 atan(z / (1 + sqrt(1 + z^2))), applied twice: z <= 0.2
+    for (int k = 0; k < 2; ++k) {
+        z = _mm256_div_pd(
+            z, _mm256_add_pd(one, _mm256_sqrt_pd(_mm256_fmadd_pd(z, z, one))));
+    }
+    __m256d a = _mm256_mul_pd(
+        _mm256_mul_pd(_mm256_set1_pd(4.0), z),
+        polyAVX2<12>(_mm256_mul_pd(z, z), ATAN_COEFFS));
+
+    // Back to the full circle
+    a = _mm256_blendv_pd(a, _mm256_sub_pd(_mm256_set1_pd(UTM_PI / 2.0), a),
+                         _mm256_cmp_pd(ay, ax, _CMP_GT_OQ));
+    a = _mm256_blendv_pd(a, _mm256_sub_pd(_mm256_set1_pd(UTM_PI), a), x);
+    return _mm256_or_pd(a, _mm256_and_pd(y, sign_mask));
+}
+
+// 1 / (2k + 1)
+static const double LOG_COEFFS[11] = {
+    1.0,        1.0 / 3.0,  1.0 / 5.0,  1.0 / 7.0,  1.0 / 9.0, 1.0 / 11.0,
+    1.0 / 13.0, 1.0 / 15.0, 1.0 / 17.0, 1.0 / 19.0, 1.0 / 21.0};
+
+// Natural logarithm of positive, normal x
+UTM_AVX2_TARGET static inline __m256d logAVX2(__m256d x) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two52 = _mm256_set1_pd(4503599627370496.0);
+    __m256i bits = _mm256_castpd_si256(x);
+
+    // x = m 2^e with m in [1, 2)
+    __m256i exponent_bits = _mm256_srli_epi64(bits, 52);
+    __m256d e = _mm256_sub_pd(
+        _mm256_castsi256_pd(
+            _mm256_or_si256(exponent_bits, _mm256_castpd_si256(two52))),
+        two52);
+    e = _mm256_sub_pd(e, _mm256_set1_pd(1023.0));
+    __m256d m = _mm256_castsi256_pd(_mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffLL)),
+        _mm256_castpd_si256(one)));
+
+    // Bring m to [sqrt(1/2), sqrt(2))
+    __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(1.4142135623730951),
+                                _CMP_GE_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+    e = _mm256_add_pd(e, _mm256_and_pd(big, one));
+
+    // log(m) = 2 atanh(s), s = (m - 1) / (m + 1), |s| <= 0.172
+    __m256d s = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+    __m256d log_m = _mm256_mul_pd(
+        _mm256_add_pd(s, s), polyAVX2<11>(_mm256_mul_pd(s, s), LOG_COEFFS));
+    return _mm256_fmadd_pd(e, _mm256_set1_pd(0.6931471805599453), log_m);
+}
+
+// 1 / (2k + 1), for atanh(e sin(phi)) with e sin(phi) <= 0.082
+static const double ATANH_SMALL_COEFFS[7] = {
+    1.0, 1.0 / 3.0, 1.0 / 5.0, 1.0 / 7.0, 1.0 / 9.0, 1.0 / 11.0, 1.0 / 13.0};
+// 1 / (2k + 1)!, for sinh(e atanh(e sin(phi))) with an argument <= 0.007
+static const double SINH_SMALL_COEFFS[4] = {1.0, 1.0 / 6.0, 1.0 / 120.0,
+                                            1.0 / 5040.0};
+
+UTM_AVX2_TARGET static inline void forwardKernelAVX2(
+    __m256d lat, __m256d lon, __m256d lon0, const double* alpha,
+    __m256d k0A, __m256d false_northing, __m256d& x, __m256d& y) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d deg_to_rad = _mm256_set1_pd(UTM_DEG_TO_RAD);
+    const __m256d e = _mm256_set1_pd(WGS84_E);
+
+    __m256d dlon = _mm256_sub_pd(lon, lon0);
+    dlon = _mm256_fnmadd_pd(
+        _mm256_set1_pd(360.0),
+        _mm256_round_pd(_mm256_mul_pd(dlon, _mm256_set1_pd(1.0 / 360.0)),
+                        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+        dlon);
+
+    __m256d sin_phi, cos_phi, sin_lambda, cos_lambda;
+    sincosAVX2(_mm256_mul_pd(lat, deg_to_rad), sin_phi, cos_phi);
+    sincosAVX2(_mm256_mul_pd(dlon, deg_to_rad), sin_lambda, cos_lambda);
+
+    // sigma = sinh(e atanh(e sin(phi)))
+    __m256d z = _mm256_mul_pd(e, sin_phi);
+    __m256d v = _mm256_mul_pd(
+        _mm256_mul_pd(e, z),
+        polyAVX2<7>(_mm256_mul_pd(z, z), ATANH_SMALL_COEFFS));
+    __m256d sigma =
+        _mm256_mul_pd(v, polyAVX2<4>(_mm256_mul_pd(v, v), SINH_SMALL_COEFFS));
+
+    __m256d T = _mm256_fmsub_pd(
+        sin_phi, _mm256_sqrt_pd(_mm256_fmadd_pd(sigma, sigma, one)), sigma);
+    __m256d C = _mm256_mul_pd(cos_lambda, cos_phi);
+    __m256d TT = _mm256_mul_pd(T, T);
+    __m256d CC = _mm256_mul_pd(C, C);
+
+    __m256d xip = atan2AVX2(T, C);
+    __m256d u = _mm256_div_pd(
+        _mm256_mul_pd(sin_lambda, cos_phi),
+        _mm256_sqrt_pd(_mm256_fmadd_pd(cos_phi, cos_phi, TT)));
+    __m256d etap = _mm256_mul_pd(
+        _mm256_set1_pd(0.5),
+        logAVX2(_mm256_div_pd(_mm256_add_pd(one, u), _mm256_sub_pd(one, u))));
+
+    __m256d inv_r2 = _mm256_div_pd(one, _mm256_add_pd(TT, CC));
+    __m256d sin_2xi = _mm256_mul_pd(_mm256_mul_pd(two, T),
+                                    _mm256_mul_pd(C, inv_r2));
+    __m256d cos_2xi = _mm256_mul_pd(_mm256_sub_pd(CC, TT), inv_r2);
+    __m256d uu = _mm256_mul_pd(u, u);
+    __m256d inv_d = _mm256_div_pd(one, _mm256_sub_pd(one, uu));
+    __m256d cosh_2eta = _mm256_mul_pd(_mm256_add_pd(one, uu), inv_d);
+    __m256d sinh_2eta = _mm256_mul_pd(_mm256_mul_pd(two, u), inv_d);
+
+    // Clenshaw summation of sum_k alpha_k sin(2k zeta), in complex numbers
+    __m256d sin_r = _mm256_mul_pd(sin_2xi, cosh_2eta);
+    __m256d sin_i = _mm256_mul_pd(cos_2xi, sinh_2eta);
+    __m256d ar = _mm256_mul_pd(two, _mm256_mul_pd(cos_2xi, cosh_2eta));
+    __m256d ai = _mm256_mul_pd(_mm256_set1_pd(-2.0),
+                               _mm256_mul_pd(sin_2xi, sinh_2eta));
+    __m256d b1r = _mm256_setzero_pd(), b1i = _mm256_setzero_pd();
+    __m256d b2r = _mm256_setzero_pd(), b2i = _mm256_setzero_pd();
+    for (int k = 5; k >= 0; --k) {
+        __m256d br = _mm256_add_pd(
+            _mm256_set1_pd(alpha[k]),
+            _mm256_sub_pd(_mm256_fmsub_pd(ar, b1r, _mm256_mul_pd(ai, b1i)),
+                          b2r));
+        __m256d bi = _mm256_sub_pd(
+            _mm256_fmadd_pd(ar, b1i, _mm256_mul_pd(ai, b1r)), b2i);
+        b2r = b1r;
+        b2i = b1i;
+        b1r = br;
+        b1i = bi;
+    }
+    __m256d sum_r = _mm256_fmsub_pd(b1r, sin_r, _mm256_mul_pd(b1i, sin_i));
+    __m256d sum_i = _mm256_fmadd_pd(b1r, sin_i, _mm256_mul_pd(b1i, sin_r));
+
+    x = _mm256_fmadd_pd(k0A, _mm256_add_pd(etap, sum_i),
+                        _mm256_set1_pd(UTM_FALSE_EASTING));
+    y = _mm256_fmadd_pd(k0A, _mm256_add_pd(xip, sum_r), false_northing);
+}
+
+UTM_AVX2_TARGET void UtmProjection::forwardAVX2(size_t n, const double* lat,
+                                                const double* lon, double* x,
+                                                double* y) const {
+    __m256d lon0 = _mm256_set1_pd(m_lon0);
+    __m256d k0A = _mm256_set1_pd(m_k0A);
+    __m256d false_northing = _mm256_set1_pd(m_falseNorthing);
+    __m256d out_x, out_y;
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        forwardKernelAVX2(_mm256_loadu_pd(lat + i), _mm256_loadu_pd(lon + i),
+                          lon0, m_alpha, k0A, false_northing, out_x, out_y);
+        _mm256_storeu_pd(x + i, out_x);
+        _mm256_storeu_pd(y + i, out_y);
+    }
+
+    // Pad the tail so that every point goes through the same kernel
+    if (i < n) {
+        double tail_lat[4] = {0.0, 0.0, 0.0, 0.0};
+        double tail_lon[4] = {m_lon0, m_lon0, m_lon0, m_lon0};
+        double tail_x[4], tail_y[4];
+        for (size_t j = 0; i + j < n; ++j) {
+            tail_lat[j] = lat[i + j];
+            tail_lon[j] = lon[i + j];
+        }
+        forwardKernelAVX2(_mm256_loadu_pd(tail_lat), _mm256_loadu_pd(tail_lon),
+                          lon0, m_alpha, k0A, false_northing, out_x, out_y);
+        _mm256_storeu_pd(tail_x, out_x);
+        _mm256_storeu_pd(tail_y, out_y);
+        for (size_t j = 0; i + j < n; ++j) {
+            x[i + j] = tail_x[j];
+            y[i + j] = tail_y[j];
+        }
+    }
+}
+
+#else
+
+bool UtmProjection::hasSimdKernel() { return false; }
+
+#endif
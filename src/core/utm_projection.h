@@ -0,0 +1,64 @@
+/*=====================================================================================
+                                utm_projection.h
+
+    Description:  Native UTM (transverse Mercator, WGS84) projection
+
+        Implements the Krueger series to sixth order in the third flattening
+        (Karney, "Transverse Mercator with an accuracy of a few nanometers",
+        J. Geodesy 85, 2011), which is accurate to well below a millimetre
+        over a UTM zone. The forward projection of batches runs four points
+        at a time with AVX2 when the CPU supports it, and falls back to a
+        scalar implementation otherwise.
+=====================================================================================*/
+
+#ifndef UTM_PROJECTION_H_
+#define UTM_PROJECTION_H_
+
+#include <cstddef>
+
+class UtmProjection {
+public:
+    // Invalid projection (zone 0), see isValid()
+    UtmProjection();
+    UtmProjection(int zone, bool south);
+
+    bool isValid() const { return m_zone > 0; }
+    int zone() const { return m_zone; }
+    bool isSouth() const { return m_south; }
+    // Central meridian of the zone, in degrees
+    double centralMeridian() const { return m_lon0; }
+
+    // UTM zone containing (lat, lon), in degrees, including the Norway and
+    // Svalbard exceptions
+    static int zoneFromLatLon(double lat, double lon);
+
+    // lat / lon in degrees to easting / northing in meters. The outputs may
+    // alias the inputs (e.g. x == lon and y == lat).
+    void forward(size_t n, const double* lat, const double* lon, double* x,
+                 double* y) const;
+    // easting / northing in meters to lat / lon in degrees. The outputs may
+    // alias the inputs.
+    void inverse(size_t n, const double* x, const double* y, double* lat,
+                 double* lon) const;
+
+    // True if forward() uses the AVX2 kernel on this machine
+    static bool hasSimdKernel();
+
+private:
+    void forwardScalar(size_t n, const double* lat, const double* lon,
+                       double* x, double* y) const;
+#if defined(__x86_64__) || defined(__i386__)
+    void forwardAVX2(size_t n, const double* lat, const double* lon,
+                     double* x, double* y) const;
+#endif
+
+    int m_zone;
+    bool m_south;
+    double m_lon0;           // central meridian, degrees
+    double m_falseNorthing;  // 0 or 1e7 meters
+    double m_k0A;            // scale factor times rectifying radius
+    double m_alpha[6];       // forward series coefficients
+    double m_beta[6];        // inverse series coefficients
+};
+
+#endif /* end of include guard: UTM_PROJECTION_H_ */
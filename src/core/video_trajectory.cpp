@@ -45,24 +45,35 @@ bool VideoTrajectory::load(const string& filename) {
         new_pt.altitude = std::stof(res[5]);
         new_pt.hAccuracy = std::stof(res[6]);
         new_pt.vAccuracy = std::stof(res[7]);
-        float easting, northing;
-        latlon_converter.convertLatLonToXY(new_pt.latitude, new_pt.longitude,
-                                           easting, northing);
-        new_pt.easting = easting;
-        new_pt.northing = northing;
-        if (m_boundBox[0] > easting) {
-            m_boundBox[0] = easting;
+        m_gpsPoints.push_back(new_pt);
+    }
+
+    // Project all points at once, selecting the UTM zone from their centroid
+    // if the scene has none yet
+    size_t n_pt = m_gpsPoints.size();
+    vector<double> lat(n_pt), lon(n_pt);
+    vector<float> easting(n_pt), northing(n_pt);
+    for (size_t i = 0; i < n_pt; ++i) {
+        lat[i] = m_gpsPoints[i].latitude;
+        lon[i] = m_gpsPoints[i].longitude;
+    }
+    latlon_converter.convertLatLonToXY(n_pt, lat.data(), lon.data(),
+                                       easting.data(), northing.data());
+    for (size_t i = 0; i < n_pt; ++i) {
+        m_gpsPoints[i].easting = easting[i];
+        m_gpsPoints[i].northing = northing[i];
+        if (m_boundBox[0] > easting[i]) {
+            m_boundBox[0] = easting[i];
         }
-        if (m_boundBox[1] < easting) {
-            m_boundBox[1] = easting;
+        if (m_boundBox[1] < easting[i]) {
+            m_boundBox[1] = easting[i];
         }
-        if (m_boundBox[2] > northing) {
-            m_boundBox[2] = northing;
+        if (m_boundBox[2] > northing[i]) {
+            m_boundBox[2] = northing[i];
         }
-        if (m_boundBox[3] < northing) {
-            m_boundBox[3] = northing;
+        if (m_boundBox[3] < northing[i]) {
+            m_boundBox[3] = northing[i];
         }
-        m_gpsPoints.push_back(new_pt);
     }
     printf(
         "Loading complete from file %s.\n\tThere are %lu points in "
@@ -90,7 +90,8 @@ void SceneWidget::slotLoadOpenStreetMap() {
     m_openingFile = true;
     QString filename = QFileDialog::getOpenFileName(
         &MainWindow::getInstance(), "Load OpenStreetMap from file",
-        defaultOSMDir.c_str(), tr("OpenStreetMap (*.osm)"));
+        defaultOSMDir.c_str(),
+        tr("OpenStreetMap (*.osm *.osm.pbf *.pbf *.osm.gz *.osm.bz2)"));
     if (filename.isEmpty()) return;
 
     if (m_scene->m_osmMap->load(filename.toStdString())) {